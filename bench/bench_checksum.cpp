@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "checksum.hpp"
+
+// throughput of the xxHash64 of the verifier, on random data in memory. bench_checksum_scalar
+// is the same without the vector lanes: both must print the same hashes.
+//   bench_checksum [-m MB] [-r rounds]
+
+static void usage() {
+    fprintf(stderr, "usage: bench_checksum [-m MB] [-r rounds]\n");
+    exit(2);
+}
+
+static double nowSec() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+int main(int argc, char **argv) {
+    unsigned int size = 16; // MB
+    unsigned int rounds = 20;
+    int option;
+    while((option = getopt(argc, argv, "m:r:")) != -1) {
+        switch(option) {
+            case 'm':
+                size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+        }
+    }
+    std::vector<unsigned char> data((size_t)size << 20);
+    srand(1);
+    for(unsigned char &byte : data) {
+        byte = rand();
+    }
+
+    //the pieces of a read loop: odd lengths and offsets, as the stripes straddle them
+    uint64_t pieces = 0;
+    for(unsigned int i = 0; i < 1000; i++) {
+        size_t length = rand() % 5000;
+        size_t offset = rand() % 64;
+        Checksum checksum(i);
+        for(size_t done = 0, step; done < length; done += step) {
+            step = 1 + rand() % 100;
+            if(step > length - done) {
+                step = length - done;
+            }
+            checksum.update(data.data() + offset + done, step);
+        }
+        if(checksum.digest() != Checksum::hash(data.data() + offset, length, i)) {
+            printf("the hash of %u bytes depends on its pieces\n", (unsigned int)length);
+            return 1;
+        }
+        pieces = pieces * 31 + checksum.digest();
+    }
+
+    uint64_t hash = 0;
+    double start = nowSec();
+    for(unsigned int i = 0; i < rounds; i++) {
+        hash ^= Checksum::hash(data.data(), data.size(), i);
+    }
+    double elapsed = nowSec() - start;
+    printf("hashes %016llx %016llx, %.0f MB/s\n", (unsigned long long)pieces, (unsigned long long)hash,
+        (double)size * rounds / elapsed);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "log.hpp"
+#include "ingest.hpp"
+#include "ingest_scan.hpp"
+#include "ingest_filter.hpp"
+
+// copies a volume mounted on /media/<label> to the big disk as the daemon does, and reports
+// the throughput. The page cache is dropped first when run as root, so the volume is read
+// from its device. The big disk should be empty, else its indexes skip the files copied
+// before. ingest.sh makes the loop devices.
+//   bench_ingest label [-q queue depth] [-f] [-p]
+//     -f for a volume which numbers its inodes at mount (fat)
+//     -p as if the music played from the big disk: the copy is throttled
+
+static void usage() {
+    fprintf(stderr, "usage: bench_ingest label [-q queue depth] [-f] [-p]\n");
+    exit(2);
+}
+
+static double nowSec() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+// the block device of the big disk, as the daemon gets it from udev
+static std::string getBigDiskDevice() {
+    struct stat info;
+    if(stat("/media/" BIG_DISK_NAME, &info) != 0) {
+        return "";
+    }
+    char link[64];
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(info.st_dev), minor(info.st_dev));
+    char *path = realpath(link, NULL);
+    if(path == NULL) {
+        return "";
+    }
+    std::string sysname = strrchr(path, '/') + 1;
+    free(path);
+    return sysname;
+}
+
+static void dropCaches() {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if((fd == -1) || (write(fd, "3", 1) != 1)) {
+        printf("the page cache is kept, the volume may be read from memory\n");
+    }
+    if(fd != -1) {
+        close(fd);
+    }
+}
+
+int main(int argc, char **argv) {
+    if((argc < 2) || (argv[1][0] == '-')) {
+        usage();
+    }
+    IngestVolume volume;
+    volume.label = argv[1];
+    volume.queueDepth = INGEST_QUEUE_DEPTH;
+    volume.stableInodes = true;
+    volume.order = INGEST_ORDER;
+    bool playing = false;
+    int option;
+    optind = 2;
+    while((option = getopt(argc, argv, "q:fp")) != -1) {
+        switch(option) {
+            case 'q':
+                volume.queueDepth = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                volume.stableInodes = false;
+                break;
+            case 'p':
+                playing = true;
+                break;
+            default:
+                usage();
+        }
+    }
+    initLog(false);
+
+    static const char* rules[] = INGEST_FILTER;
+    IngestFilter filter;
+    filter.compile(std::vector<std::string>(rules, rules + sizeof(rules)/sizeof(const char*)));
+    std::vector<std::string> dirs;
+    std::vector<IngestFile> files;
+    if(!scanVolume("/media/" + volume.label, filter, dirs, files)) {
+        fprintf(stderr, "unable to scan /media/%s\n", volume.label.c_str());
+        return 1;
+    }
+    uint64_t bytes = 0;
+    for(const IngestFile &file : files) {
+        bytes += file.size;
+    }
+    dropCaches();
+
+    Ingest ingest;
+    if(playing) {
+        ingest.setMusicDevice(getBigDiskDevice());
+        ingest.setPlaying(true);
+    }
+    double start = nowSec();
+    if(!ingest.start(volume)) {
+        return 1;
+    }
+    char msg = Ingest::PROGRESS;
+    while((msg != Ingest::DONE) && (msg != Ingest::FAILED) && (msg != Ingest::NO_SPACE)) {
+        pollfd fd;
+        fd.fd = ingest.getPipe().getReadFd();
+        fd.events = POLLIN;
+        fd.revents = 0;
+        if(poll(&fd, 1, -1) > 0) {
+            msg = ingest.getPipe().read();
+        }
+    }
+    double elapsed = nowSec() - start;
+    std::list<std::string> finished;
+    std::list<std::string> refused;
+    ingest.collectFinished(finished, refused);
+    printf("%s: %u files, %u folders, %.1f MB in %.2f s: %.1f MB/s, %.0f files/s%s\n", volume.label.c_str(),
+        (unsigned int)files.size(), (unsigned int)dirs.size(), bytes / 1048576.0, elapsed, bytes / 1048576.0 / elapsed,
+        files.size() / elapsed, (msg == Ingest::DONE) ? "" : ", FAILED");
+    if(playing) {
+        printf("throttle level %u at the end, %.1f MB/s on the last period\n", ingest.getThrottleLevel(), ingest.getThroughput() / 1048576.0);
+    }
+    return (msg == Ingest::DONE) ? 0 : 1;
+}
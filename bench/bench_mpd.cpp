@@ -0,0 +1,411 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "log.hpp"
+#include "mpd.hpp"
+#include "fake_mpd.hpp"
+
+// the real Mpd class against the fake MPD, which takes the socket of MPD_SOCKET: not to be
+// run beside a real MPD. The logs of the client go to syslog, the measures to stdout.
+//   bench_mpd roundtrip [-n presses] [-d server delay usec] [-f failures]
+//     latency from a press to its command on the server, and to the client back in idle,
+//     then the presses per second the client gets through when they come back to back
+//   bench_mpd press [-n presses] [-d server delay usec]
+//     a test: each press made while the client waits in idle must reach the server, as its
+//     noidle then its command, within PRESS_MAX_LATENCY. The exit status is 1 otherwise
+//   bench_mpd skip [-n skips] [-m folder] [-s song MB]
+//     time from a next to the head of its song read by the server, as MPD opens and buffers
+//     it, with the page cache of the songs dropped: once with the read ahead of the client,
+//     once with the pages dropped again just before the press. The songs are written in
+//     the folder, relative to MPD_MUSIC_DIR, on the disk to measure
+
+#define SONGS           20
+#define CONNECT_TIMEOUT 5000000
+#define PRESS_TIMEOUT   2000000
+#define SETTLE_TIME     20000   // after a press, so the refresh of its status is over
+#define BURST_TIME      2000000
+#define PRESS_MAX_LATENCY 5000  // usec
+#define WARM_TIME       1000000 // given to the read ahead after a skip
+#define SKIP_READ       (512*1024) // bytes read by the server at the start of a song
+
+struct Options {
+    unsigned int presses;
+    unsigned int delay;
+    unsigned int failures;
+    std::string folder;
+    unsigned int songSize; // MB
+};
+
+static void usage() {
+    fprintf(stderr, "usage: bench_mpd roundtrip [-n presses] [-d server delay usec] [-f failures]\n"
+                    "       bench_mpd press [-n presses] [-d server delay usec]\n"
+                    "       bench_mpd skip [-n skips] [-m folder] [-s song MB]\n");
+    exit(2);
+}
+
+static void printStats(const char *name, std::vector<uint64_t> &usecs) {
+    if(usecs.empty()) {
+        printf("%-16s no measure\n", name);
+        return;
+    }
+    std::sort(usecs.begin(), usecs.end());
+    printf("%-16s min %7.3f ms  median %7.3f ms  p99 %7.3f ms  max %7.3f ms\n", name, usecs.front() / 1000.0,
+        usecs[usecs.size() / 2] / 1000.0, usecs[usecs.size() * 99 / 100] / 1000.0, usecs.back() / 1000.0);
+}
+
+// the loop of the daemon, until done or the timeout
+static bool runUntil(Mpd &mpd, const std::function<bool()> &done, uint64_t timeout) {
+    uint64_t end = FakeMpd::nowUsec() + timeout;
+    while(!done()) {
+        uint64_t now = FakeMpd::nowUsec();
+        if(now >= end) {
+            return false;
+        }
+        pollfd fds[2];
+        fds[0].fd = mpd.getFd();
+        fds[1].fd = mpd.getEventPipe().getReadFd();
+        for(pollfd &fd : fds) {
+            fd.events = POLLIN;
+            fd.revents = 0;
+        }
+        poll(fds, 2, std::min((end - now) / 1000 + 1, (uint64_t)10));
+        if(fds[0].revents != 0) {
+            mpd.manageEvents();
+        }
+        if(fds[1].revents != 0) {
+            mpd.getEventPipe().read();
+        }
+    }
+    return true;
+}
+
+// the buttons in turn: next, prev, and the pause every third press
+static void press(Mpd &mpd, unsigned int index, bool withPause) {
+    if(withPause && (index % 3 == 2)) {
+        mpd.playOrPause();
+    }
+    else if(index % 2 == 0) {
+        mpd.next();
+    }
+    else {
+        mpd.prev();
+    }
+}
+
+// what the server saw, written by its thread
+struct Seen {
+    std::atomic<uint64_t> idleAt; // last time the client entered idle
+    std::atomic<uint64_t> noidleAt;
+    std::atomic<uint64_t> commandAt; // last press received
+    std::atomic<unsigned int> commands;
+};
+
+static std::vector<std::string> getSongs() {
+    std::vector<std::string> songs;
+    for(unsigned int i = 0; i < SONGS; i++) {
+        songs.push_back("bench/song" + std::to_string(i) + ".mp3");
+    }
+    return songs;
+}
+
+static bool start(FakeMpd &server, Seen &seen) {
+    seen.idleAt = 0;
+    seen.noidleAt = 0;
+    seen.commandAt = 0;
+    seen.commands = 0;
+    server.setListener([&seen](const std::string &command, uint64_t at) {
+        if(command == "idle") {
+            seen.idleAt = at;
+        }
+        else if(command == "noidle") {
+            seen.noidleAt = at;
+        }
+        else if((command.compare(0, 7, "playid ") == 0) || (command.compare(0, 6, "pause ") == 0)) {
+            seen.commandAt = at;
+            ++seen.commands;
+        }
+    });
+    return server.start();
+}
+
+static bool waitConnected(Mpd &mpd, Seen &seen) {
+    if(!runUntil(mpd, [&seen]() { return seen.idleAt != 0; }, CONNECT_TIMEOUT)) {
+        fprintf(stderr, "the client did not connect to the fake mpd\n");
+        return false;
+    }
+    runUntil(mpd, []() { return false; }, SETTLE_TIME);
+    return true;
+}
+
+static int roundTrip(const Options &options) {
+    FakeMpd server(MPD_SOCKET, getSongs());
+    server.setDelay("*", options.delay);
+    server.fail("playid", options.failures);
+    Seen seen;
+    if(!start(server, seen)) {
+        return 1;
+    }
+    Mpd mpd;
+    if(!waitConnected(mpd, seen)) {
+        return 1;
+    }
+
+    std::vector<uint64_t> toServer;
+    std::vector<uint64_t> toIdle;
+    unsigned int lost = 0;
+    for(unsigned int i = 0; i < options.presses; i++) {
+        uint64_t pressAt = FakeMpd::nowUsec();
+        press(mpd, i, false);
+        if(!runUntil(mpd, [&]() { return (seen.commandAt > pressAt) && (seen.idleAt > seen.commandAt); }, PRESS_TIMEOUT)) {
+            ++lost;
+            continue;
+        }
+        toServer.push_back(seen.commandAt - pressAt);
+        toIdle.push_back(seen.idleAt - pressAt);
+        runUntil(mpd, []() { return false; }, SETTLE_TIME);
+    }
+    printStats("press to server", toServer);
+    printStats("round trip", toIdle);
+    if(lost > 0) {
+        printf("%u presses never reached the server\n", lost);
+    }
+
+    //a press as soon as the client is back in idle
+    unsigned int first = seen.commands;
+    uint64_t start = FakeMpd::nowUsec();
+    uint64_t end = start + BURST_TIME;
+    uint64_t pressAt = 0;
+    unsigned int index = 0;
+    while(FakeMpd::nowUsec() < end) {
+        pressAt = FakeMpd::nowUsec();
+        press(mpd, index++, false);
+        runUntil(mpd, [&]() { return (seen.commandAt > pressAt) && (seen.idleAt > seen.commandAt); }, end - pressAt);
+    }
+    double elapsed = (FakeMpd::nowUsec() - start) / 1000000.0;
+    printf("%-16s %.0f presses/s\n", "throughput", (seen.commands - first) / elapsed);
+    server.stop();
+    return lost > 0 ? 1 : 0;
+}
+
+// the client is parked in idle before each press, as between two presses in the car
+static int pressLatency(const Options &options) {
+    FakeMpd server(MPD_SOCKET, getSongs());
+    server.setDelay("*", options.delay);
+    Seen seen;
+    if(!start(server, seen)) {
+        return 1;
+    }
+    Mpd mpd;
+    if(!waitConnected(mpd, seen)) {
+        return 1;
+    }
+    std::vector<uint64_t> toNoidle;
+    std::vector<uint64_t> toServer;
+    unsigned int late = 0;
+    for(unsigned int i = 0; i < options.presses; i++) {
+        uint64_t pressAt = FakeMpd::nowUsec();
+        press(mpd, i, true);
+        bool received = runUntil(mpd, [&]() { return seen.commandAt > pressAt; }, PRESS_TIMEOUT);
+        if(!received || (seen.commandAt - pressAt > PRESS_MAX_LATENCY)) {
+            ++late;
+        }
+        if(received) {
+            toServer.push_back(seen.commandAt - pressAt);
+            if(seen.noidleAt > pressAt) {
+                toNoidle.push_back(seen.noidleAt - pressAt);
+            }
+        }
+        runUntil(mpd, [&]() { return seen.idleAt > seen.commandAt; }, PRESS_TIMEOUT);
+        runUntil(mpd, []() { return false; }, SETTLE_TIME);
+    }
+    server.stop();
+    printStats("press to noidle", toNoidle);
+    printStats("press to server", toServer);
+    if(late > 0) {
+        printf("FAILED: %u presses of %u reached the server after %u ms\n", late, options.presses, PRESS_MAX_LATENCY / 1000);
+        return 1;
+    }
+    printf("passed: every press reached the server within %u ms\n", PRESS_MAX_LATENCY / 1000);
+    return 0;
+}
+
+static bool writeSongs(const std::vector<std::string> &songs, unsigned int size) {
+    std::vector<char> data(1024 * 1024);
+    for(unsigned int i = 0; i < data.size(); i++) {
+        data[i] = rand();
+    }
+    for(const std::string &song : songs) {
+        std::string path = MPD_MUSIC_DIR "/" + song;
+        struct stat info;
+        if((stat(path.c_str(), &info) == 0) && ((uint64_t)info.st_size == (uint64_t)size * data.size())) {
+            continue;
+        }
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd == -1) {
+            fprintf(stderr, "unable to create %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        bool written = true;
+        for(unsigned int mb = 0; written && (mb < size); mb++) {
+            written = (write(fd, data.data(), data.size()) == (ssize_t)data.size());
+        }
+        written = written && (fdatasync(fd) == 0);
+        close(fd);
+        if(!written) {
+            fprintf(stderr, "unable to write %s\n", path.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+static void dropSongs(const std::vector<std::string> &songs) {
+    for(const std::string &song : songs) {
+        int fd = open((MPD_MUSIC_DIR "/" + song).c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd != -1) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+// the server reads the head of each song played before it answers
+static void readHead(const std::string &uri, std::atomic<uint64_t> &playedAt) {
+    char buffer[64 * 1024];
+    int fd = open((MPD_MUSIC_DIR "/" + uri).c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd != -1) {
+        for(unsigned int read = 0; read < SKIP_READ; read += sizeof(buffer)) {
+            if(::read(fd, buffer, sizeof(buffer)) <= 0) {
+                break;
+            }
+        }
+        close(fd);
+    }
+    playedAt = FakeMpd::nowUsec();
+}
+
+// two nexts by measure: the first lets the client read ahead, the second is timed
+static bool skipPass(const Options &options, const std::vector<std::string> &songs, bool warm, std::vector<uint64_t> &latencies) {
+    std::atomic<uint64_t> playedAt(0);
+    FakeMpd server(MPD_SOCKET, songs);
+    server.setPlayListener([&playedAt](const std::string &uri) {
+        readHead(uri, playedAt);
+    });
+    Seen seen;
+    dropSongs(songs);
+    if(!start(server, seen)) {
+        return false;
+    }
+    Mpd mpd;
+    if(!waitConnected(mpd, seen)) {
+        return false;
+    }
+    for(unsigned int i = 0; i < options.presses; i++) {
+        uint64_t pressAt = FakeMpd::nowUsec();
+        mpd.next();
+        runUntil(mpd, [&]() { return playedAt > pressAt; }, PRESS_TIMEOUT);
+        runUntil(mpd, []() { return false; }, WARM_TIME);
+        if(!warm) {
+            dropSongs(songs);
+        }
+        pressAt = FakeMpd::nowUsec();
+        mpd.next();
+        if(runUntil(mpd, [&]() { return playedAt > pressAt; }, PRESS_TIMEOUT)) {
+            latencies.push_back(playedAt - pressAt);
+        }
+        runUntil(mpd, []() { return false; }, SETTLE_TIME);
+    }
+    server.stop();
+    return true;
+}
+
+static int skipLatency(const Options &options) {
+    std::string folder = MPD_MUSIC_DIR "/" + options.folder;
+    if((mkdir(folder.c_str(), 0755) != 0) && (errno != EEXIST)) {
+        fprintf(stderr, "unable to create %s: %s\n", folder.c_str(), strerror(errno));
+        return 1;
+    }
+    struct statfs info;
+    if((statfs(folder.c_str(), &info) == 0) && (info.f_type == TMPFS_MAGIC)) {
+        printf("%s is in memory, the songs cannot leave the page cache\n", folder.c_str());
+    }
+    std::vector<std::string> songs;
+    for(unsigned int i = 0; i < 2 * options.presses + 1; i++) {
+        songs.push_back(options.folder + "/song" + std::to_string(i) + ".mp3");
+    }
+    if(!writeSongs(songs, options.songSize)) {
+        return 1;
+    }
+    std::vector<uint64_t> cold;
+    std::vector<uint64_t> warmed;
+    if(!skipPass(options, songs, false, cold) || !skipPass(options, songs, true, warmed)) {
+        return 1;
+    }
+    printStats("skip, cold", cold);
+    printStats("skip, read ahead", warmed);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        usage();
+    }
+    std::string mode = argv[1];
+    Options options;
+    options.presses = 0;
+    options.delay = 0;
+    options.failures = 0;
+    options.folder = "carpi_bench";
+    options.songSize = 4;
+    int option;
+    optind = 2;
+    while((option = getopt(argc, argv, "n:d:f:m:s:")) != -1) {
+        switch(option) {
+            case 'n':
+                options.presses = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                options.delay = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                options.failures = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                options.folder = optarg;
+                break;
+            case 's':
+                options.songSize = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+        }
+    }
+    if(options.presses == 0) {
+        options.presses = (mode == "skip") ? 8 : 200; // a skip costs two songs and a second
+    }
+    initLog(true);
+    if(mode == "roundtrip") {
+        return roundTrip(options);
+    }
+    if(mode == "press") {
+        return pressLatency(options);
+    }
+    if(mode == "skip") {
+        return skipLatency(options);
+    }
+    usage();
+    return 2;
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "ingest_job.hpp"
+#include "ingest_scheduler.hpp"
+
+// simulation of the copy of a camera card during a stop too short for all of it: the files
+// of a trip are taken in the order of each policy of IngestScheduler, at a throughput and a
+// cost by file (open, create, rename, journal) of a USB stick, until the stop is over.
+// Reports the files and the photos completed, a photo being worth more than the rest.
+//   bench_schedule [-r MB/s] [-c msec by file] [-s seed]
+
+#define DAY         86400
+#define TRIP_START  1700000000
+
+struct Kind {
+    const char *folder;
+    const char *extension;
+    unsigned int count;
+    uint64_t minSize;
+    uint64_t maxSize;
+    bool old; // from before the trip, as the music
+};
+
+static const Kind kinds[] = {
+    {"DCIM/100CAMERA", "jpg", 1500, 3 << 20, 8 << 20, false},
+    {"DCIM/100CAMERA", "dng", 300, 20 << 20, 30 << 20, false},
+    {"DCIM/100CAMERA", "mp4", 40, 200 << 20, 2000ull << 20, false},
+    {"MUSIC", "mp3", 400, 4 << 20, 10 << 20, true},
+    {"MISC", "xml", 200, 1 << 10, 8 << 10, false}
+};
+
+static const char* orders[] = {"scan order", "newest first", "smallest first", "type priority"};
+
+static void usage() {
+    fprintf(stderr, "usage: bench_schedule [-r MB/s] [-c msec by file] [-s seed]\n");
+    exit(2);
+}
+
+static uint64_t random64(uint64_t min, uint64_t max) {
+    return min + (((uint64_t)rand() << 31) | rand()) % (max - min + 1);
+}
+
+// the camera numbers its files as it takes them, along a trip of a week
+static void makeTrip(std::vector<IngestFile> &files) {
+    for(const Kind &kind : kinds) {
+        for(unsigned int i = 0; i < kind.count; i++) {
+            IngestFile file;
+            char name[32];
+            snprintf(name, sizeof(name), "/%04u.%s", i, kind.extension);
+            file.path = std::string("/") + kind.folder + name;
+            file.size = random64(kind.minSize, kind.maxSize);
+            file.mtime = kind.old ? TRIP_START - random64(30, 900) * DAY : TRIP_START + (time_t)i * 7 * DAY / kind.count;
+            file.inode = files.size() + 1;
+            file.offset = 0;
+            files.push_back(file);
+        }
+    }
+    //the scan meets the files of a folder as they were shot, the photos and videos mixed
+    std::stable_sort(files.begin(), files.end(), [](const IngestFile &a, const IngestFile &b) -> bool {
+        std::string folderA = a.path.substr(0, a.path.rfind('/'));
+        std::string folderB = b.path.substr(0, b.path.rfind('/'));
+        return (folderA != folderB) ? (folderA < folderB) : (a.mtime < b.mtime);
+    });
+}
+
+static bool isPhoto(const IngestFile &file) {
+    return (file.path.compare(file.path.size() - 4, 4, ".jpg") == 0) || (file.path.compare(file.path.size() - 4, 4, ".dng") == 0);
+}
+
+int main(int argc, char **argv) {
+    double rate = 20; // MB/s, a USB 2 stick
+    double cost = 4; // msec by file
+    unsigned int seed = 1;
+    int option;
+    while((option = getopt(argc, argv, "r:c:s:")) != -1) {
+        switch(option) {
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'c':
+                cost = atof(optarg);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+        }
+    }
+    srand(seed);
+    std::vector<IngestFile> files;
+    makeTrip(files);
+    unsigned int photos = 0;
+    uint64_t bytes = 0;
+    for(const IngestFile &file : files) {
+        photos += isPhoto(file) ? 1 : 0;
+        bytes += file.size;
+    }
+    printf("%u files, %u photos, %.1f GB at %.0f MB/s and %.1f ms by file: %.0f min for all of them\n",
+        (unsigned int)files.size(), photos, bytes / 1073741824.0, rate, cost,
+        (bytes / 1048576.0 / rate + files.size() * cost / 1000) / 60);
+
+    static const unsigned int budgets[] = {1, 2, 5, 10, 20, 40}; // min
+    printf("%-6s %-15s %12s %12s %10s\n", "stop", "order", "files", "photos", "MB");
+    for(unsigned int budget : budgets) {
+        for(unsigned int order = IngestScheduler::scanOrder; order <= IngestScheduler::typePriority; order++) {
+            IngestScheduler scheduler((IngestScheduler::Order)order);
+            for(const IngestFile &file : files) {
+                scheduler.push(&file);
+            }
+            //the file copied when the power goes is lost
+            double left = budget * 60.0;
+            unsigned int copied = 0;
+            unsigned int photosCopied = 0;
+            uint64_t bytesCopied = 0;
+            const IngestFile *file;
+            while((file = scheduler.take()) != NULL) {
+                left -= file->size / 1048576.0 / rate + cost / 1000;
+                if(left < 0) {
+                    break;
+                }
+                ++copied;
+                photosCopied += isPhoto(*file) ? 1 : 0;
+                bytesCopied += file->size;
+            }
+            printf("%3u min %-15s %5u/%-6u %5u/%-6u %10.0f\n", budget, orders[order], copied, (unsigned int)files.size(),
+                photosCopied, photos, bytesCopied / 1048576.0);
+        }
+    }
+    return 0;
+}
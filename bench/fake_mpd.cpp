@@ -0,0 +1,505 @@
+#include "fake_mpd.hpp"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define ACK_ERROR_ARG       2
+#define ACK_ERROR_UNKNOWN   5
+#define ACK_ERROR_NO_EXIST  50
+#define FIRST_SONG_ID       100
+
+FakeMpd::FakeMpd(const std::string &socketPath, const std::vector<std::string> &songs) {
+    _socketPath = socketPath;
+    _listenFd = -1;
+    _wakeFds[0] = -1;
+    _wakeFds[1] = -1;
+    _started = false;
+    _stopping = false;
+    _updateTime = 200000;
+    _songs = songs;
+    _nextId = FIRST_SONG_ID;
+    for(unsigned int i = 0; i < _songs.size(); i++) {
+        _ids.push_back(_nextId++);
+    }
+    _version = 1;
+    _pos = _songs.empty() ? -1 : 0;
+    _state = "stop";
+    _elapsed = 0;
+    _lastJob = 0;
+    _updateJob = 0;
+    _updateEnd = 0;
+}
+
+FakeMpd::~FakeMpd() {
+    stop();
+}
+
+// the folder of the socket is created as MPD would
+bool FakeMpd::start() {
+    std::string folder = _socketPath.substr(0, _socketPath.rfind('/'));
+    if(!folder.empty() && (mkdir(folder.c_str(), 0755) != 0) && (errno != EEXIST)) {
+        fprintf(stderr, "unable to create %s: %s\n", folder.c_str(), strerror(errno));
+        return false;
+    }
+    unlink(_socketPath.c_str());
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, _socketPath.c_str(), sizeof(address.sun_path) - 1);
+    _listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if((_listenFd == -1) || (bind(_listenFd, (sockaddr*)&address, sizeof(address)) != 0) || (listen(_listenFd, 4) != 0)) {
+        fprintf(stderr, "unable to listen on %s: %s\n", _socketPath.c_str(), strerror(errno));
+        return false;
+    }
+    if(pipe2(_wakeFds, O_CLOEXEC) != 0) {
+        return false;
+    }
+    _started = (pthread_create(&_thread, NULL, FakeMpd::_startRun, (void*)this) == 0);
+    return _started;
+}
+
+void FakeMpd::stop() {
+    if(_started) {
+        _stopping = true;
+        char wake = 0;
+        if(write(_wakeFds[1], &wake, 1) != 1) {
+            fprintf(stderr, "unable to wake the fake mpd: %s\n", strerror(errno));
+        }
+        pthread_join(_thread, NULL);
+        _started = false;
+    }
+    for(const Client &client : _clients) {
+        close(client.fd);
+    }
+    _clients.clear();
+    for(int i = 0; i < 2; i++) {
+        if(_wakeFds[i] != -1) {
+            close(_wakeFds[i]);
+            _wakeFds[i] = -1;
+        }
+    }
+    if(_listenFd != -1) {
+        close(_listenFd);
+        _listenFd = -1;
+        unlink(_socketPath.c_str());
+    }
+}
+
+void FakeMpd::setDelay(const std::string &command, unsigned int usec) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    _delays[command] = usec;
+}
+
+void FakeMpd::fail(const std::string &command, unsigned int count) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    _failures[command] += count;
+}
+
+void FakeMpd::setUpdateTime(unsigned int usec) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    _updateTime = usec;
+}
+
+void FakeMpd::setListener(const Listener &listener) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    _listener = listener;
+}
+
+void FakeMpd::setPlayListener(const PlayListener &listener) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    _playListener = listener;
+}
+
+uint64_t FakeMpd::nowUsec() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void* FakeMpd::_startRun(void *server) {
+    ((FakeMpd*)server)->_run();
+    return NULL;
+}
+
+// one poll for the socket, the clients and the end of the update
+void FakeMpd::_run() {
+    while(!_stopping) {
+        std::vector<pollfd> fds(2 + _clients.size());
+        fds[0].fd = _listenFd;
+        fds[1].fd = _wakeFds[0];
+        for(unsigned int i = 0; i < _clients.size(); i++) {
+            fds[2 + i].fd = _clients[i].fd;
+        }
+        for(pollfd &fd : fds) {
+            fd.events = POLLIN;
+            fd.revents = 0;
+        }
+        int timeout = -1;
+        if(_updateJob != 0) {
+            uint64_t now = nowUsec();
+            timeout = (_updateEnd > now) ? (int)((_updateEnd - now) / 1000 + 1) : 0;
+        }
+        if((poll(fds.data(), fds.size(), timeout) < 0) && (errno != EINTR)) {
+            fprintf(stderr, "fake mpd poll failed: %s\n", strerror(errno));
+            return;
+        }
+        if((_updateJob != 0) && (nowUsec() >= _updateEnd)) {
+            _updateJob = 0;
+            _changes.insert("update");
+            _changes.insert("database");
+        }
+        //the clients are read backwards, so the ones dropped do not shift the others
+        for(unsigned int i = _clients.size(); i > 0; i--) {
+            if((fds[1 + i].revents != 0) && !_read(_clients[i - 1])) {
+                close(_clients[i - 1].fd);
+                _clients.erase(_clients.begin() + (i - 1));
+            }
+        }
+        if(fds[0].revents != 0) {
+            _accept();
+        }
+        for(Client &client : _clients) {
+            if(client.idle && !_changes.empty()) {
+                _answerIdle(client);
+            }
+        }
+    }
+}
+
+void FakeMpd::_accept() {
+    Client client;
+    client.fd = accept4(_listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if(client.fd == -1) {
+        return;
+    }
+    client.idle = false;
+    client.inList = false;
+    client.listOk = false;
+    if(!_send(client.fd, "OK MPD 0.23.5\n")) {
+        close(client.fd);
+        return;
+    }
+    _clients.push_back(client);
+}
+
+bool FakeMpd::_read(Client &client) {
+    char buffer[4096];
+    ssize_t length = recv(client.fd, buffer, sizeof(buffer), 0);
+    if(length <= 0) {
+        return (length < 0) && (errno == EINTR);
+    }
+    client.input.append(buffer, length);
+    size_t end;
+    while((end = client.input.find('\n')) != std::string::npos) {
+        std::string line = client.input.substr(0, end);
+        client.input.erase(0, end + 1);
+        if(!_onLine(client, line)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// MPD closes the connection of a client which sends anything else than noidle while idle
+bool FakeMpd::_onLine(Client &client, const std::string &line) {
+    Listener listener;
+    {
+        const std::lock_guard<std::mutex> lock(_mut);
+        listener = _listener;
+    }
+    if(listener) {
+        listener(line, nowUsec());
+    }
+    std::string command = line.substr(0, line.find(' '));
+    if(client.idle) {
+        if(command != "noidle") {
+            return false;
+        }
+        _answerIdle(client);
+        return true;
+    }
+    if(client.inList) {
+        if(command != "command_list_end") {
+            client.list.push_back(line);
+            return true;
+        }
+        std::string output;
+        bool success = true;
+        for(unsigned int i = 0; success && (i < client.list.size()); i++) {
+            success = _execute(client.list[i], output, i);
+            if(success && client.listOk) {
+                output += "list_OK\n";
+            }
+        }
+        if(success) {
+            output += "OK\n";
+        }
+        client.inList = false;
+        client.list.clear();
+        return _send(client.fd, output);
+    }
+    if((command == "command_list_begin") || (command == "command_list_ok_begin")) {
+        client.inList = true;
+        client.listOk = (command == "command_list_ok_begin");
+        return true;
+    }
+    if(command == "idle") {
+        client.idle = true;
+        if(!_changes.empty()) {
+            _answerIdle(client);
+        }
+        return true;
+    }
+    if(command == "noidle") {
+        return true; //ignored outside idle, as MPD does
+    }
+    std::string output;
+    if(_execute(line, output, 0)) {
+        output += "OK\n";
+    }
+    return _send(client.fd, output);
+}
+
+// the answer goes in output, or the ACK when refused
+bool FakeMpd::_execute(const std::string &line, std::string &output, unsigned int index) {
+    std::vector<std::string> args;
+    _split(line, args);
+    const std::string &command = args[0];
+    unsigned int delay = 0;
+    bool failed = false;
+    {
+        const std::lock_guard<std::mutex> lock(_mut);
+        std::map<std::string, unsigned int>::iterator found = _delays.find(command);
+        if(found == _delays.end()) {
+            found = _delays.find("*");
+        }
+        if(found != _delays.end()) {
+            delay = found->second;
+        }
+        found = _failures.find(command);
+        if((found != _failures.end()) && (found->second > 0)) {
+            --found->second;
+            failed = true;
+        }
+    }
+    if(delay > 0) {
+        usleep(delay);
+    }
+    char ack[256];
+    int error = 0;
+    const char *message = NULL;
+    if(failed) {
+        error = ACK_ERROR_NO_EXIST;
+        message = "scripted failure";
+    }
+    else if(command == "status") {
+        _status(output);
+    }
+    else if(command == "ping") {
+    }
+    else if(command == "currentsong") {
+        if(_pos >= 0) {
+            _song(output, _pos);
+        }
+    }
+    else if((command == "play") || (command == "seek")) {
+        int pos = (args.size() > 1) ? atoi(args[1].c_str()) : ((_pos >= 0) ? _pos : 0);
+        if((pos < 0) || ((unsigned int)pos >= _songs.size())) {
+            error = ACK_ERROR_ARG;
+            message = "Bad song index";
+        }
+        else {
+            _play(pos, (args.size() > 2) ? atof(args[2].c_str()) : 0);
+        }
+    }
+    else if((command == "playid") || (command == "seekid")) {
+        int pos = (args.size() > 1) ? _findId(atoi(args[1].c_str())) : _pos;
+        if(pos < 0) {
+            error = ACK_ERROR_NO_EXIST;
+            message = "No such song";
+        }
+        else {
+            _play(pos, (args.size() > 2) ? atof(args[2].c_str()) : 0);
+        }
+    }
+    else if((command == "next") || (command == "previous")) {
+        int pos = _pos + ((command == "next") ? 1 : -1);
+        if((_pos < 0) || (pos < 0) || ((unsigned int)pos >= _songs.size())) {
+            _state = "stop";
+            _changes.insert("player");
+        }
+        else {
+            _play(pos, 0);
+        }
+    }
+    else if(command == "pause") {
+        bool paused = (args.size() > 1) ? (args[1] == "1") : (strcmp(_state, "play") == 0);
+        if(strcmp(_state, "stop") != 0) {
+            _state = paused ? "pause" : "play";
+            _changes.insert("player");
+        }
+    }
+    else if(command == "stop") {
+        _state = "stop";
+        _changes.insert("player");
+    }
+    else if(command == "plchanges") {
+        unsigned int version = (args.size() > 1) ? strtoul(args[1].c_str(), NULL, 10) : 0;
+        for(unsigned int i = 0; (version < _version) && (i < _songs.size()); i++) {
+            _song(output, i);
+        }
+    }
+    else if(command == "update") {
+        unsigned int updateTime;
+        {
+            const std::lock_guard<std::mutex> lock(_mut);
+            updateTime = _updateTime;
+        }
+        _updateJob = ++_lastJob;
+        _updateEnd = nowUsec() + updateTime;
+        _changes.insert("update");
+        output += "updating_db: " + std::to_string(_updateJob) + "\n";
+    }
+    else if(command == "add") {
+        if(args.size() < 2) {
+            error = ACK_ERROR_ARG;
+            message = "missing argument";
+        }
+        else {
+            _songs.push_back(args[1]);
+            _ids.push_back(_nextId++);
+            ++_version;
+            _changes.insert("playlist");
+        }
+    }
+    else if(command == "clear") {
+        _songs.clear();
+        _ids.clear();
+        _pos = -1;
+        _state = "stop";
+        ++_version;
+        _changes.insert("playlist");
+        _changes.insert("player");
+    }
+    else {
+        error = ACK_ERROR_UNKNOWN;
+        message = "unknown command";
+    }
+    if(error == 0) {
+        return true;
+    }
+    snprintf(ack, sizeof(ack), "ACK [%d@%u] {%s} %s\n", error, index, command.c_str(), message);
+    output += ack;
+    return false;
+}
+
+void FakeMpd::_answerIdle(Client &client) {
+    std::string output;
+    for(const std::string &change : _changes) {
+        output += "changed: " + change + "\n";
+    }
+    output += "OK\n";
+    _changes.clear();
+    client.idle = false;
+    _send(client.fd, output);
+}
+
+void FakeMpd::_play(int pos, double elapsed) {
+    PlayListener listener;
+    {
+        const std::lock_guard<std::mutex> lock(_mut);
+        listener = _playListener;
+    }
+    if(listener) {
+        listener(_songs[pos]);
+    }
+    _pos = pos;
+    _state = "play";
+    _elapsed = elapsed;
+    _changes.insert("player");
+}
+
+int FakeMpd::_findId(unsigned int id) const {
+    for(unsigned int i = 0; i < _ids.size(); i++) {
+        if(_ids[i] == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void FakeMpd::_status(std::string &output) const {
+    char status[512];
+    snprintf(status, sizeof(status), "volume: 100\nrepeat: 0\nrandom: 0\nsingle: 0\nconsume: 0\n"
+        "playlist: %u\nplaylistlength: %u\nstate: %s\n", _version, (unsigned int)_songs.size(), _state);
+    output += status;
+    if((_pos >= 0) && (strcmp(_state, "stop") != 0)) {
+        snprintf(status, sizeof(status), "song: %d\nsongid: %u\nelapsed: %.3f\n", _pos, _ids[_pos], _elapsed);
+        output += status;
+    }
+    if((_pos >= 0) && ((unsigned int)_pos + 1 < _songs.size())) {
+        snprintf(status, sizeof(status), "nextsong: %d\nnextsongid: %u\n", _pos + 1, _ids[_pos + 1]);
+        output += status;
+    }
+    if(_updateJob != 0) {
+        output += "updating_db: " + std::to_string(_updateJob) + "\n";
+    }
+}
+
+void FakeMpd::_song(std::string &output, unsigned int pos) const {
+    output += "file: " + _songs[pos] + "\nPos: " + std::to_string(pos) + "\nId: " + std::to_string(_ids[pos]) + "\n";
+}
+
+bool FakeMpd::_send(int fd, const std::string &output) {
+    size_t sent = 0;
+    while(sent < output.size()) {
+        ssize_t length = send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+        if(length < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sent += length;
+    }
+    return true;
+}
+
+// the arguments are quoted by libmpdclient, with backslashes before the quotes
+void FakeMpd::_split(const std::string &line, std::vector<std::string> &args) {
+    size_t i = 0;
+    while(i < line.size()) {
+        if(line[i] == ' ') {
+            ++i;
+            continue;
+        }
+        std::string arg;
+        if(line[i] == '"') {
+            for(++i; (i < line.size()) && (line[i] != '"'); i++) {
+                if((line[i] == '\\') && (i + 1 < line.size())) {
+                    ++i;
+                }
+                arg += line[i];
+            }
+            ++i;
+        }
+        else {
+            for(; (i < line.size()) && (line[i] != ' '); i++) {
+                arg += line[i];
+            }
+        }
+        args.push_back(arg);
+    }
+    if(args.empty()) {
+        args.push_back("");
+    }
+}
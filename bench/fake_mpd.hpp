@@ -0,0 +1,94 @@
+#ifndef _FAKE_MPD_HPP
+#define _FAKE_MPD_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// stand-in for MPD on a unix socket, with enough of the protocol for the daemon: status,
+// idle/noidle, play/playid/pause/next/previous, seek/seekid, plchanges, update, add, clear
+// and the command lists. Its own thread serves every client. Each command can be delayed
+// or refused on purpose, and a listener sees every command as it comes.
+class FakeMpd {
+    public:
+        // called by the server thread, usec on the monotonic clock
+        typedef std::function<void(const std::string &command, uint64_t at)> Listener;
+        // called by the server thread when a song starts, before the command is answered
+        typedef std::function<void(const std::string &uri)> PlayListener;
+
+        FakeMpd(const std::string &socketPath, const std::vector<std::string> &songs);
+        ~FakeMpd();
+
+        bool start();
+        void stop();
+
+        // usec before the answer of a command, "*" for all of them
+        void setDelay(const std::string &command, unsigned int usec);
+        // the next count calls of the command are refused with an ACK
+        void fail(const std::string &command, unsigned int count = 1);
+        // usec an update takes
+        void setUpdateTime(unsigned int usec);
+        void setListener(const Listener&);
+        void setPlayListener(const PlayListener&);
+
+        static uint64_t nowUsec();
+
+    protected:
+        struct Client {
+            int fd;
+            std::string input;
+            bool idle;
+            bool inList;
+            bool listOk;
+            std::vector<std::string> list;
+        };
+
+        std::string _socketPath;
+        int _listenFd;
+        int _wakeFds[2];
+        pthread_t _thread;
+        bool _started;
+        std::atomic<bool> _stopping;
+        std::mutex _mut; // the script
+        std::map<std::string, unsigned int> _delays;
+        std::map<std::string, unsigned int> _failures;
+        unsigned int _updateTime;
+        Listener _listener;
+        PlayListener _playListener;
+
+        // what the server plays, used by its thread only
+        std::vector<std::string> _songs;
+        std::vector<unsigned int> _ids;
+        unsigned int _nextId;
+        unsigned int _version;
+        int _pos; // -1 when stopped on no song
+        const char *_state;
+        double _elapsed;
+        unsigned int _lastJob;
+        unsigned int _updateJob; // 0 when none runs
+        uint64_t _updateEnd;
+        std::set<std::string> _changes; // idle events not reported yet
+        std::vector<Client> _clients;
+
+        static void* _startRun(void*);
+        void _run();
+        void _accept();
+        bool _read(Client&);
+        bool _onLine(Client&, const std::string &line);
+        bool _execute(const std::string &line, std::string &output, unsigned int index);
+        void _answerIdle(Client&);
+        void _play(int pos, double elapsed);
+        int _findId(unsigned int id) const;
+        void _status(std::string &output) const;
+        void _song(std::string &output, unsigned int pos) const;
+        static bool _send(int fd, const std::string&);
+        static void _split(const std::string &line, std::vector<std::string> &args);
+};
+
+#endif // _FAKE_MPD_HPP
@@ -0,0 +1,98 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "fake_mpd.hpp"
+
+// the fake MPD alone, until interrupted, to try the daemon by hand:
+//   fake_mpd [-s socket] [-n songs] [-u update usec] [-d command=usec]... [-f command=count]... [-v]
+static void usage() {
+    fprintf(stderr, "usage: fake_mpd [-s socket] [-n songs] [-u update usec] [-d command=usec]... [-f command=count]... [-v]\n");
+    exit(2);
+}
+
+static bool splitOption(const char *option, std::string &command, unsigned int &value) {
+    const char *equal = strchr(option, '=');
+    if(equal == NULL) {
+        return false;
+    }
+    command.assign(option, equal - option);
+    value = strtoul(equal + 1, NULL, 10);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    std::string socketPath = MPD_SOCKET;
+    unsigned int songs = 20;
+    unsigned int updateTime = 200000;
+    bool verbose = false;
+    std::vector<std::pair<std::string, unsigned int> > delays;
+    std::vector<std::pair<std::string, unsigned int> > failures;
+    int option;
+    while((option = getopt(argc, argv, "s:n:u:d:f:v")) != -1) {
+        std::string command;
+        unsigned int value;
+        switch(option) {
+            case 's':
+                socketPath = optarg;
+                break;
+            case 'n':
+                songs = strtoul(optarg, NULL, 10);
+                break;
+            case 'u':
+                updateTime = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+            case 'f':
+                if(!splitOption(optarg, command, value)) {
+                    usage();
+                }
+                ((option == 'd') ? delays : failures).push_back(std::make_pair(command, value));
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    std::vector<std::string> uris;
+    for(unsigned int i = 0; i < songs; i++) {
+        uris.push_back("fake/song" + std::to_string(i) + ".mp3");
+    }
+    FakeMpd server(socketPath, uris);
+    server.setUpdateTime(updateTime);
+    for(const std::pair<std::string, unsigned int> &delay : delays) {
+        server.setDelay(delay.first, delay.second);
+    }
+    for(const std::pair<std::string, unsigned int> &failure : failures) {
+        server.fail(failure.first, failure.second);
+    }
+    if(verbose) {
+        server.setListener([](const std::string &command, uint64_t at) {
+            printf("%llu.%06llu %s\n", (unsigned long long)(at / 1000000), (unsigned long long)(at % 1000000), command.c_str());
+            fflush(stdout);
+        });
+    }
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL); // before the server thread, which inherits it
+    if(!server.start()) {
+        return 1;
+    }
+    printf("fake mpd listening on %s with %u songs\n", socketPath.c_str(), songs);
+    fflush(stdout);
+    int received;
+    sigwait(&signals, &received);
+    server.stop();
+    return 0;
+}
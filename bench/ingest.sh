@@ -0,0 +1,120 @@
+#!/bin/bash
+# copy benchmarks of the ingest on loop devices, as root and away from the car: the image of
+# the big disk is mounted on its folder of /media, the source on /media/$LABEL.
+#   ingest.sh copy [work folder]
+#     a stick of big and medium files on ext4, copied to an empty big disk
+#   ingest.sh compare [work folder]
+#     the same stick copied by io_uring then by the pool of threads, at the first queue
+#     depth of a volume then at 1
+#   ingest.sh small [work folder]
+#     a camera card of 50k small files in 500 folders on vfat, copied by io_uring then by
+#     the pool of threads. No result of it is recorded yet.
+# The images are made in the work folder, /var/tmp/carpi_bench by default, and removed after.
+
+set -e
+cd "$(dirname "$0")"
+
+MODE=$1
+WORK=${2:-/var/tmp/carpi_bench}
+BIG_DISK=$(sed -n 's/^#define BIG_DISK_NAME *"\([^"]*\)".*/\1/p' ../config.h)
+LABEL=CARPIBENCH
+MOUNTS=()
+LOOPS=()
+
+usage() {
+    echo "usage: ingest.sh copy|compare|small [work folder]" >&2
+    exit 2
+}
+
+cleanup() {
+    for ((i = ${#MOUNTS[@]} - 1; i >= 0; i--)); do
+        umount "${MOUNTS[$i]}" 2>/dev/null && rmdir "${MOUNTS[$i]}" 2>/dev/null || true
+    done
+    for loop in "${LOOPS[@]}"; do
+        losetup -d "$loop" 2>/dev/null || true
+    done
+    MOUNTS=()
+    LOOPS=()
+}
+trap 'cleanup; rm -rf "$WORK"' EXIT
+
+# image file, size, mkfs command, mount folder
+mount_image() {
+    truncate -s "$2" "$1"
+    local loop
+    loop=$(losetup -f --show "$1")
+    LOOPS+=("$loop")
+    $3 "$loop" > /dev/null
+    mkdir -p "$4"
+    mount "$loop" "$4"
+    MOUNTS+=("$4")
+}
+
+# folder, files, size in KB, extension
+fill() {
+    mkdir -p "$1"
+    for ((i = 0; i < $2; i++)); do
+        head -c $(($3 * 1024)) /dev/urandom > "$1/file$i.$4"
+    done
+}
+
+# folder, folders, files by folder: 4 to 32 KB, by folder
+fill_small() {
+    for ((d = 0; d < $2; d++)); do
+        local dir size
+        dir=$(printf "%s/%03uCAMERA" "$1" "$d")
+        size=$(((4 + d % 8 * 4) * 1024))
+        mkdir -p "$dir"
+        head -c $(($3 * size)) /dev/urandom | split -b "$size" -d -a 4 --additional-suffix=.jpg - "$dir/IMG_"
+    done
+}
+
+# the big disk is made again for each run, its indexes would skip the files copied before
+run() {
+    mount_image "$WORK/big.img" 8G "mkfs.ext4 -q -F -L $BIG_DISK" "/media/$BIG_DISK"
+    local name=$1
+    [ $# -gt 2 ] && name="$1 ${*:3}"
+    echo -n "$name, "
+    "./$1" "${@:2}" | tail -n 1
+    umount "/media/$BIG_DISK"
+    rmdir "/media/$BIG_DISK"
+    unset 'MOUNTS[${#MOUNTS[@]}-1]'
+    losetup -d "${LOOPS[${#LOOPS[@]}-1]}"
+    unset 'LOOPS[${#LOOPS[@]}-1]'
+    rm -f "$WORK/big.img"
+}
+
+[ "$(id -u)" = 0 ] || { echo "ingest.sh mounts loop devices, it must run as root" >&2; exit 1; }
+[ -x ./bench_ingest ] && [ -x ./bench_ingest_pool ] || make -s bench_ingest bench_ingest_pool
+if mountpoint -q "/media/$BIG_DISK"; then
+    echo "/media/$BIG_DISK is mounted, the benchmark would copy on the big disk" >&2
+    exit 1
+fi
+mkdir -p "$WORK"
+
+case "$MODE" in
+    copy|compare)
+        mount_image "$WORK/source.img" 4G "mkfs.ext4 -q -F -L $LABEL" "/media/$LABEL"
+        fill "/media/$LABEL/DCIM/VIDEO" 12 131072 mp4
+        fill "/media/$LABEL/DCIM/PHOTO" 300 4096 jpg
+        fill "/media/$LABEL/MUSIC" 2000 48 mp3
+        mount -o remount,ro "/media/$LABEL" # as the daemon mounts the volumes
+        run bench_ingest "$LABEL"
+        if [ "$MODE" = compare ]; then
+            run bench_ingest_pool "$LABEL"
+            run bench_ingest "$LABEL" -q 1
+            run bench_ingest_pool "$LABEL" -q 1
+        fi
+        ;;
+    small)
+        command -v mkfs.vfat > /dev/null || { echo "mkfs.vfat is needed, from dosfstools" >&2; exit 1; }
+        mount_image "$WORK/source.img" 2G "mkfs.vfat -F 32 -n $LABEL" "/media/$LABEL"
+        fill_small "/media/$LABEL/DCIM" 500 100
+        mount -o remount,ro "/media/$LABEL"
+        run bench_ingest "$LABEL" -f
+        run bench_ingest_pool "$LABEL" -f
+        ;;
+    *)
+        usage
+        ;;
+esac
@@ -0,0 +1,209 @@
+#include "checksum.hpp"
+
+#include <cstring>
+
+#include "config.h"
+
+//the 4 lanes go by pairs in vector registers. The 64 bits multiplies are made of 32 bits
+//ones, which pays where the scalar multiply is not 64 bits (armv7, x86)
+#if !defined(DISABLE_SIMD_CHECKSUM) && defined(__ARM_NEON) && !defined(__aarch64__)
+#define CHECKSUM_NEON 1
+#include <arm_neon.h>
+#elif !defined(DISABLE_SIMD_CHECKSUM) && defined(__SSE2__) && !defined(__x86_64__)
+#define CHECKSUM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t read64(const unsigned char *data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value; // little endian only, as the raspberry pi
+}
+
+static inline uint32_t read32(const unsigned char *data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxRound(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t mergeRound(uint64_t acc, uint64_t value) {
+    acc ^= xxRound(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+#if defined(CHECKSUM_NEON)
+
+static inline uint64x2_t mul64(uint64x2_t value, uint32x2_t primeLow, uint32x2_t primeHigh) {
+    uint32x2_t low = vmovn_u64(value);
+    uint32x2_t high = vshrn_n_u64(value, 32);
+    uint64x2_t cross = vmlal_u32(vmull_u32(high, primeLow), low, primeHigh);
+    return vaddq_u64(vmull_u32(low, primeLow), vshlq_n_u64(cross, 32));
+}
+
+static inline uint64x2_t vectorRound(uint64x2_t acc, const unsigned char *input) {
+    const uint32x2_t prime1Low = vdup_n_u32((uint32_t)PRIME1);
+    const uint32x2_t prime1High = vdup_n_u32((uint32_t)(PRIME1 >> 32));
+    const uint32x2_t prime2Low = vdup_n_u32((uint32_t)PRIME2);
+    const uint32x2_t prime2High = vdup_n_u32((uint32_t)(PRIME2 >> 32));
+    acc = vaddq_u64(acc, mul64(vreinterpretq_u64_u8(vld1q_u8(input)), prime2Low, prime2High));
+    acc = vorrq_u64(vshlq_n_u64(acc, 31), vshrq_n_u64(acc, 33));
+    return mul64(acc, prime1Low, prime1High);
+}
+
+// whole stripes of 32 bytes, returns the bytes hashed
+static size_t hashStripes(uint64_t *acc, const unsigned char *input, size_t length) {
+    uint64x2_t acc01 = vld1q_u64(acc);
+    uint64x2_t acc23 = vld1q_u64(acc + 2);
+    size_t done = 0;
+    while(length - done >= 32) {
+        acc01 = vectorRound(acc01, input + done);
+        acc23 = vectorRound(acc23, input + done + 16);
+        done += 32;
+    }
+    vst1q_u64(acc, acc01);
+    vst1q_u64(acc + 2, acc23);
+    return done;
+}
+
+#elif defined(CHECKSUM_SSE2)
+
+static inline __m128i mul64(__m128i value, __m128i primeLow, __m128i primeHigh) {
+    __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(value, 32), primeLow), _mm_mul_epu32(value, primeHigh));
+    return _mm_add_epi64(_mm_mul_epu32(value, primeLow), _mm_slli_epi64(cross, 32));
+}
+
+static inline __m128i vectorRound(__m128i acc, const unsigned char *input) {
+    const __m128i prime1Low = _mm_set1_epi32((int)(uint32_t)PRIME1);
+    const __m128i prime1High = _mm_set1_epi32((int)(uint32_t)(PRIME1 >> 32));
+    const __m128i prime2Low = _mm_set1_epi32((int)(uint32_t)PRIME2);
+    const __m128i prime2High = _mm_set1_epi32((int)(uint32_t)(PRIME2 >> 32));
+    acc = _mm_add_epi64(acc, mul64(_mm_loadu_si128((const __m128i*)input), prime2Low, prime2High));
+    acc = _mm_or_si128(_mm_slli_epi64(acc, 31), _mm_srli_epi64(acc, 33));
+    return mul64(acc, prime1Low, prime1High);
+}
+
+static size_t hashStripes(uint64_t *acc, const unsigned char *input, size_t length) {
+    __m128i acc01 = _mm_loadu_si128((const __m128i*)acc);
+    __m128i acc23 = _mm_loadu_si128((const __m128i*)(acc + 2));
+    size_t done = 0;
+    while(length - done >= 32) {
+        acc01 = vectorRound(acc01, input + done);
+        acc23 = vectorRound(acc23, input + done + 16);
+        done += 32;
+    }
+    _mm_storeu_si128((__m128i*)acc, acc01);
+    _mm_storeu_si128((__m128i*)(acc + 2), acc23);
+    return done;
+}
+
+#else
+
+static size_t hashStripes(uint64_t *acc, const unsigned char *input, size_t length) {
+    size_t done = 0;
+    while(length - done >= 32) {
+        acc[0] = xxRound(acc[0], read64(input + done));
+        acc[1] = xxRound(acc[1], read64(input + done + 8));
+        acc[2] = xxRound(acc[2], read64(input + done + 16));
+        acc[3] = xxRound(acc[3], read64(input + done + 24));
+        done += 32;
+    }
+    return done;
+}
+
+#endif
+
+Checksum::Checksum(uint64_t seed) {
+    _seed = seed;
+    _acc[0] = seed + PRIME1 + PRIME2;
+    _acc[1] = seed + PRIME2;
+    _acc[2] = seed;
+    _acc[3] = seed - PRIME1;
+    _length = 0;
+    _buffered = 0;
+}
+
+void Checksum::update(const void *data, size_t length) {
+    const unsigned char *input = (const unsigned char*)data;
+    _length += length;
+    if(_buffered + length < 32) {
+        memcpy(_buffer + _buffered, input, length);
+        _buffered += length;
+        return;
+    }
+    if(_buffered > 0) {
+        size_t missing = 32 - _buffered;
+        memcpy(_buffer + _buffered, input, missing);
+        hashStripes(_acc, _buffer, 32);
+        input += missing;
+        length -= missing;
+        _buffered = 0;
+    }
+    size_t done = hashStripes(_acc, input, length);
+    input += done;
+    length -= done;
+    memcpy(_buffer, input, length);
+    _buffered = length;
+}
+
+uint64_t Checksum::digest() const {
+    uint64_t hash;
+    if(_length >= 32) {
+        hash = rotl(_acc[0], 1) + rotl(_acc[1], 7) + rotl(_acc[2], 12) + rotl(_acc[3], 18);
+        for(int i = 0; i < 4; i++) {
+            hash = mergeRound(hash, _acc[i]);
+        }
+    }
+    else {
+        hash = _seed + PRIME5;
+    }
+    hash += _length;
+
+    const unsigned char *input = _buffer;
+    size_t length = _buffered;
+    while(length >= 8) {
+        hash ^= xxRound(0, read64(input));
+        hash = rotl(hash, 27) * PRIME1 + PRIME4;
+        input += 8;
+        length -= 8;
+    }
+    if(length >= 4) {
+        hash ^= (uint64_t)read32(input) * PRIME1;
+        hash = rotl(hash, 23) * PRIME2 + PRIME3;
+        input += 4;
+        length -= 4;
+    }
+    while(length > 0) {
+        hash ^= (*input) * PRIME5;
+        hash = rotl(hash, 11) * PRIME1;
+        ++input;
+        --length;
+    }
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t Checksum::hash(const void *data, size_t length, uint64_t seed) {
+    Checksum checksum(seed);
+    checksum.update(data, length);
+    return checksum.digest();
+}
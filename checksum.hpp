@@ -0,0 +1,25 @@
+#ifndef _CHECKSUM_HPP
+#define _CHECKSUM_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+// streaming xxHash64, its lanes in vector registers with armv7 NEON and 32 bits SSE2
+class Checksum {
+    public:
+        Checksum(uint64_t seed = 0);
+
+        void update(const void *data, size_t length);
+        uint64_t digest() const;
+
+        static uint64_t hash(const void *data, size_t length, uint64_t seed = 0);
+
+    protected:
+        uint64_t _acc[4];
+        uint64_t _seed;
+        uint64_t _length;
+        unsigned char _buffer[32];
+        size_t _buffered;
+};
+
+#endif // _CHECKSUM_HPP
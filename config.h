@@ -7,6 +7,55 @@
 #define IGNORED_PARTITIONS      {"boot"}
 #define BIG_DISK_NAME           "rpi_trip"
 #define DOS_PART_OWNER          "1000"
+#define EXT_COMMIT_DELAY        "30"           // sec between two journal commits of a read-write ext3/4, the copies sync their own data
+
+#define SOURCE_READ_AHEAD       2048           // KB, the volumes are read once from end to end
+#define SOURCE_SCHEDULERS       {"none", "mq-deadline"} // the first available is used
+#define SOURCE_NR_REQUESTS      32             // doubled for a fixed disk
+#define MUSIC_READ_AHEAD        512            // KB, read ahead of the big disk, doubled when rotational
+#define MUSIC_SCHEDULERS        {"bfq", "mq-deadline"} // bfq honours the idle priority of the throttled copies
+#define MUSIC_NR_REQUESTS       128
+#define MAX_SECTORS_KB          1024           // max size of a request, when the hardware allows it
+
+#define INGEST_CHUNK_SIZE       (8*1024*1024)  // max bytes copied by one syscall
+#define INGEST_PROGRESS_STEP    (16*1024*1024) // bytes copied between progress reports
+#define INGEST_SCAN_THREADS     4              // threads walking a volume
+#define INGEST_QUEUE_DEPTH      8              // requests in flight by volume (io_uring buffers or threads), at first
+#define INGEST_MAX_QUEUE_DEPTH  16             // max of the queue depth tuned for a device
+#define INGEST_MIN_REQUEST_SIZE (128*1024)     // min of the read size tuned for a device
+#define INGEST_TUNE_PERIOD      3000000        // throughput measure of a device tuning, usec
+#define INGEST_BUFFER_SIZE      (1024*1024)    // size of an io_uring copy buffer
+#define INGEST_LARGE_FILE_SIZE  (64*1024*1024) // files copied around the page cache (direct I/O) from this size
+#define INGEST_DIRECT_BUFFERS   4              // aligned buffers of a direct copy, of INGEST_BUFFER_SIZE at least
+#define INGEST_SMALL_FILE_SIZE  (64*1024)      // files sharing an io_uring buffer with others
+#define INGEST_SMALL_FILES      64             // small files copied at once by volume, besides the queue depth
+#define INGEST_DIR_FDS          64             // folders kept open by volume, on each side of the copy
+// #define DISABLE_IO_URING 1
+// #define DISABLE_SIMD_CHECKSUM 1                // the checksums are computed by scalar code
+#define INGEST_STATE_DIR        ".carpi"       // folder of the ingest indexes, on the big disk
+#define INGEST_COMMIT_DELAY     2000000        // max delay between two syncs of the copy journal, usec
+#define INGEST_MAX_RATE         0              // bytes/sec copied by the volumes while the music is stopped, 0 for no limit
+#define INGEST_PLAYING_RATE     (8*1024*1024)  // bytes/sec copied while the music plays, halved at each throttle level
+#define INGEST_MAX_LATENCY      30000          // read latency of the big disk which raises the throttle level, usec
+#define INGEST_GOVERNOR_PERIOD  1000000        // delay between two checks of the read latency, usec
+#define INGEST_LATENCY_PROBE    200000         // end of a period where the read latency is measured, the checks of the copies wait, usec
+#define INGEST_VERIFY_THREADS   0              // threads checking the copies, 0 for one by core
+#define INGEST_ORDER            IngestScheduler::typePriority // or scanOrder, newestFirst, smallestFirst
+#define INGEST_TYPE_PRIORITY    {"jpg", "jpeg", "heic", "dng", "cr2", "nef", "arw", "mp3", "flac", "ogg", "m4a", "mp4", "mov"}
+// what is copied from the volumes, the first rule matching a path decides ("+" copies, "-" skips).
+// A pattern without "/" matches a name at any depth, one starting with "/" a path from the volume
+// root, one ending with "/" only folders; "*" stops at "/", "**" does not, the case is ignored.
+// Conditions on the files may follow: size<N, size>N (k, M, G suffixes), magic=[offset:]hexbytes
+#define INGEST_FILTER           {"-/.Trashes/", "-/.Spotlight-V100/", "-/.fseventsd/", "-/System Volume Information/", "-/$RECYCLE.BIN/", \
+                                 "-.thumbnails/", "-._*", "-.DS_Store", "-Thumbs.db", "-desktop.ini", "-*.thm", "-*.lrv", "-*.tmp"}
+
+// #define DISABLE_COMPRESSION 1                  // copies are compressed only when built with libzstd
+#define INGEST_COMPRESS_MIN_SIZE (64*1024)     // smaller files are copied as they are
+#define INGEST_COMPRESS_ENTROPY 6.0            // bits by byte of the samples, under which a file is compressed
+#define INGEST_COMPRESS_LEVEL   3              // zstd level
+#define INGEST_COMPRESS_FRAME   (4*1024*1024)  // bytes compressed apart, the unit of random access in a compressed copy
+#define INGEST_COMPRESS_THREADS 0              // zstd workers, 0 for one by core
+#define INGEST_COMPRESSED_TYPES {"jpg", "jpeg", "heic", "png", "gif", "webp", "cr2", "cr3", "nef", "arw", "dng", "mp3", "flac", "ogg", "opus", "m4a", "aac", "mp4", "mov", "mkv", "avi", "zip", "gz", "bz2", "xz", "zst", "7z", "rar"}
 
 // #define DISABLE_GPIO 1
 
@@ -16,9 +65,22 @@
 #define BUTTON_MIN_DELAY        100000  // min time before rebounce, usec
 #define REBOUNCE_ACCEL          0.7
 
+#define MPD_SOCKET              "/run/mpd/socket" // used when it exists, else the port on localhost
+#define MPD_PORT                6600
+#define MPD_COMMAND_TIMEOUT     5000000 // max delay of an mpd answer, usec, the connection is dropped after
+#define MPD_PRESS_DEADLINE      3000000 // a button press not sent to mpd by then is dropped, usec
 #define MPD_RECONNECT_DELAY     1000000 // first reconnection delay, usec
 #define MPD_RECONNECT_MAXDELAY  30000000 // max reconnection delay, usec
 #define MPD_RECONNECT_ACCEL     2
+#define MPD_RESUME_FILE         "/home/" RUN_AS_USER "/." DAEMON_NAME "_playback" // what mpd played, resumed at the next boot
+#define MPD_MUSIC_DIR           "/media"       // music_directory of mpd.conf, which holds the big disk and the volumes
+#define MPD_PREWARM_TRACKS      3              // songs read ahead after the one to be played
+#define MPD_PREWARM_SIZE        (8*1024*1024)  // bytes read ahead at the start of a song
+#define MPD_PREWARM_BUDGET      (24*1024*1024) // max bytes read ahead for the songs to come
+// #define DISABLE_AUTOPLAY 1                    // else the music of a volume plugged replaces the queue at once
+#define MPD_AUTOPLAY_TYPES      {"mp3", "flac", "ogg", "opus", "m4a", "aac", "wav", "wma"}
+#define MPD_AUTOPLAY_BATCH      64             // songs added by command list
+#define MPD_RECONNECT_PROBE     20000 // first reconnection delay once the socket of mpd appears, usec
 
 #define PIN_BTN_NEXT            15
 #define PIN_BTN_PREV            17
@@ -0,0 +1,339 @@
+#include "content_index.hpp"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "log.hpp"
+#include "checksum.hpp"
+
+#define PARTIAL_SIZE    (64*1024) // bytes hashed at the head and at the tail of a file
+#define HASH_BLOCK      (256*1024)
+
+ContentIndex::ContentIndex() {
+    _log = NULL;
+}
+
+ContentIndex::~ContentIndex() {
+    close();
+}
+
+bool ContentIndex::open(const std::string &root) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(_log != NULL) {
+        if(root == _root) {
+            return true;
+        }
+        fclose(_log);
+        _log = NULL;
+    }
+    _root = root;
+    _entries.clear();
+    _bySize.clear();
+    _byPath.clear();
+
+    std::string dir = root + "/" INGEST_STATE_DIR;
+    if((mkdir(dir.c_str(), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) != 0) && (errno != EEXIST)) {
+        log(LOG_ERR, "Unable to create folder %s: %s", dir.c_str(), strerror(errno));
+        return false;
+    }
+    _logPath = dir + "/content.idx";
+    unsigned int lines = _load();
+    if(lines > _byPath.size() * 2 + 64) {
+        _compact();
+    }
+    _log = fopen(_logPath.c_str(), "a");
+    if(_log == NULL) {
+        log(LOG_ERR, "unable to open %s: %s", _logPath.c_str(), strerror(errno));
+        return false;
+    }
+    log(LOG_INFO, "content index loaded: %u files", (unsigned int)_byPath.size());
+    return true;
+}
+
+void ContentIndex::close() {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(_log != NULL) {
+        fclose(_log);
+        _log = NULL;
+    }
+    _entries.clear();
+    _bySize.clear();
+    _byPath.clear();
+}
+
+bool ContentIndex::isOpen() {
+    const std::lock_guard<std::mutex> lock(_mut);
+    return _log != NULL;
+}
+
+void ContentIndex::flush() {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(_log != NULL) {
+        fflush(_log);
+    }
+}
+
+// one line by file: size mtime partial full path, the last line of a path wins
+unsigned int ContentIndex::_load() {
+    FILE *file = fopen(_logPath.c_str(), "r");
+    if(file == NULL) {
+        return 0;
+    }
+    unsigned int lines = 0;
+    char *line = NULL;
+    size_t lineSize = 0;
+    ssize_t length;
+    while((length = getline(&line, &lineSize, file)) > 0) {
+        if(line[length - 1] == '\n') {
+            line[length - 1] = 0;
+        }
+        unsigned long long size;
+        long long mtime;
+        unsigned long long partial;
+        unsigned long long full;
+        int pathStart = 0;
+        if((sscanf(line, "%llu %lld %llx %llx %n", &size, &mtime, &partial, &full, &pathStart) < 4) || (pathStart == 0)) {
+            continue;
+        }
+        Entry entry;
+        entry.path = line + pathStart;
+        entry.size = size;
+        entry.mtime = mtime;
+        entry.partial = partial;
+        entry.full = full;
+        _insert(entry);
+        ++lines;
+    }
+    free(line);
+    fclose(file);
+    return lines;
+}
+
+void ContentIndex::_compact() {
+    std::string tmpPath = _logPath + ".tmp";
+    FILE *file = fopen(tmpPath.c_str(), "w");
+    if(file == NULL) {
+        log(LOG_ERR, "unable to create %s: %s", tmpPath.c_str(), strerror(errno));
+        return;
+    }
+    for(const std::pair<const std::string, size_t> &pair : _byPath) {
+        const Entry &entry = _entries[pair.second];
+        fprintf(file, "%llu %lld %016llx %016llx %s\n", (unsigned long long)entry.size, (long long)entry.mtime,
+            (unsigned long long)entry.partial, (unsigned long long)entry.full, entry.path.c_str());
+    }
+    if((fflush(file) != 0) || (fsync(fileno(file)) != 0)) {
+        log(LOG_ERR, "unable to write %s: %s", tmpPath.c_str(), strerror(errno));
+        fclose(file);
+        return;
+    }
+    fclose(file);
+    if(rename(tmpPath.c_str(), _logPath.c_str()) != 0) {
+        log(LOG_ERR, "unable to replace %s: %s", _logPath.c_str(), strerror(errno));
+    }
+}
+
+void ContentIndex::_insert(const Entry &entry) {
+    _remove(entry.path);
+    size_t index = _entries.size();
+    _entries.push_back(entry);
+    _byPath[entry.path] = index;
+    _bySize.insert(std::pair<uint64_t, size_t>(entry.size, index));
+}
+
+// entries stay in the vector, but are not reachable anymore
+void ContentIndex::_remove(const std::string &path) {
+    std::map<std::string, size_t>::iterator found = _byPath.find(path);
+    if(found == _byPath.end()) {
+        return;
+    }
+    size_t index = found->second;
+    _byPath.erase(found);
+    std::pair<std::multimap<uint64_t, size_t>::iterator, std::multimap<uint64_t, size_t>::iterator> range;
+    range = _bySize.equal_range(_entries[index].size);
+    for(std::multimap<uint64_t, size_t>::iterator i = range.first; i != range.second; ++i) {
+        if(i->second == index) {
+            _bySize.erase(i);
+            break;
+        }
+    }
+}
+
+void ContentIndex::_append(const Entry &entry) {
+    if((_log == NULL) || (strchr(entry.path.c_str(), '\n') != NULL)) {
+        return;
+    }
+    fprintf(_log, "%llu %lld %016llx %016llx %s\n", (unsigned long long)entry.size, (long long)entry.mtime,
+        (unsigned long long)entry.partial, (unsigned long long)entry.full, entry.path.c_str());
+}
+
+void ContentIndex::add(const std::string &storedPath, uint64_t size, time_t mtime, uint64_t full) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(_log == NULL) {
+        return;
+    }
+    std::map<std::string, size_t>::iterator found = _byPath.find(storedPath);
+    if(found != _byPath.end()) {
+        const Entry &known = _entries[found->second];
+        if((known.size == size) && (known.mtime == mtime) && ((full == 0) || (known.full == full))) {
+            return;
+        }
+    }
+    Entry entry;
+    entry.path = storedPath;
+    entry.size = size;
+    entry.mtime = mtime;
+    entry.partial = (size <= 2 * PARTIAL_SIZE) ? full : 0;
+    entry.full = full;
+    _insert(entry);
+    _append(entry);
+}
+
+bool ContentIndex::hasSize(uint64_t size) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    return _bySize.count(size) != 0;
+}
+
+void ContentIndex::_getCandidates(uint64_t size, std::vector<Entry> &candidates) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    std::pair<std::multimap<uint64_t, size_t>::iterator, std::multimap<uint64_t, size_t>::iterator> range;
+    range = _bySize.equal_range(size);
+    for(std::multimap<uint64_t, size_t>::iterator i = range.first; i != range.second; ++i) {
+        candidates.push_back(_entries[i->second]);
+    }
+}
+
+void ContentIndex::_update(const Entry &entry) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    std::map<std::string, size_t>::iterator found = _byPath.find(entry.path);
+    if(found == _byPath.end()) {
+        return;
+    }
+    Entry &known = _entries[found->second];
+    if((known.size != entry.size) || (known.mtime != entry.mtime)) {
+        return;
+    }
+    known.partial = entry.partial;
+    known.full = entry.full;
+    _append(known);
+}
+
+// hash a stored file, after checking it did not change since it was indexed
+bool ContentIndex::_hashStored(Entry &entry, bool full) {
+    if((full ? entry.full : entry.partial) != 0) {
+        return true;
+    }
+    std::string path = _root + "/" + entry.path;
+    struct stat info;
+    if((stat(path.c_str(), &info) != 0) || ((uint64_t)info.st_size != entry.size) || (info.st_mtime != entry.mtime)) {
+        const std::lock_guard<std::mutex> lock(_mut);
+        _remove(entry.path);
+        return false;
+    }
+    uint64_t hash;
+    if(!_hash(path, entry.size, full, hash)) {
+        return false;
+    }
+    if(full || (entry.size <= 2 * PARTIAL_SIZE)) {
+        entry.full = hash;
+    }
+    if(!full || (entry.size <= 2 * PARTIAL_SIZE)) {
+        entry.partial = hash;
+    }
+    _update(entry);
+    return true;
+}
+
+bool ContentIndex::mayContain(const std::string &srcPath, const IngestFile &file) {
+    std::vector<Entry> candidates;
+    _getCandidates(file.size, candidates);
+    if(candidates.empty()) {
+        return false;
+    }
+    uint64_t partial;
+    if(!_hash(srcPath, file.size, false, partial)) {
+        return false;
+    }
+    for(Entry &candidate : candidates) {
+        if(_hashStored(candidate, false) && (candidate.partial == partial)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ContentIndex::find(const std::string &srcPath, const IngestFile &file, std::string &storedPath) {
+    std::vector<Entry> candidates;
+    _getCandidates(file.size, candidates);
+    if(candidates.empty()) {
+        return false;
+    }
+    uint64_t partial;
+    if(!_hash(srcPath, file.size, false, partial)) {
+        return false;
+    }
+    uint64_t full = 0;
+    for(Entry &candidate : candidates) {
+        if(!_hashStored(candidate, false) || (candidate.partial != partial)) {
+            continue;
+        }
+        if(full == 0) {
+            if(file.size <= 2 * PARTIAL_SIZE) {
+                full = partial;
+            }
+            else if(!_hash(srcPath, file.size, true, full)) {
+                return false;
+            }
+        }
+        if(_hashStored(candidate, true) && (candidate.full == full)) {
+            storedPath = candidate.path;
+            return true;
+        }
+    }
+    return false;
+}
+
+// the partial hash covers the head and the tail of the file, or the whole small files
+bool ContentIndex::_hash(const std::string &path, uint64_t size, bool full, uint64_t &hash) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        log(LOG_ERR, "unable to open %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    char *buffer = new char[HASH_BLOCK];
+    Checksum checksum;
+    bool success = true;
+    uint64_t offset = 0;
+    while(success && (offset < size)) {
+        if(!full && (size > 2 * PARTIAL_SIZE) && (offset == PARTIAL_SIZE)) {
+            offset = size - PARTIAL_SIZE;
+        }
+        uint64_t end = size;
+        if(!full && (size > 2 * PARTIAL_SIZE) && (offset < PARTIAL_SIZE)) {
+            end = PARTIAL_SIZE;
+        }
+        size_t length = (end - offset > HASH_BLOCK) ? HASH_BLOCK : (size_t)(end - offset);
+        ssize_t result = pread(fd, buffer, length, offset);
+        if(result == -1 && errno == EINTR) {
+            continue;
+        }
+        if(result <= 0) {
+            log(LOG_ERR, "unable to read %s: %s", path.c_str(), result == 0 ? "file truncated" : strerror(errno));
+            success = false;
+            break;
+        }
+        checksum.update(buffer, result);
+        offset += result;
+    }
+    delete[] buffer;
+    ::close(fd);
+    hash = checksum.digest();
+    if(hash == 0) { // 0 means unknown
+        hash = 1;
+    }
+    return success;
+}
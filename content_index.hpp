@@ -0,0 +1,62 @@
+#ifndef _CONTENT_INDEX_HPP
+#define _CONTENT_INDEX_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ingest_job.hpp"
+
+// persistent index of the files stored on the big disk, by content.
+// Hashes are computed only when needed: the size is checked first,
+// then a partial hash (head and tail), then the hash of the whole file.
+class ContentIndex {
+    public:
+        ContentIndex();
+        ~ContentIndex();
+
+        bool open(const std::string &root);
+        void close();
+        bool isOpen();
+        void flush();
+
+        bool hasSize(uint64_t size);
+        // is there a stored file with the same size and partial hash ?
+        bool mayContain(const std::string &srcPath, const IngestFile&);
+        // find a stored file with the same content, storedPath is relative to the root
+        bool find(const std::string &srcPath, const IngestFile&, std::string &storedPath);
+        // full is the hash of the whole file, 0 if unknown
+        void add(const std::string &storedPath, uint64_t size, time_t mtime, uint64_t full = 0);
+
+    protected:
+        struct Entry {
+            std::string path;
+            uint64_t size;
+            time_t mtime;
+            uint64_t partial; // 0 when not computed yet
+            uint64_t full; // 0 when not computed yet
+        };
+
+        std::mutex _mut;
+        std::string _root;
+        std::string _logPath;
+        FILE *_log;
+        std::vector<Entry> _entries;
+        std::multimap<uint64_t, size_t> _bySize;
+        std::map<std::string, size_t> _byPath;
+
+        unsigned int _load();
+        void _compact();
+        void _insert(const Entry&);
+        void _remove(const std::string &path);
+        void _append(const Entry&);
+        void _getCandidates(uint64_t size, std::vector<Entry>&);
+        bool _hashStored(Entry&, bool full);
+        void _update(const Entry&);
+        static bool _hash(const std::string &path, uint64_t size, bool full, uint64_t &hash);
+};
+
+#endif // _CONTENT_INDEX_HPP
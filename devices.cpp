@@ -2,11 +2,16 @@
 
 #include <cstring>
 #include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 #include <mntent.h>
 #include <fstab.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/mount.h>
-#include <sys/statvfs.h>
 
 #include "config.h"
 #include "log.hpp"
@@ -31,16 +36,14 @@ Devices::Devices() {
         udev_device_unref(device);
     }
     udev_enumerate_unref(lister);
-    _checkSizes();
+    _startIngest();
 }
 
 
 Devices::~Devices() {
+    _ingest.stopAll();
     udev_monitor_unref(_monitor);
     udev_unref(_udev);
-    for(char *name : _copyables) {
-        free(name);
-    }
 }
 
 void Devices::manageChanges() {
@@ -51,7 +54,10 @@ void Devices::manageChanges() {
     }
     const char* action = udev_device_get_action(device);
     if(strcmp(action, "add") == 0) {
-        _onAdded(device);
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        _onAdded(device, (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+        _startIngest();
     }
     else if(strcmp(action, "remove") == 0) {
         _onRemoved(device);
@@ -71,7 +77,72 @@ bool Devices::isCopyAvailable() const {
     return _bigDiskConnected && !_copyables.empty();
 }
 
-void Devices::_onAdded(udev_device *device) {
+int Devices::getIngestFd() const {
+    return _ingest.getPipe().getReadFd();
+}
+
+void Devices::manageIngest() {
+    char msg = _ingest.getPipe().read();
+    if((msg != Ingest::DONE) && (msg != Ingest::FAILED) && (msg != Ingest::NO_SPACE)) {
+        return;
+    }
+    std::list<std::string> finished;
+    std::list<std::string> refused;
+    _ingest.collectFinished(finished, refused);
+    for(const std::string &label : finished) {
+        _copyables.remove_if([&](const IngestVolume &volume) -> bool {
+            return volume.label == label;
+        });
+        //failed copies have brought files too
+        _musicChanges.push_back("/media/" BIG_DISK_NAME "/" + label);
+    }
+    for(const std::string &label : refused) {
+        _copyables.remove_if([&](const IngestVolume &volume) -> bool {
+            return volume.label == label;
+        });
+    }
+}
+
+bool Devices::isCopying() const {
+    return _ingest.isRunning();
+}
+
+unsigned int Devices::getCopyProgress() const {
+    return _ingest.getProgress();
+}
+
+void Devices::setMusicPlaying(bool playing) {
+    _ingest.setPlaying(playing);
+}
+
+unsigned int Devices::getCopyThrottle() const {
+    return _ingest.getThrottleLevel();
+}
+
+uint64_t Devices::getCopyThroughput() const {
+    return _ingest.getThroughput();
+}
+
+void Devices::collectMusicChanges(std::list<std::string> &paths) {
+    paths.splice(paths.end(), _musicChanges);
+}
+
+void Devices::collectPluggedVolumes(std::list<std::pair<std::string, uint64_t> > &volumes) {
+    volumes.splice(volumes.end(), _pluggedVolumes);
+}
+
+void Devices::_startIngest() {
+    if(!_bigDiskConnected) {
+        return;
+    }
+    for(const IngestVolume &volume : _copyables) {
+        if(!_ingest.isRunning(volume.label)) {
+            _ingest.start(volume);
+        }
+    }
+}
+
+void Devices::_onAdded(udev_device *device, uint64_t pluggedAt) {
     const char *devtype = udev_device_get_devtype(device);
     if(devtype ==NULL || strcmp(devtype, "partition") != 0) {
         return;
@@ -82,68 +153,163 @@ void Devices::_onAdded(udev_device *device) {
     if(idFsLabelEnc == NULL){
         return;
     }
-    if((status == Devices::umounted) || (status == Devices::rw)){
+    bool isBigDisk = (strcmp(idFsLabelEnc, BIG_DISK_NAME) == 0);
+    if(isBigDisk && ((status == Devices::umounted) || (status == Devices::ro))) {
+        //the big disk receives the copies
+        mountFailure = !_mount(device, false, status);
+    }
+    else if(!isBigDisk && ((status == Devices::umounted) || (status == Devices::rw))) {
         mountFailure = !_mount(device, true, status);
     }
     if((!mountFailure) && (status != Devices::ignored) && (status != Devices::system)) {
-        if(strcmp(idFsLabelEnc, BIG_DISK_NAME) == 0){
+        _tune(device, isBigDisk);
+        if(isBigDisk){
             _bigDiskConnected = true;
+            _ingest.setMusicDevice(udev_device_get_sysname(device));
+        }
+        else if(!_ingest.isRunning(idFsLabelEnc)){
+            _copyables.remove_if([&](const IngestVolume &volume) -> bool {
+                return volume.label == idFsLabelEnc;
+            });
+            IngestVolume volume;
+            volume.label = idFsLabelEnc;
+            const char* uuid = udev_device_get_property_value(device, "ID_FS_UUID");
+            volume.uuid = (uuid == NULL) ? "" : uuid;
+            volume.sysname = udev_device_get_sysname(device);
+            //the copy tuning is remembered by device
+            const char* serial = udev_device_get_property_value(device, "ID_SERIAL");
+            if(serial == NULL) {
+                serial = udev_device_get_property_value(device, "ID_MODEL");
+            }
+            volume.device = (serial == NULL) ? "" : serial;
+            volume.queueDepth = INGEST_QUEUE_DEPTH;
+            volume.order = INGEST_ORDER;
+            const char* fstype = udev_device_get_property_value(device, "ID_FS_TYPE");
+            volume.stableInodes = (fstype != NULL) && (strcmp(fstype, "vfat") != 0);
+            _copyables.push_back(volume);
+        }
+        if(!isBigDisk) {
+            _musicChanges.push_back(std::string("/media/") + idFsLabelEnc);
         }
-        else{
-            _copyables.push_back(strdup(idFsLabelEnc));
+        if(!isBigDisk && (pluggedAt != 0)) {
+            _pluggedVolumes.push_back(std::make_pair(std::string("/media/") + idFsLabelEnc, pluggedAt));
         }
     }
 }
 
+static std::string readQueueValue(const std::string &queue, const char *name) {
+    std::string path = queue + name;
+    FILE *file = fopen(path.c_str(), "r");
+    if(file == NULL) {
+        return "";
+    }
+    char value[256];
+    if(fgets(value, sizeof(value), file) == NULL) {
+        value[0] = 0;
+    }
+    fclose(file);
+    value[strcspn(value, "\n")] = 0;
+    return value;
+}
+
+static void writeQueueValue(const std::string &queue, const char *disk, const char *name, const std::string &before, const std::string &value) {
+    if(before.empty() || (before == value)) {
+        return;
+    }
+    std::string path = queue + name;
+    FILE *file = fopen(path.c_str(), "w");
+    bool written = (file != NULL) && (fputs(value.c_str(), file) >= 0);
+    if((file == NULL) || (fclose(file) != 0)) {
+        written = false;
+    }
+    if(!written) {
+        log(LOG_ERR, "unable to set %s of %s to %s: %s", name, disk, value.c_str(), strerror(errno));
+        return;
+    }
+    log(LOG_INFO, "%s %s: %s -> %s", disk, name, before.c_str(), readQueueValue(queue, name).c_str());
+}
+
+// the scheduler in use is between brackets, among the available ones
+static std::string chooseScheduler(const std::string &available, const std::vector<std::string> &wanted, std::string &current) {
+    size_t open = available.find('[');
+    size_t close = available.find(']');
+    current = ((open != std::string::npos) && (close != std::string::npos)) ? available.substr(open + 1, close - open - 1) : "";
+    std::string words = " " + available + " ";
+    for(const std::string &scheduler : wanted) {
+        if((words.find(" " + scheduler + " ") != std::string::npos) || (scheduler == current)) {
+            return scheduler;
+        }
+    }
+    return current;
+}
+
+// the queue of the disk is set for its use: a source is read once from end to end,
+// while the big disk plays the music and receives the throttled copies
+void Devices::_tune(udev_device *device, bool isBigDisk) const {
+    udev_device *disk = udev_device_get_parent_with_subsystem_devtype(device, "block", "disk");
+    if(disk == NULL) {
+        return;
+    }
+    const char *name = udev_device_get_sysname(disk);
+    std::string queue = udev_device_get_syspath(disk);
+    queue += "/queue/";
+    bool rotational = (readQueueValue(queue, "rotational") == "1");
+    const char *removable = udev_device_get_sysattr_value(disk, "removable");
+    bool fixed = (removable != NULL) && (strcmp(removable, "0") == 0);
+
+    unsigned long readAhead = isBigDisk ? MUSIC_READ_AHEAD : SOURCE_READ_AHEAD;
+    if(rotational && isBigDisk) {
+        readAhead *= 2;
+    }
+    unsigned long requests = isBigDisk ? MUSIC_NR_REQUESTS : SOURCE_NR_REQUESTS;
+    if(fixed && !isBigDisk) {
+        requests *= 2;
+    }
+    std::vector<std::string> schedulers = isBigDisk ? std::vector<std::string>(MUSIC_SCHEDULERS) : std::vector<std::string>(SOURCE_SCHEDULERS);
+    if(rotational && !isBigDisk) {
+        schedulers.insert(schedulers.begin(), "mq-deadline"); //the seeks are worth sorting
+    }
+
+    std::string current;
+    std::string scheduler = chooseScheduler(readQueueValue(queue, "scheduler"), schedulers, current);
+    writeQueueValue(queue, name, "scheduler", current, scheduler);
+    writeQueueValue(queue, name, "read_ahead_kb", readQueueValue(queue, "read_ahead_kb"), std::to_string(readAhead));
+    //the scheduler resets nr_requests, so it is set after
+    writeQueueValue(queue, name, "nr_requests", readQueueValue(queue, "nr_requests"), std::to_string(requests));
+    unsigned long maxSectors = strtoul(readQueueValue(queue, "max_hw_sectors_kb").c_str(), NULL, 10);
+    if(maxSectors > MAX_SECTORS_KB) {
+        maxSectors = MAX_SECTORS_KB;
+    }
+    if(maxSectors > 0) {
+        writeQueueValue(queue, name, "max_sectors_kb", readQueueValue(queue, "max_sectors_kb"), std::to_string(maxSectors));
+    }
+}
+
 void Devices::_onRemoved(udev_device *device) {
     const char *devtype = udev_device_get_devtype(device);
     if(devtype == NULL || strcmp(devtype, "partition") != 0) {
         return;
     }
-    _umount(device);
     const char* idFsLabelEnc = udev_device_get_property_value(device, "ID_FS_LABEL_ENC");
     if(idFsLabelEnc == NULL){
+        _umount(device);
         return;
     }
+    //the copies must release the files before the umount
     if(strcmp(idFsLabelEnc, BIG_DISK_NAME) == 0){
+        _ingest.stopAll();
         _bigDiskConnected = false;
     }
     else{
-        _copyables.remove_if([&](const char* name) -> bool {
-            return (strcmp(idFsLabelEnc, name) == 0);
+        _ingest.stop(idFsLabelEnc);
+        _copyables.remove_if([&](const IngestVolume &volume) -> bool {
+            return volume.label == idFsLabelEnc;
         });
     }
-}
-
-void Devices::_checkSizes() {
-    if(!isCopyAvailable()) {
-        return;
+    //its songs leave the library of MPD
+    if(_umount(device) && (strcmp(idFsLabelEnc, BIG_DISK_NAME) != 0)) {
+        _musicChanges.push_back(std::string("/media/") + idFsLabelEnc);
     }
-    struct statvfs info;
-    if(statvfs("/media/" BIG_DISK_NAME, &info)) {
-        log(LOG_ERR, "unable to get space available on %s: %s", "/media/" BIG_DISK_NAME, strerror(errno));
-        return;
-    }
-    double bigDiskSpace = (double)info.f_bfree * (double)info.f_bsize;
-
-    _copyables.remove_if([&](const char* name) -> bool {
-        std::string path = "/media/";
-        path += name;
-        if(statvfs(path.c_str(), &info)) {
-            log(LOG_ERR, "unable to get used space on %s: %s", path.c_str(), strerror(errno));
-            return true;
-        }
-        double available = (double)info.f_bfree * (double)info.f_bsize;
-        double total = (double)info.f_blocks * (double)info.f_bsize;
-        double used = total - available;
-        if(bigDiskSpace > used) {
-            return false;
-        }
-        else {
-            log(LOG_INFO, "not enought space for %s", path.c_str());
-            return true;
-        }
-    });
 }
 
 Devices::MountStatus Devices::_getStatus(udev_device *device) const { 
@@ -228,11 +394,14 @@ bool Devices::_mount(udev_device *device, bool readOnly, Devices::MountStatus st
     else if(strcmp(fstype, "ext2") == 0) {
         options = MS_NOATIME;
     }
-    else if(strcmp(fstype, "ext3") == 0) {
-        options = MS_NOATIME;
-    }
-    else if(strcmp(fstype, "ext4") == 0) {
+    else if((strcmp(fstype, "ext3") == 0) || (strcmp(fstype, "ext4") == 0)) {
         options = MS_NOATIME;
+        if(!readOnly) {
+            data = "commit=" EXT_COMMIT_DELAY;
+#ifdef MS_LAZYTIME
+            options |= MS_LAZYTIME; // the times of the copies are written with their data
+#endif
+        }
     }
     else {
         log(LOG_ERR, "unmanaged fs type %s", fstype);
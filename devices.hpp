@@ -4,6 +4,8 @@
 #include <libudev.h>
 #include <list>
 
+#include "ingest.hpp"
+
 //TODO: perf: use async forblong operation: mounting! , udev scan? , fstab and mtab scan ?
 //TODO: good error managment
 class Devices {
@@ -15,6 +17,18 @@ class Devices {
        int getUdevFd() const;
        void manageChanges();
        bool isCopyAvailable() const;
+       int getIngestFd() const;
+       void manageIngest();
+       bool isCopying() const;
+       unsigned int getCopyProgress() const;
+       void setMusicPlaying(bool);
+       unsigned int getCopyThrottle() const;
+       uint64_t getCopyThroughput() const; // bytes/sec
+       // the folders whose music changed since the last call: volumes mounted or removed, copies done
+       void collectMusicChanges(std::list<std::string> &paths);
+       // the volumes mounted since the last call, by path, with when udev announced them
+       // (usec on the monotonic clock). Not the ones found at start
+       void collectPluggedVolumes(std::list<std::pair<std::string, uint64_t> > &volumes);
 
     protected:
        enum MountStatus {
@@ -30,14 +44,18 @@ class Devices {
        udev_monitor *_monitor;
        int _udevFd;
        bool _bigDiskConnected;
-       std::list<char*> _copyables;
+       std::list<IngestVolume> _copyables;
+       Ingest _ingest;
+       std::list<std::string> _musicChanges;
+       std::list<std::pair<std::string, uint64_t> > _pluggedVolumes;
 
        bool _mount(udev_device*, bool readOnly, MountStatus currentStatus = undefined) const;
        bool _umount(udev_device*, MountStatus currentStatus = undefined) const;
        bool _umount(const char*) const;
        MountStatus _getStatus(udev_device*) const;
-       void _checkSizes();
-       void _onAdded(udev_device*);
+       void _startIngest();
+       void _tune(udev_device*, bool isBigDisk) const;
+       void _onAdded(udev_device*, uint64_t pluggedAt = 0);
        void _onRemoved(udev_device*);
 };
 
@@ -0,0 +1,110 @@
+#include "ingest.hpp"
+
+#include "config.h"
+#include "log.hpp"
+
+const char Ingest::PROGRESS;
+const char Ingest::DONE;
+const char Ingest::FAILED;
+const char Ingest::NO_SPACE;
+
+Ingest::Ingest() {
+    static const char* rules[] = INGEST_FILTER;
+    _filter.compile(std::vector<std::string>(rules, rules + sizeof(rules)/sizeof(const char*)));
+}
+
+Ingest::~Ingest() {
+    stopAll();
+}
+
+bool Ingest::start(const IngestVolume &volume) {
+    if(_jobs.count(volume.label) != 0) {
+        return false;
+    }
+    _index.open("/media/" BIG_DISK_NAME);
+    _manifest.open("/media/" BIG_DISK_NAME);
+    _tunings.open("/media/" BIG_DISK_NAME);
+    _jobs[volume.label] = new IngestJob(volume, _pipe, _index, _governor, _manifest, _tunings, _filter);
+    return true;
+}
+
+void Ingest::stop(const std::string &label) {
+    std::map<std::string, IngestJob*>::iterator i = _jobs.find(label);
+    if(i == _jobs.end()) {
+        return;
+    }
+    delete i->second;
+    _jobs.erase(i);
+}
+
+void Ingest::stopAll() {
+    for(std::pair<const std::string, IngestJob*> &pair : _jobs) {
+        pair.second->stop();
+    }
+    for(std::pair<const std::string, IngestJob*> &pair : _jobs) {
+        delete pair.second;
+    }
+    _jobs.clear();
+    _index.close();
+    _manifest.close();
+    _tunings.close();
+}
+
+bool Ingest::isRunning(const std::string &label) const {
+    return _jobs.count(label) != 0;
+}
+
+bool Ingest::isRunning() const {
+    return !_jobs.empty();
+}
+
+unsigned int Ingest::getProgress() const {
+    uint64_t copied = 0;
+    uint64_t total = 0;
+    for(const std::pair<const std::string, IngestJob*> &pair : _jobs) {
+        copied += pair.second->getCopiedBytes();
+        total += pair.second->getTotalBytes();
+    }
+    if(total == 0) {
+        return 0;
+    }
+    return (unsigned int)(copied * 100 / total);
+}
+
+void Ingest::collectFinished(std::list<std::string> &labels, std::list<std::string> &refused) {
+    std::map<std::string, IngestJob*>::iterator i = _jobs.begin();
+    while(i != _jobs.end()) {
+        if(i->second->getStatus() == IngestJob::running) {
+            ++i;
+            continue;
+        }
+        if(i->second->getStatus() == IngestJob::noSpace) {
+            refused.push_back(i->first);
+        }
+        else {
+            labels.push_back(i->first);
+        }
+        delete i->second;
+        _jobs.erase(i++);
+    }
+}
+
+const Pipe& Ingest::getPipe() const {
+    return _pipe;
+}
+
+void Ingest::setPlaying(bool playing) {
+    _governor.setPlaying(playing);
+}
+
+void Ingest::setMusicDevice(const std::string &sysname) {
+    _governor.setMusicDevice(sysname);
+}
+
+unsigned int Ingest::getThrottleLevel() const {
+    return _governor.getLevel();
+}
+
+uint64_t Ingest::getThroughput() const {
+    return _governor.getThroughput();
+}
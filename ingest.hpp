@@ -0,0 +1,53 @@
+#ifndef _INGEST_HPP
+#define _INGEST_HPP
+
+#include <map>
+#include <list>
+#include <string>
+
+#include "pipe.hpp"
+#include "ingest_job.hpp"
+#include "content_index.hpp"
+#include "ingest_governor.hpp"
+#include "ingest_manifest.hpp"
+#include "ingest_tuner.hpp"
+#include "ingest_filter.hpp"
+
+// copy the removable volumes on the big disk, one thread per volume
+class Ingest {
+    public:
+        static const char PROGRESS = 1;
+        static const char DONE = 2;
+        static const char FAILED = 3;
+        static const char NO_SPACE = 4;
+
+        Ingest();
+        ~Ingest();
+
+        bool start(const IngestVolume&);
+        void stop(const std::string &label);
+        void stopAll();
+        bool isRunning(const std::string &label) const;
+        bool isRunning() const;
+        unsigned int getProgress() const; // percent of all running copies
+        // the copies ended, apart from the ones refused for lack of space
+        void collectFinished(std::list<std::string> &labels, std::list<std::string> &refused);
+        const Pipe& getPipe() const;
+
+        // throttle the copies while the music plays from the big disk
+        void setPlaying(bool);
+        void setMusicDevice(const std::string &sysname);
+        unsigned int getThrottleLevel() const;
+        uint64_t getThroughput() const; // bytes/sec
+
+    protected:
+        Pipe _pipe;
+        std::map<std::string, IngestJob*> _jobs;
+        ContentIndex _index;
+        IngestGovernor _governor;
+        IngestManifest _manifest;
+        IngestTunings _tunings;
+        IngestFilter _filter;
+};
+
+#endif // _INGEST_HPP
@@ -0,0 +1,337 @@
+#include "ingest_compress.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+#include "log.hpp"
+#include "checksum.hpp"
+#include "ingest_job.hpp"
+#include "ingest_governor.hpp"
+
+#ifdef HAS_COMPRESSION
+#include <zstd.h>
+#endif
+
+#define SAMPLES             4
+#define SAMPLE_SIZE         (16*1024)
+#define SKIPPABLE_MAGIC     0x184D2A5E
+#define SEEKABLE_MAGIC      0x8F92EAB1
+#define SEEK_FOOTER_SIZE    9
+
+const char *IngestCompressor::SUFFIX = ".zst";
+
+#ifdef HAS_COMPRESSION
+static bool readFull(int fd, char *buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while(done < length) {
+        ssize_t result = pread(fd, buffer + done, length - done, offset + done);
+        if((result == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if(result <= 0) {
+            if(result == 0) {
+                errno = EAGAIN; //the source shrunk during the copy
+            }
+            return false;
+        }
+        done += result;
+    }
+    return true;
+}
+
+static bool writeFull(int fd, const char *buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while(done < length) {
+        ssize_t result = pwrite(fd, buffer + done, length - done, offset + done);
+        if((result == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if(result <= 0) {
+            if(result == 0) {
+                errno = ENOSPC;
+            }
+            return false;
+        }
+        done += result;
+    }
+    return true;
+}
+
+static void putLe32(std::vector<unsigned char> &data, uint32_t value) {
+    for(int i = 0; i < 4; i++) {
+        data.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+#endif
+
+bool IngestCompressor::mayCompress(const IngestFile &file) {
+#ifdef HAS_COMPRESSION
+    if(file.size < INGEST_COMPRESS_MIN_SIZE) {
+        return false;
+    }
+    size_t dot = file.path.rfind('.');
+    if((dot == std::string::npos) || (file.path.find('/', dot) != std::string::npos)) {
+        return true;
+    }
+    std::string extension = file.path.substr(dot + 1);
+    for(char &c : extension) {
+        c = tolower(c);
+    }
+    for(const char *compressed : INGEST_COMPRESSED_TYPES) {
+        if(extension == compressed) {
+            return false;
+        }
+    }
+    return true;
+#else
+    (void)file;
+    return false;
+#endif
+}
+
+// samples spread on the file, the entropy is computed on their bytes altogether
+bool IngestCompressor::isCompressible(int fd, uint64_t size, double *ratio) {
+#ifdef HAS_COMPRESSION
+    std::vector<char> samples(SAMPLES * SAMPLE_SIZE);
+    size_t sampled = 0;
+    for(unsigned int i = 0; i < SAMPLES; i++) {
+        uint64_t offset = size / SAMPLES * i;
+        size_t length = (size - offset > SAMPLE_SIZE) ? SAMPLE_SIZE : (size_t)(size - offset);
+        if((length == 0) || !readFull(fd, &samples[sampled], length, offset)) {
+            break;
+        }
+        sampled += length;
+    }
+    if(sampled == 0) {
+        return false;
+    }
+    unsigned int counts[256] = {0};
+    for(size_t i = 0; i < sampled; i++) {
+        ++counts[(unsigned char)samples[i]];
+    }
+    double entropy = 0; // bits by byte
+    for(unsigned int count : counts) {
+        if(count > 0) {
+            double p = (double)count / sampled;
+            entropy -= p * log2(p);
+        }
+    }
+    if(entropy >= INGEST_COMPRESS_ENTROPY) {
+        return false;
+    }
+    if(ratio != NULL) {
+        std::vector<char> compressed(ZSTD_compressBound(sampled));
+        size_t length = ZSTD_compress(compressed.data(), compressed.size(), samples.data(), sampled, INGEST_COMPRESS_LEVEL);
+        *ratio = ZSTD_isError(length) ? 1.0 : (double)length / sampled;
+    }
+    return true;
+#else
+    (void)fd;
+    (void)size;
+    (void)ratio;
+    return false;
+#endif
+}
+
+uint64_t IngestCompressor::estimateSize(const std::string &srcPath, const IngestFile &file) {
+    if(!mayCompress(file)) {
+        return file.size;
+    }
+    int fd = open(srcPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        return file.size;
+    }
+    double ratio = 1.0;
+    bool compressible = isCompressible(fd, file.size, &ratio);
+    close(fd);
+    if(!compressible || (ratio >= 1.0)) {
+        return file.size;
+    }
+    uint64_t frames = (file.size + INGEST_COMPRESS_FRAME - 1) / INGEST_COMPRESS_FRAME;
+    return (uint64_t)(file.size * ratio) + frames * 8 + 8 + SEEK_FOOTER_SIZE;
+}
+
+IngestCompressor::IngestCompressor(IngestGovernor &governor, const std::atomic<bool> &stop): _governor(governor), _stop(stop) {
+    _ctx = NULL;
+    _in = NULL;
+    _out = NULL;
+    _outSize = 0;
+}
+
+IngestCompressor::~IngestCompressor() {
+#ifdef HAS_COMPRESSION
+    if(_ctx != NULL) {
+        ZSTD_freeCCtx((ZSTD_CCtx*)_ctx);
+    }
+#endif
+    delete[] _in;
+    delete[] _out;
+}
+
+// the context and the buffers are created for the first file, and kept
+bool IngestCompressor::_init() {
+#ifdef HAS_COMPRESSION
+    if(_ctx != NULL) {
+        return true;
+    }
+    ZSTD_CCtx *ctx = ZSTD_createCCtx();
+    if(ctx == NULL) {
+        return false;
+    }
+    ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, INGEST_COMPRESS_LEVEL);
+    ZSTD_CCtx_setParameter(ctx, ZSTD_c_checksumFlag, 1);
+    long workers = INGEST_COMPRESS_THREADS;
+    if(workers <= 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    //a frame is split in jobs, compressed at once. Fails if libzstd is single threaded
+    if((workers > 1) && !ZSTD_isError(ZSTD_CCtx_setParameter(ctx, ZSTD_c_nbWorkers, workers))) {
+        ZSTD_CCtx_setParameter(ctx, ZSTD_c_jobSize, INGEST_COMPRESS_FRAME / workers);
+    }
+    _ctx = ctx;
+    _in = new char[INGEST_COMPRESS_FRAME];
+    _outSize = ZSTD_CStreamOutSize();
+    _out = new char[_outSize];
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool IngestCompressor::compress(int srcFd, int dstFd, const IngestFile &file, const Progress &progress, uint64_t &hash) {
+#ifdef HAS_COMPRESSION
+    if(!_init()) {
+        errno = ENOMEM;
+        return false;
+    }
+    if(ftruncate(dstFd, 0) != 0) {
+        return false;
+    }
+    posix_fadvise(srcFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ZSTD_CCtx *ctx = (ZSTD_CCtx*)_ctx;
+    Checksum checksum;
+    std::vector<unsigned char> seekTable;
+    uint32_t frames = 0;
+    uint64_t offset = 0;
+    uint64_t outOffset = 0;
+    while(offset < file.size) {
+        size_t frameSize = (file.size - offset > INGEST_COMPRESS_FRAME) ? INGEST_COMPRESS_FRAME : (size_t)(file.size - offset);
+        //read the frame, then compress it with the workers
+        for(size_t read = 0; read < frameSize; ) {
+            size_t length = (frameSize - read > INGEST_BUFFER_SIZE) ? INGEST_BUFFER_SIZE : frameSize - read;
+            if(!_governor.acquire(length, _stop)) {
+                errno = ECANCELED;
+                return false;
+            }
+            if(!readFull(srcFd, _in + read, length, offset + read)) {
+                return false;
+            }
+            read += length;
+            progress(length);
+        }
+        checksum.update(_in, frameSize);
+        ZSTD_CCtx_reset(ctx, ZSTD_reset_session_only);
+        ZSTD_CCtx_setPledgedSrcSize(ctx, frameSize);
+        ZSTD_inBuffer input = {_in, frameSize, 0};
+        uint64_t frameOut = 0;
+        size_t remaining;
+        do {
+            ZSTD_outBuffer output = {_out, _outSize, 0};
+            remaining = ZSTD_compressStream2(ctx, &output, &input, ZSTD_e_end);
+            if(ZSTD_isError(remaining)) {
+                log(LOG_ERR, "unable to compress %s: %s", file.path.c_str(), ZSTD_getErrorName(remaining));
+                errno = EIO;
+                return false;
+            }
+            if(!writeFull(dstFd, _out, output.pos, outOffset)) {
+                return false;
+            }
+            outOffset += output.pos;
+            frameOut += output.pos;
+        } while(remaining != 0);
+        putLe32(seekTable, frameOut);
+        putLe32(seekTable, frameSize);
+        ++frames;
+        offset += frameSize;
+    }
+
+    //the seek table is a skippable frame, ignored by the decoders
+    std::vector<unsigned char> frame;
+    putLe32(frame, SKIPPABLE_MAGIC);
+    putLe32(frame, seekTable.size() + SEEK_FOOTER_SIZE);
+    frame.insert(frame.end(), seekTable.begin(), seekTable.end());
+    putLe32(frame, frames);
+    frame.push_back(0); // no checksum in the entries
+    putLe32(frame, SEEKABLE_MAGIC);
+    if(!writeFull(dstFd, (const char*)frame.data(), frame.size(), outOffset)) {
+        return false;
+    }
+    hash = checksum.digest();
+    return true;
+#else
+    (void)srcFd;
+    (void)dstFd;
+    (void)file;
+    (void)progress;
+    (void)hash;
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+int IngestCompressor::hashContent(int fd, uint64_t size, uint64_t &hash) {
+#ifdef HAS_COMPRESSION
+    ZSTD_DCtx *ctx = ZSTD_createDCtx();
+    if(ctx == NULL) {
+        return ENOMEM;
+    }
+    std::vector<char> in(ZSTD_DStreamInSize());
+    std::vector<char> out(ZSTD_DStreamOutSize());
+    Checksum checksum;
+    uint64_t total = 0;
+    uint64_t offset = 0;
+    size_t pending = 0; // of the last frame
+    int error = 0;
+    while(error == 0) {
+        ssize_t result = pread(fd, in.data(), in.size(), offset);
+        if((result == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if(result <= 0) {
+            error = (result == 0) ? 0 : errno;
+            break;
+        }
+        offset += result;
+        ZSTD_inBuffer input = {in.data(), (size_t)result, 0};
+        bool flushed = false;
+        while(!flushed && (error == 0)) {
+            ZSTD_outBuffer output = {out.data(), out.size(), 0};
+            pending = ZSTD_decompressStream(ctx, &output, &input);
+            if(ZSTD_isError(pending)) {
+                log(LOG_ERR, "corrupted compressed copy: %s", ZSTD_getErrorName(pending));
+                error = EBADMSG;
+                break;
+            }
+            checksum.update(out.data(), output.pos);
+            total += output.pos;
+            //a full output may hold more data
+            flushed = (input.pos == input.size) && (output.pos < output.size);
+        }
+    }
+    ZSTD_freeDCtx(ctx);
+    if((error == 0) && ((pending != 0) || (total != size))) {
+        error = EBADMSG;
+    }
+    hash = checksum.digest();
+    return error;
+#else
+    (void)fd;
+    (void)size;
+    (void)hash;
+    return ENOTSUP;
+#endif
+}
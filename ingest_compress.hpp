@@ -0,0 +1,56 @@
+#ifndef _INGEST_COMPRESS_HPP
+#define _INGEST_COMPRESS_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <string>
+
+#include "config.h"
+
+#if defined(HAVE_ZSTD) && !defined(DISABLE_COMPRESSION)
+#define HAS_COMPRESSION 1
+#endif
+
+struct IngestFile;
+class IngestGovernor;
+
+// copy of the files which compress well (logs, documents, raw sidecars), found by
+// the entropy of a few samples. The copy is in the zstd seekable format: the file is
+// cut in frames compressed apart, by the zstd workers, and a seek table ends it, so a
+// part of it can be read without decompressing the rest. zstd -d reads it as usual.
+// Needs libzstd (HAVE_ZSTD), nothing is compressed without it.
+class IngestCompressor {
+    public:
+        static const char *SUFFIX; // of the compressed copies
+
+        // called with the bytes read from the source
+        typedef std::function<void(uint64_t bytes)> Progress;
+
+        // false when the file is too small or of a compressed type
+        static bool mayCompress(const IngestFile&);
+        // is the entropy of the samples low enough ? ratio is the size expected once compressed
+        static bool isCompressible(int fd, uint64_t size, double *ratio = NULL);
+        // bytes the copy of the file is expected to take
+        static uint64_t estimateSize(const std::string &srcPath, const IngestFile&);
+        // hash of the data of a compressed copy, returns 0 or an errno
+        static int hashContent(int fd, uint64_t size, uint64_t &hash);
+
+        IngestCompressor(IngestGovernor&, const std::atomic<bool> &stop);
+        ~IngestCompressor();
+
+        // hash is the one of the source data
+        bool compress(int srcFd, int dstFd, const IngestFile&, const Progress&, uint64_t &hash);
+
+    protected:
+        IngestGovernor &_governor;
+        const std::atomic<bool> &_stop;
+        void *_ctx;
+        char *_in;
+        char *_out;
+        size_t _outSize;
+
+        bool _init();
+};
+
+#endif // _INGEST_COMPRESS_HPP
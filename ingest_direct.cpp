@@ -0,0 +1,310 @@
+#include "ingest_direct.hpp"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "config.h"
+#include "log.hpp"
+#include "checksum.hpp"
+#include "ingest_job.hpp"
+#include "ingest_governor.hpp"
+
+static size_t roundUp(size_t value, size_t unit) {
+    return (value + unit - 1) / unit * unit;
+}
+
+IngestDirectCopy::IngestDirectCopy(IngestGovernor &governor, const std::atomic<bool> &stop): _governor(governor), _stop(stop) {
+    _bufferSize = 0;
+    _align = 0;
+    _abort = false;
+    _srcFd = -1;
+    _srcDirect = false;
+    _readOffset = 0;
+    _size = 0;
+}
+
+IngestDirectCopy::~IngestDirectCopy() {
+    _release();
+}
+
+bool IngestDirectCopy::copy(int srcFd, int dstFd, const IngestFile &file, const Progress &progress, bool &hashed, uint64_t &hash) {
+    hashed = false;
+    if(!_allocate(srcFd, dstFd)) {
+        errno = ENOMEM;
+        return false;
+    }
+    //direct I/O starts on an aligned offset, the end of a resumed copy is written again
+    uint64_t start = file.offset - file.offset % _align;
+    if(ftruncate(dstFd, start) != 0) {
+        return false;
+    }
+    //reserve the file at once, so the fs can give it contiguous extents
+    if((fallocate(dstFd, FALLOC_FL_KEEP_SIZE, start, file.size - start) != 0) && (errno != EOPNOTSUPP) && (errno != ENOSYS)) {
+        return false;
+    }
+    bool dstDirect = _setDirect(dstFd, true);
+    _srcFd = srcFd;
+    _srcDirect = _setDirect(srcFd, true);
+    _readOffset = start;
+    _size = file.size;
+    _abort = false;
+    _filled.clear();
+    _free = _buffers;
+    if(!_srcDirect) {
+        posix_fadvise(srcFd, start, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    pthread_t reader;
+    if(pthread_create(&reader, NULL, IngestDirectCopy::_startReader, (void*)this) != 0) {
+        int error = errno;
+        log(LOG_ERR, "unable to start a read thread: %s", strerror(errno));
+        _setDirect(srcFd, false);
+        _setDirect(dstFd, false);
+        errno = error;
+        return false;
+    }
+
+    Checksum checksum;
+    int error = 0;
+    uint64_t written = start;
+    uint64_t dropped = start; // the destination pages before are on the disk and out of the cache
+    while(written < file.size) {
+        Chunk chunk;
+        {
+            std::unique_lock<std::mutex> lock(_mut);
+            while(_filled.empty()) {
+                _cond.wait(lock);
+            }
+            chunk = _filled.front();
+            _filled.pop_front();
+        }
+        if(chunk.error == 0) {
+            //the governor may hold the copy while the music plays
+            if(!_governor.acquire(chunk.length, _stop)) {
+                chunk.error = ECANCELED;
+            }
+            else if(!_write(dstFd, dstDirect, chunk)) {
+                chunk.error = errno;
+            }
+        }
+        if(chunk.error != 0) {
+            error = chunk.error;
+            break;
+        }
+        if(start == 0) {
+            checksum.update(chunk.data, chunk.length);
+        }
+        {
+            const std::lock_guard<std::mutex> lock(_mut);
+            _free.push_back(chunk.data);
+            _cond.notify_all();
+        }
+        written += chunk.length;
+        if(!_srcDirect) {
+            _dropBehind(srcFd, chunk.offset, chunk.length, false);
+        }
+        if(!dstDirect) {
+            //the chunk goes to the disk while the next one is read, the previous one is dropped
+            sync_file_range(dstFd, chunk.offset, chunk.length, SYNC_FILE_RANGE_WRITE);
+            _dropBehind(dstFd, dropped, chunk.offset - dropped, true);
+            dropped = chunk.offset;
+        }
+        progress(written);
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(_mut);
+        _abort = true;
+        _cond.notify_all();
+    }
+    pthread_join(reader, NULL);
+    _setDirect(srcFd, false);
+    _setDirect(dstFd, false);
+    //the last chunk was padded to the alignment
+    if((error == 0) && (ftruncate(dstFd, file.size) != 0)) {
+        error = errno;
+    }
+    if(error != 0) {
+        errno = error;
+        return false;
+    }
+    hashed = (start == 0);
+    hash = checksum.digest();
+    return true;
+}
+
+// the buffers are kept while the disks stay the same
+bool IngestDirectCopy::_allocate(int srcFd, int dstFd) {
+    size_t align = sysconf(_SC_PAGESIZE);
+    size_t unit = 0;
+    for(int fd : {srcFd, dstFd}) {
+        size_t logical = _queueValue(fd, "logical_block_size");
+        if(logical > align) {
+            align = logical;
+        }
+        size_t optimal = _queueValue(fd, "optimal_io_size");
+        if((optimal > unit) && (optimal <= INGEST_CHUNK_SIZE)) {
+            unit = optimal;
+        }
+    }
+    unit = roundUp((unit > align) ? unit : align, align);
+    size_t size = roundUp(INGEST_BUFFER_SIZE, unit);
+    if(!_buffers.empty() && (size == _bufferSize) && (align == _align)) {
+        return true;
+    }
+    _release();
+    for(unsigned int i = 0; i < INGEST_DIRECT_BUFFERS; i++) {
+        void *buffer;
+        if(posix_memalign(&buffer, align, size) != 0) {
+            log(LOG_ERR, "unable to allocate direct copy buffers");
+            _release();
+            return false;
+        }
+        _buffers.push_back((char*)buffer);
+    }
+    _bufferSize = size;
+    _align = align;
+    return true;
+}
+
+void IngestDirectCopy::_release() {
+    for(char *buffer : _buffers) {
+        free(buffer);
+    }
+    _buffers.clear();
+    _free.clear();
+}
+
+void* IngestDirectCopy::_startReader(void *copy) {
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    ((IngestDirectCopy*)copy)->_read();
+    return NULL;
+}
+
+// read ahead into the free buffers, a chunk with an error ends the copy
+void IngestDirectCopy::_read() {
+    uint64_t offset = _readOffset;
+    while(offset < _size) {
+        Chunk chunk;
+        {
+            std::unique_lock<std::mutex> lock(_mut);
+            while(_free.empty() && !_abort) {
+                _cond.wait(lock);
+            }
+            if(_abort) {
+                return;
+            }
+            chunk.data = _free.back();
+            _free.pop_back();
+        }
+        chunk.offset = offset;
+        chunk.length = (_size - offset > _bufferSize) ? _bufferSize : (size_t)(_size - offset);
+        chunk.error = _stop ? ECANCELED : 0;
+        size_t done = 0;
+        while((chunk.error == 0) && (done < chunk.length)) {
+            //a direct read is aligned, so it is done at once, up to the end of file
+            size_t length = _srcDirect ? roundUp(chunk.length, _align) : chunk.length - done;
+            ssize_t result = pread(_srcFd, chunk.data + done, length, offset + done);
+            if((result == -1) && (errno == EINTR)) {
+                continue;
+            }
+            if(result == -1) {
+                chunk.error = errno;
+            }
+            else if((result == 0) || (_srcDirect && ((size_t)result < chunk.length))) {
+                chunk.error = EAGAIN; //the source shrunk during the copy
+            }
+            else {
+                done += result;
+            }
+        }
+        {
+            const std::lock_guard<std::mutex> lock(_mut);
+            _filled.push_back(chunk);
+            _cond.notify_all();
+        }
+        if(chunk.error != 0) {
+            return;
+        }
+        offset += chunk.length;
+    }
+}
+
+bool IngestDirectCopy::_write(int dstFd, bool direct, const Chunk &chunk) {
+    size_t length = chunk.length;
+    if(direct) {
+        length = roundUp(chunk.length, _align);
+        memset(chunk.data + chunk.length, 0, length - chunk.length);
+    }
+    size_t done = 0;
+    while(done < length) {
+        ssize_t result = pwrite(dstFd, chunk.data + done, length - done, chunk.offset + done);
+        if((result == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if(result <= 0) {
+            if(result == 0) {
+                errno = ENOSPC;
+            }
+            return false;
+        }
+        if(direct && ((size_t)result != length)) {
+            errno = ENOSPC; //a short direct write cannot be continued unaligned
+            return false;
+        }
+        done += result;
+    }
+    return true;
+}
+
+// dirty pages must be written before they can be dropped
+void IngestDirectCopy::_dropBehind(int fd, uint64_t offset, uint64_t length, bool written) {
+    if(length == 0) {
+        return;
+    }
+    if(written) {
+        sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+// false when the fs does not support direct I/O
+bool IngestDirectCopy::_setDirect(int fd, bool direct) {
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1) {
+        return false;
+    }
+    flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+// value of the block queue of the disk holding the file, 0 when unknown
+unsigned long IngestDirectCopy::_queueValue(int fd, const char *name) {
+    struct stat info;
+    if(fstat(fd, &info) != 0) {
+        return 0;
+    }
+    //a partition has no queue, its disk has
+    for(const char *format : {"/sys/dev/block/%u:%u/queue/%s", "/sys/dev/block/%u:%u/../queue/%s"}) {
+        char path[128];
+        snprintf(path, sizeof(path), format, major(info.st_dev), minor(info.st_dev), name);
+        FILE *file = fopen(path, "r");
+        if(file == NULL) {
+            continue;
+        }
+        unsigned long value;
+        int found = fscanf(file, "%lu", &value);
+        fclose(file);
+        if(found == 1) {
+            return value;
+        }
+    }
+    return 0;
+}
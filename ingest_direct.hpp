@@ -0,0 +1,69 @@
+#ifndef _INGEST_DIRECT_HPP
+#define _INGEST_DIRECT_HPP
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+struct IngestFile;
+class IngestGovernor;
+
+// copy of the big files (videos) around the page cache, so they do not evict the music.
+// The destination is preallocated, then the data goes with O_DIRECT through aligned buffers
+// sized to the disks optimal I/O, reused from one file to the next. A thread reads ahead
+// while the data is written. When a fs refuses O_DIRECT, its pages are dropped behind the copy.
+// The source is hashed on the way, so the verification does not read it again.
+class IngestDirectCopy {
+    public:
+        // called with the offset up to which the copy is written
+        typedef std::function<void(uint64_t written)> Progress;
+
+        IngestDirectCopy(IngestGovernor&, const std::atomic<bool> &stop);
+        ~IngestDirectCopy();
+
+        // copy from the offset of the file, rounded down to the alignment.
+        // hashed is set when the whole source was read, with its hash
+        bool copy(int srcFd, int dstFd, const IngestFile&, const Progress&, bool &hashed, uint64_t &hash);
+
+    protected:
+        struct Chunk {
+            char *data;
+            uint64_t offset;
+            size_t length; // bytes read, the last chunk is padded to the alignment
+            int error;
+        };
+
+        IngestGovernor &_governor;
+        const std::atomic<bool> &_stop;
+        std::vector<char*> _buffers;
+        size_t _bufferSize;
+        size_t _align;
+        std::mutex _mut;
+        std::condition_variable _cond;
+        std::deque<Chunk> _filled;
+        std::vector<char*> _free;
+        bool _abort;
+        // the reader state
+        int _srcFd;
+        bool _srcDirect;
+        uint64_t _readOffset;
+        uint64_t _size;
+
+        bool _allocate(int srcFd, int dstFd);
+        void _release();
+        static void* _startReader(void*);
+        void _read();
+        bool _write(int dstFd, bool direct, const Chunk&);
+        static void _dropBehind(int fd, uint64_t offset, uint64_t length, bool written);
+        static bool _setDirect(int fd, bool direct);
+        static unsigned long _queueValue(int fd, const char *name);
+};
+
+#endif // _INGEST_DIRECT_HPP
@@ -0,0 +1,81 @@
+#include "ingest_dirs.hpp"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "log.hpp"
+
+IngestDirCache::IngestDirCache(const std::string &root, unsigned int capacity): _root(root), _capacity(capacity) {
+}
+
+IngestDirCache::~IngestDirCache() {
+    clear();
+}
+
+int IngestDirCache::acquire(const std::string &relDir) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    auto found = _entries.find(relDir);
+    if(found != _entries.end()) {
+        Entry &entry = found->second;
+        if(entry.users++ == 0) {
+            _unused.erase(entry.unused);
+        }
+        return entry.fd;
+    }
+    std::string path = _root + relDir;
+    int fd = open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1) {
+        log(LOG_ERR, "unable to open folder %s: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+    Entry entry;
+    entry.fd = fd;
+    entry.users = 1;
+    _entries[relDir] = entry;
+    _trim();
+    return fd;
+}
+
+void IngestDirCache::release(const std::string &relDir) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    auto found = _entries.find(relDir);
+    if((found == _entries.end()) || (found->second.users == 0)) {
+        return;
+    }
+    Entry &entry = found->second;
+    if(--entry.users == 0) {
+        entry.unused = _unused.insert(_unused.end(), relDir);
+        _trim();
+    }
+}
+
+void IngestDirCache::clear() {
+    const std::lock_guard<std::mutex> lock(_mut);
+    for(auto &entry : _entries) {
+        close(entry.second.fd);
+    }
+    _entries.clear();
+    _unused.clear();
+}
+
+void IngestDirCache::split(const std::string &relPath, std::string &relDir, std::string &name) {
+    size_t pos = relPath.rfind('/');
+    if(pos == std::string::npos) {
+        relDir.clear();
+        name = relPath;
+        return;
+    }
+    relDir = relPath.substr(0, pos);
+    name = relPath.substr(pos + 1);
+}
+
+void IngestDirCache::_trim() {
+    while((_entries.size() > _capacity) && !_unused.empty()) {
+        auto found = _entries.find(_unused.front());
+        close(found->second.fd);
+        _entries.erase(found);
+        _unused.pop_front();
+    }
+}
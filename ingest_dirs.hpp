@@ -0,0 +1,43 @@
+#ifndef _INGEST_DIRS_HPP
+#define _INGEST_DIRS_HPP
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// fds of the folders of a tree, so the files are opened by name (openat) instead of
+// walking their whole path again. Beyond the capacity, the least recently used
+// folders are closed once released.
+class IngestDirCache {
+    public:
+        IngestDirCache(const std::string &root, unsigned int capacity);
+        ~IngestDirCache();
+
+        // fd of the folder (relative to the root, "" for the root), -1 on error.
+        // It stays open until released
+        int acquire(const std::string &relDir);
+        void release(const std::string &relDir);
+        // close every folder, none must be in use
+        void clear();
+
+        // split a path relative to the root in its folder and its name
+        static void split(const std::string &relPath, std::string &relDir, std::string &name);
+
+    protected:
+        struct Entry {
+            int fd;
+            unsigned int users;
+            std::list<std::string>::iterator unused;
+        };
+
+        std::string _root;
+        unsigned int _capacity;
+        std::mutex _mut;
+        std::unordered_map<std::string, Entry> _entries;
+        std::list<std::string> _unused; // released folders, the least recently used first
+
+        void _trim();
+};
+
+#endif // _INGEST_DIRS_HPP
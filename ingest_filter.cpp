@@ -0,0 +1,360 @@
+#include "ingest_filter.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.hpp"
+
+#define MAX_STATES      4096 // a DFA is exponential at worst, more states means bad rules
+#define NO_MAX_SIZE     ((uint64_t)-1)
+
+IngestFilter::IngestFilter() {
+    _clear();
+}
+
+bool IngestFilter::compile(const std::vector<std::string> &rules) {
+    _clear();
+    for(const std::string &text : rules) {
+        Rule rule;
+        if(!_parse(text, rule)) {
+            log(LOG_ERR, "invalid ingest filter rule: %s", text.c_str());
+            _clear();
+            return false;
+        }
+        _rules.push_back(rule);
+        if(!rule.magic.empty() && (rule.magicOffset + rule.magic.size() > _sniffLength)) {
+            _sniffLength = rule.magicOffset + rule.magic.size();
+        }
+    }
+    if(!_build()) {
+        log(LOG_ERR, "too many ingest filter rules, the volumes are copied whole");
+        _clear();
+        return false;
+    }
+    log(LOG_INFO, "ingest filter of %u rules compiled in %u states", (unsigned int)_rules.size(), (unsigned int)_accepted.size());
+    return true;
+}
+
+IngestFilter::State IngestFilter::getStart() const {
+    return _start;
+}
+
+IngestFilter::State IngestFilter::next(State folder, const char *name) const {
+    //nothing matches below a dead state
+    if(folder == 0) {
+        return 0;
+    }
+    State state = _transitions[folder * _classCount + _classes['/']];
+    for(const unsigned char *c = (const unsigned char*)name; (*c != 0) && (state != 0); c++) {
+        state = _transitions[state * _classCount + _classes[*c]];
+    }
+    return state;
+}
+
+bool IngestFilter::isFolderIncluded(State state) const {
+    for(unsigned int index : _accepted[state]) {
+        const Rule &rule = _rules[index];
+        //the conditions are on files
+        if((rule.minSize == 0) && (rule.maxSize == NO_MAX_SIZE) && rule.magic.empty()) {
+            return rule.include;
+        }
+    }
+    return true;
+}
+
+bool IngestFilter::isFileIncluded(State state, int dirFd, const char *name, uint64_t size) const {
+    std::string head;
+    bool sniffed = false;
+    for(unsigned int index : _accepted[state]) {
+        const Rule &rule = _rules[index];
+        if(!rule.folderOnly && _matches(rule, dirFd, name, size, head, sniffed)) {
+            return rule.include;
+        }
+    }
+    return true;
+}
+
+void IngestFilter::_clear() {
+    _rules.clear();
+    memset(_classes, 0, sizeof(_classes));
+    _classCount = 1;
+    _transitions.assign(1, 0);
+    _accepted.assign(1, std::vector<unsigned int>());
+    _start = 0;
+    _sniffLength = 0;
+}
+
+// "+pattern [conditions]" or "-pattern [conditions]", the pattern may contain spaces
+bool IngestFilter::_parse(const std::string &text, Rule &rule) {
+    if((text.size() < 2) || ((text[0] != '+') && (text[0] != '-'))) {
+        return false;
+    }
+    rule.include = (text[0] == '+');
+    rule.folderOnly = false;
+    rule.minSize = 0;
+    rule.maxSize = NO_MAX_SIZE;
+    rule.magicOffset = 0;
+    std::string pattern = text.substr(1);
+    size_t space;
+    while((space = pattern.rfind(' ')) != std::string::npos) {
+        std::string condition = pattern.substr(space + 1);
+        uint64_t size;
+        if(condition.compare(0, 5, "size>") == 0) {
+            if(!_parseSize(condition.c_str() + 5, size) || (size == NO_MAX_SIZE)) {
+                return false;
+            }
+            rule.minSize = size + 1;
+        }
+        else if(condition.compare(0, 5, "size<") == 0) {
+            if(!_parseSize(condition.c_str() + 5, size) || (size == 0)) {
+                return false;
+            }
+            rule.maxSize = size - 1;
+        }
+        else if(condition.compare(0, 6, "magic=") == 0) {
+            const char *bytes = condition.c_str() + 6;
+            const char *colon = strchr(bytes, ':');
+            if(colon != NULL) {
+                char *end;
+                rule.magicOffset = strtoull(bytes, &end, 10);
+                if(end != colon) {
+                    return false;
+                }
+                bytes = colon + 1;
+            }
+            size_t length = strlen(bytes);
+            if((length == 0) || (length % 2 != 0) || (strspn(bytes, "0123456789abcdefABCDEF") != length)) {
+                return false;
+            }
+            rule.magic.clear();
+            for(size_t i = 0; i < length; i += 2) {
+                char byte[3] = {bytes[i], bytes[i + 1], 0};
+                rule.magic.push_back((char)strtoul(byte, NULL, 16));
+            }
+        }
+        else {
+            break;
+        }
+        pattern.erase(space);
+    }
+    if(!pattern.empty() && (pattern[pattern.size() - 1] == '/')) {
+        rule.folderOnly = true;
+        pattern.erase(pattern.size() - 1);
+    }
+    if(pattern.empty()) {
+        return false;
+    }
+    //a name matches at any depth
+    if(pattern[0] != '/') {
+        pattern = "**/" + pattern;
+    }
+    return _parsePattern(pattern, rule.elements);
+}
+
+bool IngestFilter::_parsePattern(const std::string &pattern, std::vector<Element> &elements) {
+    for(size_t i = 0; i < pattern.size(); i++) {
+        Element element;
+        element.repeat = false;
+        element.skip = 0;
+        if(pattern[i] == '*') {
+            element.repeat = true;
+            element.chars.set();
+            if((i + 1 < pattern.size()) && (pattern[i + 1] == '*')) {
+                ++i;
+                //"a/**/b" matches "a/b" too
+                if((i + 1 < pattern.size()) && (pattern[i + 1] == '/')) {
+                    element.skip = 2;
+                }
+            }
+            else {
+                element.chars.reset('/');
+            }
+        }
+        else if(pattern[i] == '?') {
+            element.chars.set();
+            element.chars.reset('/');
+        }
+        else if(pattern[i] == '[') {
+            size_t j = i + 1;
+            bool negated = (j < pattern.size()) && ((pattern[j] == '!') || (pattern[j] == '^'));
+            if(negated) {
+                ++j;
+            }
+            //a "]" first is a member of the class
+            size_t first = j;
+            while((j < pattern.size()) && ((pattern[j] != ']') || (j == first))) {
+                unsigned char low = pattern[j];
+                unsigned char high = low;
+                if((j + 2 < pattern.size()) && (pattern[j + 1] == '-') && (pattern[j + 2] != ']')) {
+                    high = pattern[j + 2];
+                    j += 2;
+                }
+                for(unsigned int c = low; c <= high; c++) {
+                    element.chars.set(tolower(c));
+                    element.chars.set(toupper(c));
+                }
+                ++j;
+            }
+            if(j >= pattern.size()) {
+                return false;
+            }
+            if(negated) {
+                element.chars.flip();
+            }
+            element.chars.reset('/');
+            i = j;
+        }
+        else {
+            if((pattern[i] == '\\') && (++i >= pattern.size())) {
+                return false;
+            }
+            unsigned char c = pattern[i];
+            element.chars.set(tolower(c));
+            element.chars.set(toupper(c));
+        }
+        elements.push_back(element);
+    }
+    return true;
+}
+
+// a count of bytes, with a k, M or G suffix
+bool IngestFilter::_parseSize(const char *text, uint64_t &size) {
+    char *end;
+    size = strtoull(text, &end, 10);
+    if(end == text) {
+        return false;
+    }
+    //each unit falls through to the smaller ones
+    switch(tolower(*end)) {
+        case 'g':
+            size *= 1024;
+        case 'm':
+            size *= 1024;
+        case 'k':
+            size *= 1024;
+            ++end;
+            break;
+    }
+    return *end == 0;
+}
+
+// subset construction: a state is a set of positions in the patterns, a position being
+// a rule and the count of its elements matched
+bool IngestFilter::_build() {
+    std::vector<unsigned int> ruleOf;
+    std::vector<unsigned int> positionOf;
+    std::vector<unsigned int> firsts;
+    for(unsigned int r = 0; r < _rules.size(); r++) {
+        firsts.push_back(ruleOf.size());
+        for(unsigned int p = 0; p <= _rules[r].elements.size(); p++) {
+            ruleOf.push_back(r);
+            positionOf.push_back(p);
+        }
+    }
+    //the bytes accepted by the same elements go through the same transitions
+    std::map<std::vector<bool>, unsigned int> signatures;
+    std::vector<unsigned char> samples;
+    for(unsigned int c = 0; c < 256; c++) {
+        std::vector<bool> signature;
+        for(const Rule &rule : _rules) {
+            for(const Element &element : rule.elements) {
+                signature.push_back(element.chars.test(c));
+            }
+        }
+        std::map<std::vector<bool>, unsigned int>::iterator found = signatures.find(signature);
+        if(found == signatures.end()) {
+            found = signatures.insert(std::make_pair(signature, (unsigned int)samples.size())).first;
+            samples.push_back(c);
+        }
+        _classes[c] = found->second;
+    }
+    _classCount = samples.size();
+
+    //a repeat may match nothing, the position after it is reached too
+    auto close = [&](std::vector<unsigned int> &positions) {
+        for(size_t i = 0; i < positions.size(); i++) {
+            const Rule &rule = _rules[ruleOf[positions[i]]];
+            unsigned int p = positionOf[positions[i]];
+            if((p < rule.elements.size()) && rule.elements[p].repeat) {
+                positions.push_back(positions[i] + 1);
+            }
+            if((p < rule.elements.size()) && (rule.elements[p].skip > 0)) {
+                positions.push_back(positions[i] + rule.elements[p].skip);
+            }
+        }
+        std::sort(positions.begin(), positions.end());
+        positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+    };
+    std::map<std::vector<unsigned int>, State> states;
+    std::vector<std::vector<unsigned int> > sets;
+    auto add = [&](const std::vector<unsigned int> &positions) -> State {
+        std::map<std::vector<unsigned int>, State>::iterator found = states.find(positions);
+        if(found != states.end()) {
+            return found->second;
+        }
+        State state = sets.size();
+        states[positions] = state;
+        sets.push_back(positions);
+        return state;
+    };
+    add(std::vector<unsigned int>()); // the dead state is 0
+    close(firsts);
+    _start = add(firsts);
+
+    _transitions.clear();
+    _accepted.clear();
+    for(State state = 0; state < sets.size(); state++) {
+        if(sets.size() > MAX_STATES) {
+            return false;
+        }
+        const std::vector<unsigned int> positions = sets[state];
+        for(unsigned int c = 0; c < _classCount; c++) {
+            std::vector<unsigned int> nexts;
+            for(unsigned int position : positions) {
+                const Rule &rule = _rules[ruleOf[position]];
+                unsigned int p = positionOf[position];
+                if((p < rule.elements.size()) && rule.elements[p].chars.test(samples[c])) {
+                    nexts.push_back(rule.elements[p].repeat ? position : position + 1);
+                }
+            }
+            close(nexts);
+            _transitions.push_back(add(nexts));
+        }
+        //the positions are sorted, so are the rules
+        std::vector<unsigned int> accepted;
+        for(unsigned int position : positions) {
+            if(positionOf[position] == _rules[ruleOf[position]].elements.size()) {
+                accepted.push_back(ruleOf[position]);
+            }
+        }
+        _accepted.push_back(accepted);
+    }
+    return true;
+}
+
+bool IngestFilter::_matches(const Rule &rule, int dirFd, const char *name, uint64_t size, std::string &head, bool &sniffed) const {
+    if((size < rule.minSize) || (size > rule.maxSize)) {
+        return false;
+    }
+    if(rule.magic.empty()) {
+        return true;
+    }
+    //the head of the file is read once for all the rules
+    if(!sniffed) {
+        sniffed = true;
+        int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+        if(fd != -1) {
+            head.resize(_sniffLength);
+            ssize_t result = pread(fd, &head[0], _sniffLength, 0);
+            head.resize((result > 0) ? result : 0);
+            close(fd);
+        }
+    }
+    return (head.size() >= rule.magicOffset + rule.magic.size()) &&
+        (head.compare(rule.magicOffset, rule.magic.size(), rule.magic) == 0);
+}
@@ -0,0 +1,63 @@
+#ifndef _INGEST_FILTER_HPP
+#define _INGEST_FILTER_HPP
+
+#include <stdint.h>
+#include <bitset>
+#include <string>
+#include <vector>
+
+// which files and folders of a volume are copied. The rules are tried in order, the first
+// matching a path decides: "+pattern" copies, "-pattern" skips (a skipped folder is not read).
+// A pattern without "/" matches a name at any depth, one starting with "/" the path from the
+// volume root, one ending with "/" only folders. "*" and "?" do not match "/", "**" does,
+// "[a-z]" is a class, the case is ignored. Conditions may follow the pattern on files:
+// size<N, size>N (k, M, G suffixes), magic=[offset:]hexbytes.
+// The patterns are compiled in a single DFA, which is run on each name from the state of
+// its folder, so a path costs the length of its last name whatever the number of rules.
+class IngestFilter {
+    public:
+        typedef unsigned int State;
+
+        IngestFilter(); // copies everything
+
+        // false on a rule error, the filter then copies everything
+        bool compile(const std::vector<std::string> &rules);
+        State getStart() const; // state of the volume root
+        State next(State folder, const char *name) const;
+        bool isFolderIncluded(State) const;
+        // the file is opened in its folder only when a magic condition must be checked
+        bool isFileIncluded(State, int dirFd, const char *name, uint64_t size) const;
+
+    protected:
+        struct Element {
+            std::bitset<256> chars;
+            bool repeat; // "*" or "**"
+            unsigned int skip; // elements which may be skipped, "**/" may match nothing
+        };
+        struct Rule {
+            bool include;
+            bool folderOnly;
+            uint64_t minSize;
+            uint64_t maxSize;
+            uint64_t magicOffset;
+            std::string magic;
+            std::vector<Element> elements;
+        };
+
+        std::vector<Rule> _rules;
+        unsigned char _classes[256]; // bytes are grouped by the elements accepting them
+        unsigned int _classCount;
+        std::vector<State> _transitions; // state * _classCount + class
+        std::vector<std::vector<unsigned int> > _accepted; // rules matched by state, in order
+        State _start;
+        uint64_t _sniffLength; // bytes read to check the magic conditions
+
+        void _clear();
+        bool _parse(const std::string &text, Rule&);
+        static bool _parsePattern(const std::string &pattern, std::vector<Element>&);
+        static bool _parseSize(const char *text, uint64_t &size);
+        bool _build();
+        bool _matches(const Rule&, int dirFd, const char *name, uint64_t size, std::string &head, bool &sniffed) const;
+};
+
+#endif // _INGEST_FILTER_HPP
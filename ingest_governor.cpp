@@ -0,0 +1,205 @@
+#include "ingest_governor.hpp"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "config.h"
+#include "log.hpp"
+
+// from linux/ioprio.h, not exported by every libc
+#define IOPRIO_CLASS_SHIFT          13
+#define IOPRIO_CLASS_BE             2
+#define IOPRIO_CLASS_IDLE           3
+#define IOPRIO_WHO_PROCESS          1
+#define IOPRIO_VALUE(class, data)   (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+const unsigned int IngestGovernor::MAX_LEVEL;
+
+// the io priority is by thread, set again only when the level changes it
+static void setThreadPriority(int priority) {
+#ifdef SYS_ioprio_set
+    static thread_local int current = -1;
+    if((priority != current) && (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, priority) == 0)) {
+        current = priority;
+    }
+#endif
+}
+
+static long long diffUsec(const timespec &a, const timespec &b) {
+    return (long long)(a.tv_sec - b.tv_sec) * 1000000 + (a.tv_nsec - b.tv_nsec) / 1000;
+}
+
+static void addUsec(timespec &time, long long usec) {
+    time.tv_sec += usec / 1000000;
+    time.tv_nsec += (usec % 1000000) * 1000;
+    if(time.tv_nsec >= 1000000000) {
+        time.tv_sec += 1;
+        time.tv_nsec -= 1000000000;
+    }
+}
+
+IngestGovernor::IngestGovernor() {
+    _playing = false;
+    _level = 0;
+    _throughput = 0;
+    clock_gettime(CLOCK_MONOTONIC, &_next);
+    _periodStart = _next;
+    _periodBytes = 0;
+    _probing = false;
+    _lastReads = 0;
+    _lastReadTicks = 0;
+}
+
+void IngestGovernor::setPlaying(bool playing) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(playing == _playing) {
+        return;
+    }
+    _playing = playing;
+    _level = playing ? 1 : 0;
+    log(LOG_INFO, "copy throttle level %u", _level.load());
+}
+
+void IngestGovernor::setMusicDevice(const std::string &sysname) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    _statPath = "/sys/class/block/" + sysname + "/stat";
+    uint64_t unused;
+    _readLatency(unused);
+}
+
+bool IngestGovernor::acquire(uint64_t bytes, const std::atomic<bool> &stop) {
+    return _wait(bytes, true, stop);
+}
+
+bool IngestGovernor::tryAcquire(uint64_t bytes, long long &wait) {
+    return _take(bytes, true, wait);
+}
+
+bool IngestGovernor::acquireCheck(uint64_t bytes, const std::atomic<bool> &stop) {
+    return _wait(bytes, false, stop);
+}
+
+bool IngestGovernor::_take(uint64_t bytes, bool copy, long long &wait) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    _tick(now);
+    if(!copy && _probing) { //until the end of the period
+        wait = INGEST_GOVERNOR_PERIOD - diffUsec(now, _periodStart);
+        return false;
+    }
+    uint64_t rate = _getRate();
+    if((rate == 0) || (diffUsec(_next, now) < 0)) {
+        _next = now;
+    }
+    wait = diffUsec(_next, now);
+    if(wait > 0) {
+        return false;
+    }
+    if(rate != 0) {
+        addUsec(_next, (long long)(bytes * 1000000 / rate));
+    }
+    if(copy) {
+        _periodBytes += bytes;
+    }
+    return true;
+}
+
+bool IngestGovernor::_wait(uint64_t bytes, bool copy, const std::atomic<bool> &stop) {
+    setThreadPriority(getIoPriority());
+    long long wait;
+    //sleep by small steps, so a stop is not delayed
+    while(!stop && !_take(bytes, copy, wait)) {
+        usleep((wait > 100000) ? 100000 : wait);
+    }
+    return !stop;
+}
+
+uint64_t IngestGovernor::getChunkSize() const {
+    return (_level == 0) ? INGEST_CHUNK_SIZE : INGEST_BUFFER_SIZE;
+}
+
+int IngestGovernor::getIoPriority() const {
+    return (_level == 0) ? IOPRIO_VALUE(IOPRIO_CLASS_BE, 4) : IOPRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+}
+
+unsigned int IngestGovernor::getLevel() const {
+    return _level;
+}
+
+uint64_t IngestGovernor::getThroughput() const {
+    return _throughput;
+}
+
+// the latency is read from the start of the probe, at the end of the period
+void IngestGovernor::_tick(const timespec &now) {
+    long long elapsed = diffUsec(now, _periodStart);
+    if(elapsed >= INGEST_GOVERNOR_PERIOD) {
+        _update(now);
+        _probing = false;
+        elapsed = 0;
+    }
+    if(!_probing && _playing && (elapsed >= INGEST_GOVERNOR_PERIOD - INGEST_LATENCY_PROBE)) {
+        uint64_t unused;
+        _readLatency(unused);
+        _probing = true;
+    }
+}
+
+void IngestGovernor::_update(const timespec &now) {
+    long long elapsed = diffUsec(now, _periodStart);
+    _throughput = _periodBytes * 1000000 / elapsed;
+    _periodBytes = 0;
+    _periodStart = now;
+
+    uint64_t latency;
+    if(!_probing || !_readLatency(latency) || !_playing) {
+        return;
+    }
+    unsigned int level = _level;
+    if((latency > INGEST_MAX_LATENCY) && (level < IngestGovernor::MAX_LEVEL)) {
+        ++level;
+    }
+    else if((latency < INGEST_MAX_LATENCY / 2) && (level > 1)) {
+        --level;
+    }
+    if(level != _level) {
+        log(LOG_INFO, "copy throttle level %u, read latency %llu usec", level, (unsigned long long)latency);
+        _level = level;
+    }
+}
+
+// mean latency of the reads since the last call, false when there was none
+bool IngestGovernor::_readLatency(uint64_t &latency) {
+    if(_statPath.empty()) {
+        return false;
+    }
+    FILE *file = fopen(_statPath.c_str(), "r");
+    if(file == NULL) {
+        return false;
+    }
+    unsigned long long reads;
+    unsigned long long merges;
+    unsigned long long sectors;
+    unsigned long long ticks; // msec
+    int found = fscanf(file, "%llu %llu %llu %llu", &reads, &merges, &sectors, &ticks);
+    fclose(file);
+    if(found != 4) {
+        return false;
+    }
+    bool measured = (reads > _lastReads) && (_lastReads != 0);
+    if(measured) {
+        latency = (ticks - _lastReadTicks) * 1000 / (reads - _lastReads);
+    }
+    _lastReads = reads;
+    _lastReadTicks = ticks;
+    return measured;
+}
+
+uint64_t IngestGovernor::_getRate() const {
+    if(_level == 0) {
+        return INGEST_MAX_RATE;
+    }
+    return (uint64_t)INGEST_PLAYING_RATE >> (_level - 1);
+}
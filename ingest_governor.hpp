@@ -0,0 +1,62 @@
+#ifndef _INGEST_GOVERNOR_HPP
+#define _INGEST_GOVERNOR_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+// share the disks between the copies and the music.
+// Level 0 copies at full speed. While the music plays, the copies get the idle
+// io priority and a bandwidth cap, halved at each level: the level goes up when the
+// read latency of the big disk (where the music is) goes over INGEST_MAX_LATENCY.
+// The latency is measured at the end of each period, while the checks of the copies,
+// which read the big disk too, are held.
+class IngestGovernor {
+    public:
+        static const unsigned int MAX_LEVEL = 3;
+
+        IngestGovernor();
+
+        void setPlaying(bool);
+        // the partition of the big disk, to watch its read latency
+        void setMusicDevice(const std::string &sysname);
+
+        // wait until bytes can be copied, false if stopped meanwhile.
+        // The io priority of the calling thread is updated too
+        bool acquire(uint64_t bytes, const std::atomic<bool> &stop);
+        // take bytes to copy if they can go now, else give the usec to wait, without waiting
+        bool tryAcquire(uint64_t bytes, long long &wait);
+        // as acquire, for the reads checking the copies: not counted as copied
+        bool acquireCheck(uint64_t bytes, const std::atomic<bool> &stop);
+        // max bytes to copy at once, smaller when throttled to avoid bursts
+        uint64_t getChunkSize() const;
+        // io priority for requests given to io_uring
+        int getIoPriority() const;
+
+        unsigned int getLevel() const;
+        uint64_t getThroughput() const; // bytes/sec copied on the last period
+
+    protected:
+        std::mutex _mut;
+        std::atomic<bool> _playing;
+        std::atomic<unsigned int> _level;
+        std::atomic<uint64_t> _throughput;
+        std::string _statPath;
+        timespec _next; // when the next bytes can be copied
+        timespec _periodStart;
+        uint64_t _periodBytes;
+        bool _probing; // the latency is measured, the checks wait
+        uint64_t _lastReads;
+        uint64_t _lastReadTicks;
+
+        bool _take(uint64_t bytes, bool copy, long long &wait);
+        bool _wait(uint64_t bytes, bool copy, const std::atomic<bool> &stop);
+        void _tick(const timespec &now);
+        void _update(const timespec &now);
+        bool _readLatency(uint64_t &latency);
+        uint64_t _getRate() const;
+};
+
+#endif // _INGEST_GOVERNOR_HPP
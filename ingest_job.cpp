@@ -0,0 +1,1187 @@
+#include "ingest_job.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+
+#include "config.h"
+#include "log.hpp"
+#include "ingest.hpp"
+#include "ingest_uring.hpp"
+#include "ingest_scan.hpp"
+#include "content_index.hpp"
+#include "ingest_governor.hpp"
+#include "ingest_manifest.hpp"
+#include "ingest_verifier.hpp"
+#include "ingest_direct.hpp"
+#include "ingest_tuner.hpp"
+#include "ingest_compress.hpp"
+#include "volume_index.hpp"
+
+#define DIR_MODE    (S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH)
+#define FILE_MODE   (S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)
+#define PART_SUFFIX ".carpi-part" // files being copied, renamed once complete
+
+// io_uring request tags, see _copyUring
+#define URING_STAT      1
+#define URING_OPEN_SRC  2
+#define URING_OPEN_DST  3
+#define URING_READ      4
+#define URING_WRITE     5
+#define URING_MKDIR     6
+
+#define URING_DATA(op, slot, buf)   ((uint64_t)(op) | ((uint64_t)(slot) << 8) | ((uint64_t)(buf) << 24))
+#define URING_OP(data)              ((unsigned int)((data) & 0xff))
+#define URING_SLOT(data)            ((unsigned int)(((data) >> 8) & 0xffff))
+#define URING_BUF(data)             ((unsigned int)(((data) >> 24) & 0xffff))
+
+// a file being copied by io_uring
+struct UringSlot {
+    const IngestFile *file;
+    std::string srcPath;
+    std::string dstPath;
+    std::string partPath;
+    std::string dir; // relative to the roots
+    std::string name;
+    std::string partName;
+    struct statx info;
+    int srcDir;
+    int dstDir;
+    int srcFd;
+    int dstFd;
+    bool small; // shares a buffer with other files
+    bool copying;
+    uint64_t offset; // next byte to read
+    unsigned int pending; // requests in flight
+    int error;
+};
+
+IngestJob::IngestJob(const IngestVolume &volume, const Pipe &pipe, ContentIndex &index, IngestGovernor &governor, IngestManifest &manifest, IngestTunings &tunings, const IngestFilter &filter):
+        _volume(volume), _pipe(pipe), _index(index), _governor(governor), _manifest(manifest), _tunings(tunings), _filter(filter),
+        _srcDirs("/media/" + volume.label, INGEST_DIR_FDS), _dstDirs("/media/" BIG_DISK_NAME "/" + volume.label, INGEST_DIR_FDS), _scheduler(volume.order) {
+    _srcRoot = "/media/" + volume.label;
+    _dstRoot = "/media/" BIG_DISK_NAME "/" + volume.label;
+    _stop = false;
+    _status = IngestJob::running;
+    _copied = 0;
+    _total = 0;
+    _lastReport = 0;
+    _useCopyRange = true;
+    _aborted = false;
+    _failed = false;
+    _scanner = NULL;
+    _verifier = NULL;
+    _tuner = NULL;
+    _poolWorkers = 0;
+    _poolDone = false;
+    _known = 0;
+    _linked = 0;
+    _asideStarted = false;
+    _asideClosing = false;
+    _started = (pthread_create(&_thread, NULL, IngestJob::_startRun, (void*)this) == 0);
+    if(!_started) {
+        log(LOG_ERR, "unable to start the copy of %s", _srcRoot.c_str());
+        _status = IngestJob::failed;
+    }
+}
+
+IngestJob::~IngestJob() {
+    stop();
+    if(!_started) {
+        return;
+    }
+
+    //the copy checks _stop between its reads and writes, it is not long to end
+    if(pthread_join(_thread, NULL) != 0) {
+        log(LOG_ERR, "unable to join the copy thread of %s", _srcRoot.c_str());
+    }
+}
+
+void IngestJob::stop() {
+    _stop = true;
+}
+
+IngestJob::Status IngestJob::getStatus() const {
+    return (IngestJob::Status)_status.load();
+}
+
+const IngestVolume& IngestJob::getVolume() const {
+    return _volume;
+}
+
+uint64_t IngestJob::getCopiedBytes() const {
+    return _copied;
+}
+
+uint64_t IngestJob::getTotalBytes() const {
+    return _total;
+}
+
+void* IngestJob::_startRun(void *job) {
+    signal(SIGCHLD,SIG_DFL); // A child process dies
+    signal(SIGTSTP,SIG_IGN); // Various TTY signals
+    signal(SIGTTOU,SIG_IGN);
+    signal(SIGTTIN,SIG_IGN);
+    signal(SIGHUP, SIG_IGN); // Ignore hangup signal
+    signal(SIGINT,SIG_IGN); // ignore SIGTERM
+    signal(SIGQUIT,SIG_IGN); // ignore SIGTERM
+    signal(SIGTERM,SIG_IGN); // ignore SIGTERM
+
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    ((IngestJob*)job)->_run();
+    return NULL;
+}
+
+void* IngestJob::_startWorker(void *job) {
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    ((IngestJob*)job)->_poolWorker();
+    return NULL;
+}
+
+void* IngestJob::_startAside(void *job) {
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    ((IngestJob*)job)->_asideWorker();
+    return NULL;
+}
+
+// the copy starts with the first folders found, while the scan goes on
+void IngestJob::_run() {
+    IngestScanner scanner(_srcRoot, _filter, INGEST_SCAN_THREADS, &_stop);
+    _scanner = &scanner;
+    if(!_hasSpace()) {
+        _scanner = NULL;
+        if(_stop) {
+            _status = IngestJob::stopped;
+            return;
+        }
+        _status = IngestJob::noSpace;
+        _pipe.send(Ingest::NO_SPACE);
+        return;
+    }
+    log(LOG_INFO, "copying %s", _srcRoot.c_str());
+    _pipe.send(Ingest::PROGRESS);
+
+    IngestUring uring(INGEST_MAX_QUEUE_DEPTH, INGEST_BUFFER_SIZE, INGEST_MAX_QUEUE_DEPTH + INGEST_SMALL_FILES);
+    //the device starts with the best tuning of its previous insertions
+    unsigned int maxRequestSize = uring.isValid() ? INGEST_BUFFER_SIZE : INGEST_CHUNK_SIZE;
+    IngestTuning tuning;
+    if(!_tunings.get(_volume.device, tuning)) {
+        tuning.depth = _volume.queueDepth;
+        tuning.requestSize = maxRequestSize;
+    }
+    IngestTuner tuner(tuning, INGEST_MAX_QUEUE_DEPTH, maxRequestSize, _governor);
+    _tuner = &tuner;
+    bool success = _makeDir("");
+    if(success) {
+        bool journaled = _journal.open("/media/" BIG_DISK_NAME, _volume);
+        {
+            IngestVerifier verifier([this](const IngestFile &file, const std::string &copyPath, int error, uint64_t hash) {
+                _onFileVerified(file, copyPath, error, hash);
+            }, _governor, journaled ? &_journal : NULL, _stop);
+            _verifier = &verifier;
+            success = _copyFiles(uring) && !scanner.isFailed();
+            verifier.wait();
+            success = success && !_failed;
+            _verifier = NULL;
+        }
+        _journal.close();
+        _srcDirs.clear();
+        _dstDirs.clear();
+    }
+    _scanner = NULL;
+    _scanned.clear();
+    _index.flush();
+    if(tuner.getBest(tuning)) {
+        _tunings.set(_volume.device, tuning);
+    }
+    _tuner = NULL;
+    if(_known > 0) {
+        log(LOG_INFO, "%u files of %s were copied by a previous run", _known, _srcRoot.c_str());
+    }
+    if(_linked > 0) {
+        log(LOG_INFO, "%u files of %s were already on the big disk", _linked, _srcRoot.c_str());
+    }
+
+    if(_stop) {
+        _status = IngestJob::stopped;
+        log(LOG_INFO, "copy of %s stopped", _srcRoot.c_str());
+        return;
+    }
+    _status = success ? IngestJob::done : IngestJob::failed;
+    if(success) {
+        log(LOG_INFO, "copy of %s done", _srcRoot.c_str());
+    }
+    else {
+        log(LOG_ERR, "copy of %s failed", _srcRoot.c_str());
+    }
+    _pipe.send(success ? Ingest::DONE : Ingest::FAILED);
+}
+
+// checked here rather than at the plug, the scan would hold the main loop.
+// The volume fits when its used space does, the files are counted only otherwise
+bool IngestJob::_hasSpace() {
+    struct statvfs info;
+    if(statvfs("/media/" BIG_DISK_NAME, &info)) {
+        log(LOG_ERR, "unable to get space available on %s: %s", "/media/" BIG_DISK_NAME, strerror(errno));
+        return true; //the copy fails by itself if the disk is gone
+    }
+    double bigDiskSpace = (double)info.f_bfree * (double)info.f_bsize;
+    if((statvfs(_srcRoot.c_str(), &info) == 0) && ((double)(info.f_blocks - info.f_bfree) * (double)info.f_frsize < bigDiskSpace)) {
+        return true;
+    }
+    //files already on the big disk will not be copied again
+    double used = (double)_getMissingBytes();
+    if(_stop) {
+        return false;
+    }
+    if(bigDiskSpace <= used) {
+        log(LOG_INFO, "not enought space for %s", _srcRoot.c_str());
+        return false;
+    }
+    return true;
+}
+
+// bytes really needed on the big disk, the folders read are kept for the copy
+uint64_t IngestJob::_getMissingBytes() {
+    bool useIndex = _index.open("/media/" BIG_DISK_NAME);
+    VolumeIndex copied;
+    copied.open(VolumeIndex::getPath("/media/" BIG_DISK_NAME, _volume), true);
+
+    uint64_t missing = 0;
+    IngestFolder folder;
+    while(!_stop && _scanner->next(folder)) {
+        for(const IngestFile &file : folder.files) {
+            if(_stop) {
+                break;
+            }
+            if(copied.isCurrent(file, _volume.stableInodes)) {
+                continue;
+            }
+            if(isUpToDate(file, _dstRoot + file.path)) {
+                continue;
+            }
+            if(useIndex && _index.mayContain(_srcRoot + file.path, file)) {
+                continue;
+            }
+            missing += IngestCompressor::estimateSize(_srcRoot + file.path, file);
+        }
+        _scanned.push_back(std::move(folder));
+    }
+    return missing;
+}
+
+bool IngestJob::_makeDir(const std::string &relPath) {
+    std::string path = _dstRoot + relPath;
+    int result = mkdir(path.c_str(), DIR_MODE);
+    if((result != 0) && (errno != EEXIST)){
+        log(LOG_ERR, "Unable to create folder %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// dirs are sorted parent first, a level is created only when the previous one is done
+bool IngestJob::_makeDirs(IngestUring &uring, const std::vector<std::string> &dirs) {
+    if(!uring.isValid() || !uring.canMkdir()) {
+        for(const std::string &dir : dirs) {
+            if(_stop || !_makeDir(dir)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<std::vector<const std::string*> > levels;
+    for(const std::string &dir : dirs) {
+        size_t level = 0;
+        for(char c : dir) {
+            if(c == '/') {
+                ++level;
+            }
+        }
+        if(levels.size() < level) {
+            levels.resize(level);
+        }
+        levels[level - 1].push_back(&dir);
+    }
+
+    std::vector<std::string> paths;
+    bool success = true;
+    for(const std::vector<const std::string*> &level : levels) {
+        paths.clear();
+        paths.reserve(level.size());
+        for(const std::string *dir : level) {
+            paths.push_back(_dstRoot + *dir);
+        }
+        unsigned int inFlight = 0;
+        for(const std::string &path : paths) {
+            if(uring.mkdirAt(path.c_str(), DIR_MODE, URING_DATA(URING_MKDIR, 0, 0)) == NULL) {
+                success = false;
+                break;
+            }
+            ++inFlight;
+        }
+        //the paths must stay valid until the kernel is done with them
+        while(inFlight > 0) {
+            if(!uring.submit(1)) {
+                return false;
+            }
+            uint64_t data;
+            int result;
+            while(uring.complete(data, result)) {
+                --inFlight;
+                if((result < 0) && (result != -EEXIST)) {
+                    log(LOG_ERR, "Unable to create folder: %s", strerror(-result));
+                    success = false;
+                }
+            }
+        }
+        if(!success || _stop) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// get the folders found by the scan since the last call, and queue their files.
+// false when the scan is over, or if nothing was found yet and !wait.
+// The folders are created by io_uring only if no other request is in flight.
+bool IngestJob::_fetch(bool wait, IngestUring *uring) {
+    std::vector<IngestFolder> folders;
+    IngestFolder folder;
+    while(!_stop && !_scanned.empty()) { //by the space check
+        folders.push_back(std::move(_scanned.front()));
+        _scanned.pop_front();
+    }
+    while(!_stop && _scanner->next(folder, wait && folders.empty())) {
+        folders.push_back(std::move(folder));
+    }
+    if(folders.empty()) {
+        return false;
+    }
+    std::vector<std::string> dirs;
+    for(const IngestFolder &found : folders) {
+        if(!found.path.empty()) {
+            dirs.push_back(found.path);
+        }
+    }
+    bool made = true;
+    if(uring != NULL) {
+        made = _makeDirs(*uring, dirs);
+    }
+    else {
+        for(const std::string &dir : dirs) {
+            made = made && !_stop && _makeDir(dir);
+        }
+    }
+    if(!made) {
+        _failed = true; //the files of these folders are not copied
+        return true;
+    }
+    for(IngestFolder &found : folders) {
+        _plan(found.files);
+    }
+    return true;
+}
+
+// files copied by a previous run are skipped, partial copies are resumed.
+// Files already stored on the big disk are linked instead of copied.
+// The others are queued for the copy.
+void IngestJob::_plan(std::vector<IngestFile> &files) {
+    for(IngestFile &file : files) {
+        if(_stop) {
+            return;
+        }
+        _total += file.size;
+        if(_journal.isDone(file)) {
+            _addCopied(file.size);
+            ++_known;
+            continue;
+        }
+        std::string dstPath = _dstRoot + file.path;
+        uint64_t offset = _journal.getResumeOffset(file);
+        struct stat info;
+        if((offset > 0) && (stat((dstPath + PART_SUFFIX).c_str(), &info) == 0) && ((uint64_t)info.st_size >= offset)) {
+            file.offset = offset;
+            _addCopied(offset);
+            _queue(file);
+            continue;
+        }
+        if(!_index.hasSize(file.size)) {
+            _queue(file); //the copy checks if it is up to date
+            continue;
+        }
+        if(isUpToDate(file, dstPath)) {
+            _addCopied(file.size);
+            _onFileCopied(file);
+            continue;
+        }
+        std::string storedPath;
+        if(_index.find(_srcRoot + file.path, file, storedPath) && (storedPath != _volume.label + file.path) &&
+            _linkStored(storedPath, file, dstPath)) {
+            _addCopied(file.size);
+            ++_linked;
+            continue;
+        }
+        _queue(file);
+    }
+}
+
+void IngestJob::_queue(const IngestFile &file) {
+    _files.push_back(file);
+    _scheduler.push(&_files.back());
+}
+
+// reflink when the fs can, so the copy has its own times, hard link otherwise: the
+// journal then knows the file is done, its times are the ones of the stored file.
+// The link is made under the part name, so a failure leaves nothing under the final one
+bool IngestJob::_linkStored(const std::string &storedPath, const IngestFile &file, const std::string &dstPath) {
+    std::string srcPath = "/media/" BIG_DISK_NAME "/" + storedPath;
+    std::string partPath = dstPath + PART_SUFFIX;
+    if((unlink(partPath.c_str()) != 0) && (errno != ENOENT)) {
+        return false;
+    }
+    bool linked = false;
+#ifdef FICLONE
+    int srcFd = open(srcPath.c_str(), O_RDONLY | O_CLOEXEC);
+    int dstFd = (srcFd == -1) ? -1 : open(partPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, FILE_MODE);
+    if(dstFd != -1) {
+        linked = (ioctl(dstFd, FICLONE, srcFd) == 0);
+        if(linked) {
+            _setTimes(dstFd, file, partPath);
+        }
+        close(dstFd);
+        if(!linked) {
+            unlink(partPath.c_str());
+        }
+    }
+    if(srcFd != -1) {
+        close(srcFd);
+    }
+#endif
+    if(!linked && (link(srcPath.c_str(), partPath.c_str()) != 0)) {
+        return false;
+    }
+    if(rename(partPath.c_str(), dstPath.c_str()) != 0) {
+        log(LOG_ERR, "unable to rename %s: %s", partPath.c_str(), strerror(errno));
+        unlink(partPath.c_str());
+        return false;
+    }
+    _onFileCopied(file);
+    return true;
+}
+
+bool IngestJob::_copyFiles(IngestUring &uring) {
+    bool success = uring.isValid() ? _copyUring(uring) : _copyPool();
+    _closeAside();
+    return success && !_failed;
+}
+
+// every file is stated, then opened, then copied by chunks of one buffer: a read
+// linked to a write, so the data goes through registered buffers without waiting us.
+// Several files are copied at once, up to the queue depth. The small files take a
+// segment of a buffer only, so many of them are in flight and their requests go together.
+// The files are opened by name, from the cached fds of their folders.
+// The big files, and the ones which may be compressed, are left to a thread of their
+// own, so they do not hold the small ones.
+bool IngestJob::_copyUring(IngestUring &uring) {
+    unsigned int depth = uring.getDepth();
+    unsigned int bufferSize = uring.getBufferSize();
+    unsigned int segments = bufferSize / INGEST_SMALL_FILE_SIZE; // by buffer
+    if(segments == 0) {
+        segments = 1;
+    }
+    unsigned int segmentSize = bufferSize / segments;
+    std::vector<UringSlot> slots(depth + INGEST_SMALL_FILES);
+    std::vector<unsigned int> freeSlots;
+    std::vector<unsigned int> freeBuffers;
+    //a chunk is a whole buffer or a segment, numbered as buffer * segments + segment
+    std::vector<unsigned int> freeSegments; // of the split buffers
+    std::vector<unsigned int> segmentUsers(depth, 0); // 0 when the buffer is not split
+    std::vector<unsigned int> chunkLengths(depth * segments, 0);
+    std::vector<uint64_t> chunkOffsets(depth * segments, 0);
+    std::vector<int> chunkSlots(depth * segments, -1); // -1 when the chunk is free
+    for(unsigned int i = slots.size(); i > 0; i--) {
+        slots[i - 1].srcFd = -1;
+        slots[i - 1].dstFd = -1;
+        freeSlots.push_back(i - 1);
+    }
+    for(unsigned int i = depth; i > 0; i--) {
+        freeBuffers.push_back(i - 1);
+    }
+    unsigned int inFlight = 0;
+    unsigned int bigFiles = 0; // in flight, up to the tuned depth
+    const IngestFile *held = NULL; // waiting for a big file to end
+    bool success = true;
+    bool ringFailed = false;
+
+    auto takeChunk = [&](bool small, unsigned int &chunk) -> bool {
+        if(small && !freeSegments.empty()) {
+            chunk = freeSegments.back();
+            freeSegments.pop_back();
+            ++segmentUsers[chunk / segments];
+            return true;
+        }
+        if(freeBuffers.empty() || (depth - freeBuffers.size() >= _tuner->getDepth())) {
+            return false;
+        }
+        unsigned int buffer = freeBuffers.back();
+        freeBuffers.pop_back();
+        chunk = buffer * segments;
+        if(small) {
+            segmentUsers[buffer] = 1;
+            for(unsigned int i = segments; i > 1; i--) {
+                freeSegments.push_back(chunk + i - 1);
+            }
+        }
+        return true;
+    };
+
+    auto releaseChunk = [&](unsigned int chunk) {
+        unsigned int buffer = chunk / segments;
+        chunkSlots[chunk] = -1;
+        if(segmentUsers[buffer] == 0) {
+            freeBuffers.push_back(buffer);
+            return;
+        }
+        freeSegments.push_back(chunk);
+        if(--segmentUsers[buffer] == 0) { //the buffer is whole again
+            freeSegments.erase(std::remove_if(freeSegments.begin(), freeSegments.end(), [&](unsigned int segment) {
+                return segment / segments == buffer;
+            }), freeSegments.end());
+            freeBuffers.push_back(buffer);
+        }
+    };
+
+    auto openSlot = [&](unsigned int index) -> bool {
+        UringSlot &slot = slots[index];
+        if((uring.openAt(slot.srcDir, slot.name.c_str(), O_RDONLY | O_CLOEXEC, 0, URING_DATA(URING_OPEN_SRC, index, 0)) == NULL) ||
+            (uring.openAt(slot.dstDir, slot.partName.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, FILE_MODE, URING_DATA(URING_OPEN_DST, index, 0)) == NULL)) {
+            return false;
+        }
+        slot.pending += 2;
+        inFlight += 2;
+        return true;
+    };
+
+    auto endSlot = [&](unsigned int index) {
+        UringSlot &slot = slots[index];
+        bool copied = slot.copying && (slot.error == 0) && (slot.offset >= slot.file->size);
+        if(copied && !_finishFile(slot.dstFd, *slot.file, slot.partPath)) {
+            slot.error = errno;
+        }
+        if(slot.error != 0) {
+            log(LOG_ERR, "unable to copy %s: %s", slot.srcPath.c_str(), strerror(slot.error));
+            _onFileError(slot.error);
+            success = false;
+        }
+        if(slot.srcFd != -1) {
+            close(slot.srcFd);
+        }
+        if(slot.dstFd != -1) {
+            close(slot.dstFd);
+        }
+        if(slot.srcDir != -1) {
+            _srcDirs.release(slot.dir);
+        }
+        if(slot.dstDir != -1) {
+            _dstDirs.release(slot.dir);
+        }
+        if(!slot.small) {
+            --bigFiles;
+        }
+        slot.srcFd = -1;
+        slot.dstFd = -1;
+        slot.copying = false;
+        freeSlots.push_back(index);
+    };
+
+    while(!ringFailed) {
+        bool canStart = !_stop && !_aborted;
+        long long throttle = 0; // usec before the governor lets the next chunk go
+        //start new files by checking the destination, resumed files are opened directly.
+        //The files found meanwhile are scheduled first, the scan is waited only when idle
+        while(canStart && !freeSlots.empty()) {
+            const IngestFile *file = held;
+            held = NULL;
+            if(file == NULL) {
+                _fetch(false, (inFlight == 0) ? &uring : NULL);
+                file = _scheduler.take();
+            }
+            if(file == NULL) {
+                if((inFlight > 0) || !_fetch(true, &uring)) {
+                    break;
+                }
+                continue;
+            }
+            if((file->size >= INGEST_LARGE_FILE_SIZE) || IngestCompressor::mayCompress(*file)) {
+                _pushAside(file);
+                continue;
+            }
+            bool small = (file->size <= segmentSize);
+            if(!small && (bigFiles >= _tuner->getDepth())) {
+                held = file;
+                break;
+            }
+            unsigned int index = freeSlots.back();
+            freeSlots.pop_back();
+            UringSlot &slot = slots[index];
+            slot.file = file;
+            slot.small = small;
+            slot.srcPath = _srcRoot + slot.file->path;
+            slot.dstPath = _dstRoot + slot.file->path;
+            slot.partPath = slot.dstPath + PART_SUFFIX;
+            IngestDirCache::split(slot.file->path, slot.dir, slot.name);
+            slot.partName = slot.name + PART_SUFFIX;
+            slot.srcFd = -1;
+            slot.dstFd = -1;
+            slot.copying = false;
+            slot.offset = slot.file->offset;
+            slot.pending = 0;
+            slot.error = 0;
+            if(!small) {
+                ++bigFiles;
+            }
+            slot.srcDir = _srcDirs.acquire(slot.dir);
+            slot.dstDir = (slot.srcDir == -1) ? -1 : _dstDirs.acquire(slot.dir);
+            if(slot.dstDir == -1) {
+                slot.error = errno;
+                endSlot(index);
+                continue;
+            }
+            if(slot.file->offset > 0) {
+                ringFailed = !openSlot(index);
+            }
+            else if(uring.statxAt(slot.dstDir, slot.name.c_str(), &slot.info, URING_DATA(URING_STAT, index, 0)) != NULL) {
+                slot.pending = 1;
+                ++inFlight;
+            }
+            else {
+                ringFailed = true;
+            }
+            if(ringFailed) {
+                break;
+            }
+        }
+        //feed the copies with the free chunks
+        for(unsigned int index = 0; canStart && !ringFailed && (throttle <= 0) && (index < slots.size()) && (!freeBuffers.empty() || !freeSegments.empty()); index++) {
+            UringSlot &slot = slots[index];
+            unsigned int chunk;
+            while(slot.copying && (slot.error == 0) && (slot.offset < slot.file->size) && takeChunk(slot.small, chunk)) {
+                uint64_t length = slot.file->size - slot.offset;
+                if(length > _tuner->getRequestSize()) {
+                    length = _tuner->getRequestSize();
+                }
+                //the governor may hold the copy while the music plays: nothing more is
+                //submitted meanwhile, but the completions are still taken
+                if(!_governor.tryAcquire(length, throttle)) {
+                    releaseChunk(chunk);
+                    break;
+                }
+                uring.setIoPriority(_governor.getIoPriority());
+                //a flush between the read and its linked write would let the write go first
+                if(!uring.reserve(2)) {
+                    releaseChunk(chunk);
+                    ringFailed = true;
+                    break;
+                }
+                chunkLengths[chunk] = length;
+                chunkOffsets[chunk] = slot.offset;
+                chunkSlots[chunk] = index;
+                unsigned int buffer = chunk / segments;
+                unsigned int bufOffset = (chunk % segments) * segmentSize;
+                io_uring_sqe *read = uring.read(slot.srcFd, buffer, bufOffset, length, slot.offset, URING_DATA(URING_READ, index, chunk));
+                if(read == NULL) {
+                    ringFailed = true;
+                    break;
+                }
+                uring.link(read);
+                if(uring.write(slot.dstFd, buffer, bufOffset, length, slot.offset, URING_DATA(URING_WRITE, index, chunk)) == NULL) {
+                    ringFailed = true;
+                    break;
+                }
+                slot.offset += length;
+                slot.pending += 2;
+                inFlight += 2;
+            }
+        }
+        if(inFlight == 0) {
+            if(throttle <= 0) {
+                break;
+            }
+            usleep((throttle > 100000) ? 100000 : throttle);
+            continue;
+        }
+        if(!uring.submit(1)) {
+            ringFailed = true;
+            break;
+        }
+
+        uint64_t data;
+        int result;
+        while(uring.complete(data, result)) {
+            --inFlight;
+            unsigned int index = URING_SLOT(data);
+            UringSlot &slot = slots[index];
+            --slot.pending;
+            switch(URING_OP(data)) {
+                case URING_STAT:
+                    if((result == 0) && (slot.info.stx_size == slot.file->size) && (slot.info.stx_mtime.tv_sec == slot.file->mtime)) {
+                        _addCopied(slot.file->size);
+                        _onFileCopied(*slot.file);
+                        break;
+                    }
+                    if(!openSlot(index)) {
+                        ringFailed = true;
+                        slot.error = EIO;
+                    }
+                    break;
+
+                case URING_OPEN_SRC:
+                case URING_OPEN_DST:
+                    if(result < 0) {
+                        log(LOG_ERR, "unable to open %s: %s", URING_OP(data) == URING_OPEN_SRC ? slot.srcPath.c_str() : slot.partPath.c_str(), strerror(-result));
+                        slot.error = -result;
+                    }
+                    else if(URING_OP(data) == URING_OPEN_SRC) {
+                        slot.srcFd = result;
+                    }
+                    else {
+                        slot.dstFd = result;
+                    }
+                    if((slot.pending == 0) && (slot.error == 0)) {
+                        //drop what was written after the last commit of a resumed copy
+                        if(ftruncate(slot.dstFd, slot.file->offset) != 0) {
+                            slot.error = errno;
+                        }
+                        slot.copying = (slot.error == 0);
+                    }
+                    break;
+
+                case URING_READ:
+                    if(result < 0) {
+                        slot.error = -result;
+                    }
+                    else if((unsigned int)result != chunkLengths[URING_BUF(data)]) {
+                        slot.error = EAGAIN; //the source changed during the copy
+                    }
+                    break;
+
+                case URING_WRITE:
+                    releaseChunk(URING_BUF(data));
+                    if(result == (int)chunkLengths[URING_BUF(data)]) {
+                        _addCopied(result);
+                        _tuner->addBytes(result);
+                        if(slot.error == 0) {
+                            //everything before the first chunk in flight is written
+                            uint64_t written = slot.offset;
+                            for(unsigned int chunk = 0; !slot.small && (chunk < chunkSlots.size()); chunk++) {
+                                if((chunkSlots[chunk] == (int)index) && (chunkOffsets[chunk] < written)) {
+                                    written = chunkOffsets[chunk];
+                                }
+                            }
+                            _journal.setProgress(*slot.file, written);
+                            _journal.commit();
+                        }
+                    }
+                    else if(result != -ECANCELED) { //canceled when the linked read failed
+                        slot.error = (result < 0) ? -result : ENOSPC;
+                    }
+                    break;
+            }
+
+            //is the file over ?
+            if((slot.pending > 0) || (slot.copying && (slot.error == 0) && (slot.offset < slot.file->size) && canStart)) {
+                continue;
+            }
+            endSlot(index);
+        }
+    }
+
+    if(ringFailed) {
+        //the kernel must release the buffers and the paths before we free them
+        uint64_t data;
+        int result;
+        while((inFlight > 0) && uring.submit(1)) {
+            while(uring.complete(data, result)) {
+                --inFlight;
+            }
+        }
+        for(UringSlot &slot : slots) {
+            if(slot.srcFd != -1) {
+                close(slot.srcFd);
+            }
+            if(slot.dstFd != -1) {
+                close(slot.dstFd);
+            }
+        }
+        return false;
+    }
+    return success && !_stop && !_aborted;
+}
+
+// fallback without io_uring: threads share the file list, up to the tuned depth
+bool IngestJob::_copyPool() {
+    std::vector<pthread_t> workers;
+    for(unsigned int i = 1; i < INGEST_MAX_QUEUE_DEPTH; i++) {
+        pthread_t worker;
+        if(pthread_create(&worker, NULL, IngestJob::_startWorker, (void*)this) != 0) {
+            log(LOG_ERR, "unable to start a copy thread: %s", strerror(errno));
+            break;
+        }
+        workers.push_back(worker);
+    }
+    _poolWorker();
+    for(pthread_t worker : workers) {
+        pthread_join(worker, NULL);
+    }
+    return !_failed && !_stop;
+}
+
+void IngestJob::_poolWorker() {
+    unsigned int id = _poolWorkers++;
+    IngestDirectCopy direct(_governor, _stop);
+    IngestCompressor compressor(_governor, _stop);
+    while(!_stop && !_aborted && !_poolDone) {
+        if(id >= _tuner->getDepth()) { //not needed for now
+            usleep(100000);
+            continue;
+        }
+        const IngestFile *file = _poolTake();
+        if(file == NULL) {
+            _poolDone = true;
+            return;
+        }
+        if(!_copyFile(*file, direct, compressor)) {
+            _onFileError(errno);
+        }
+    }
+}
+
+// the queue only grows, so the files taken stay valid
+const IngestFile* IngestJob::_poolTake() {
+    const std::lock_guard<std::mutex> lock(_poolMut);
+    _fetch(false, NULL);
+    const IngestFile *file;
+    while((file = _scheduler.take()) == NULL) {
+        if(_stop || !_fetch(true, NULL)) {
+            return NULL;
+        }
+    }
+    return file;
+}
+
+void IngestJob::_pushAside(const IngestFile *file) {
+    const std::lock_guard<std::mutex> lock(_asideMut);
+    if(!_asideStarted) {
+        _asideStarted = (pthread_create(&_asideThread, NULL, IngestJob::_startAside, (void*)this) == 0);
+        if(!_asideStarted) {
+            log(LOG_ERR, "unable to start a copy thread: %s", strerror(errno));
+        }
+    }
+    _asideFiles.push_back(file);
+    _asideCond.notify_one();
+}
+
+// copy the files left aside one after the other, a single stream is what the disks do best
+void IngestJob::_asideWorker() {
+    IngestDirectCopy direct(_governor, _stop);
+    IngestCompressor compressor(_governor, _stop);
+    std::unique_lock<std::mutex> lock(_asideMut);
+    while(true) {
+        while(_asideFiles.empty() && !_asideClosing) {
+            _asideCond.wait(lock);
+        }
+        if(_asideFiles.empty()) {
+            return;
+        }
+        const IngestFile *file = _asideFiles.front();
+        _asideFiles.pop_front();
+        if(_stop || _aborted) {
+            continue;
+        }
+        lock.unlock();
+        if(!_copyFile(*file, direct, compressor)) {
+            _onFileError(errno);
+        }
+        lock.lock();
+    }
+}
+
+// wait for the files left aside, they are copied here if the thread could not start
+void IngestJob::_closeAside() {
+    {
+        const std::lock_guard<std::mutex> lock(_asideMut);
+        _asideClosing = true;
+        _asideCond.notify_all();
+    }
+    if(_asideStarted) {
+        pthread_join(_asideThread, NULL);
+        _asideStarted = false;
+    }
+    else {
+        _asideWorker();
+    }
+}
+
+void IngestJob::_onFileCopied(const IngestFile &file, uint64_t hash) {
+    _index.add(_volume.label + file.path, file.size, file.mtime, hash);
+    _journal.setDone(file);
+}
+
+void IngestJob::_onFileError(int error) {
+    _failed = true;
+    //no need to try the other files if one of the disks is gone or full
+    if((error == EIO) || (error == ENODEV) || (error == ENOSPC)) {
+        _aborted = true;
+    }
+}
+
+bool IngestJob::isUpToDate(const IngestFile &file, const std::string &dstPath) {
+    return isUpToDate(file, AT_FDCWD, dstPath);
+}
+
+bool IngestJob::isUpToDate(const IngestFile &file, int dirFd, const std::string &dstName) {
+    struct stat info;
+    if(fstatat(dirFd, dstName.c_str(), &info, 0) != 0) {
+        return false;
+    }
+    return ((uint64_t)info.st_size == file.size) && (info.st_mtime == file.mtime);
+}
+
+// the files are opened by name, from the cached fds of their folders
+bool IngestJob::_copyFile(const IngestFile &file, IngestDirectCopy &direct, IngestCompressor &compressor) {
+    std::string dir;
+    std::string name;
+    IngestDirCache::split(file.path, dir, name);
+    int srcDir = _srcDirs.acquire(dir);
+    if(srcDir == -1) {
+        return false;
+    }
+    int dstDir = _dstDirs.acquire(dir);
+    bool success = (dstDir != -1) && _copyFileAt(file, srcDir, dstDir, name, direct, compressor);
+    int error = errno;
+    if(dstDir != -1) {
+        _dstDirs.release(dir);
+    }
+    _srcDirs.release(dir);
+    errno = error;
+    return success;
+}
+
+bool IngestJob::_copyFileAt(const IngestFile &file, int srcDir, int dstDir, const std::string &name, IngestDirectCopy &direct, IngestCompressor &compressor) {
+    std::string srcPath = _srcRoot + file.path;
+    std::string dstPath = _dstRoot + file.path;
+    //a resumed copy goes on as it started
+    bool compress = (file.offset == 0) && IngestCompressor::mayCompress(file);
+    struct stat info;
+    if((file.offset == 0) && (isUpToDate(file, dstDir, name) ||
+        (compress && (fstatat(dstDir, (name + IngestCompressor::SUFFIX).c_str(), &info, 0) == 0) && (info.st_mtime == file.mtime)))) {
+        _addCopied(file.size);
+        _journal.setDone(file);
+        if(!compress) {
+            _onFileCopied(file);
+        }
+        return true;
+    }
+
+    int srcFd = openat(srcDir, name.c_str(), O_RDONLY | O_CLOEXEC);
+    if(srcFd == -1) {
+        log(LOG_ERR, "unable to open %s: %s", srcPath.c_str(), strerror(errno));
+        return false;
+    }
+    //the entropy of a few samples tells if the file is worth compressing
+    compress = compress && IngestCompressor::isCompressible(srcFd, file.size);
+    std::string dstName = compress ? name + IngestCompressor::SUFFIX : name;
+    std::string partPath = dstPath + (compress ? IngestCompressor::SUFFIX : "") + PART_SUFFIX;
+    int dstFd = openat(dstDir, (dstName + PART_SUFFIX).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, FILE_MODE);
+    //drop what was written after the last commit of a resumed copy
+    if((dstFd == -1) || (ftruncate(dstFd, file.offset) != 0)) {
+        int error = errno;
+        log(LOG_ERR, "unable to create %s: %s", partPath.c_str(), strerror(errno));
+        close(srcFd);
+        if(dstFd != -1) {
+            close(dstFd);
+        }
+        errno = error;
+        return false;
+    }
+
+    bool success;
+    if(compress) {
+        success = _copyCompressed(srcFd, dstFd, file, partPath, compressor);
+    }
+    else if(file.size >= INGEST_LARGE_FILE_SIZE) {
+        success = _copyLarge(srcFd, dstFd, file, partPath, direct);
+    }
+    else {
+        success = _copyData(srcFd, dstFd, file) && _finishFile(dstFd, file, partPath);
+    }
+    int error = errno;
+    if(!success && !_stop) {
+        log(LOG_ERR, "unable to copy %s: %s", srcPath.c_str(), strerror(error));
+    }
+    close(srcFd);
+    close(dstFd);
+    errno = error;
+    return success;
+}
+
+// copy_file_range keeps the data in the kernel (and lets the fs share extents),
+// sendfile is the fallback for kernels or fs pairs which does not support it
+bool IngestJob::_copyData(int srcFd, int dstFd, const IngestFile &file) {
+    loff_t srcOffset = file.offset;
+    loff_t dstOffset = file.offset;
+    while(((uint64_t)srcOffset < file.size) && !_stop) {
+        uint64_t chunk = file.size - srcOffset;
+        if(chunk > _governor.getChunkSize()) {
+            chunk = _governor.getChunkSize();
+        }
+        if(chunk > _tuner->getRequestSize()) {
+            chunk = _tuner->getRequestSize();
+        }
+        if(!_governor.acquire(chunk, _stop)) {
+            break;
+        }
+        ssize_t copied = -1;
+#ifdef __NR_copy_file_range
+        if(_useCopyRange) {
+            copied = syscall(__NR_copy_file_range, srcFd, &srcOffset, dstFd, &dstOffset, chunk, 0);
+            if((copied == -1) && ((errno == ENOSYS) || (errno == EXDEV) || (errno == EINVAL) || (errno == EOPNOTSUPP))) {
+                _useCopyRange = false;
+            }
+        }
+#else
+        _useCopyRange = false;
+#endif
+        if(!_useCopyRange) {
+            if(lseek(dstFd, srcOffset, SEEK_SET) == -1) {
+                return false;
+            }
+            copied = sendfile(dstFd, srcFd, &srcOffset, chunk);
+            dstOffset = srcOffset;
+        }
+        if(copied == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if(copied == 0) { //source file shrunk
+            errno = EAGAIN;
+            return false;
+        }
+        _addCopied(copied);
+        _tuner->addBytes(copied);
+        _journal.setProgress(file, srcOffset);
+        _journal.commit();
+    }
+    return !_stop;
+}
+
+// the big files go around the page cache, their source is hashed by the copy
+bool IngestJob::_copyLarge(int srcFd, int dstFd, const IngestFile &file, const std::string &partPath, IngestDirectCopy &direct) {
+    uint64_t counted = file.offset; // by the plan
+    bool hashed;
+    uint64_t hash;
+    bool copied = direct.copy(srcFd, dstFd, file, [&](uint64_t written) {
+        if(written > counted) {
+            _addCopied(written - counted);
+            _tuner->addBytes(written - counted);
+            counted = written;
+        }
+        _journal.setProgress(file, written);
+        _journal.commit();
+    }, hashed, hash);
+    if(!copied) {
+        return false;
+    }
+    if(!hashed) { //resumed, the source is read again
+        return _finishFile(dstFd, file, partPath);
+    }
+    _setTimes(dstFd, file, partPath);
+    _verifier->pushHashed(file, _srcRoot + file.path, hash, partPath);
+    return true;
+}
+
+// the source is hashed by the compression, the copy by its decompression
+bool IngestJob::_copyCompressed(int srcFd, int dstFd, const IngestFile &file, const std::string &partPath, IngestCompressor &compressor) {
+    uint64_t hash;
+    bool compressed = compressor.compress(srcFd, dstFd, file, [&](uint64_t bytes) {
+        _addCopied(bytes);
+        _tuner->addBytes(bytes);
+    }, hash);
+    if(!compressed) {
+        return false;
+    }
+    _setTimes(dstFd, file, partPath);
+    _verifier->pushCompressed(file, _srcRoot + file.path, hash, partPath);
+    return true;
+}
+
+// the copy is verified before it gets its final name
+bool IngestJob::_finishFile(int dstFd, const IngestFile &file, const std::string &partPath) {
+    _setTimes(dstFd, file, partPath);
+    _verifier->push(file, _srcRoot + file.path, partPath);
+    return true;
+}
+
+void IngestJob::_onFileVerified(const IngestFile &file, const std::string &partPath, int error, uint64_t hash) {
+    std::string dstPath = partPath.substr(0, partPath.size() - strlen(PART_SUFFIX));
+    bool compressed = (dstPath.size() != _dstRoot.size() + file.path.size());
+    if(error == EBADMSG) {
+        unlink(partPath.c_str()); //copied again by the next run
+        _failed = true;
+        return;
+    }
+    if(error != 0) {
+        _onFileError(error);
+        return;
+    }
+    if(rename(partPath.c_str(), dstPath.c_str()) != 0) {
+        log(LOG_ERR, "unable to rename %s: %s", partPath.c_str(), strerror(errno));
+        _onFileError(errno);
+        return;
+    }
+    _manifest.add(hash, _volume.label + dstPath.substr(_dstRoot.size()));
+    if(compressed) {
+        _journal.setDone(file); //the index knows the stored files by their data
+    }
+    else {
+        _onFileCopied(file, (hash == 0) ? 1 : hash); // 0 means unknown for the index
+    }
+    //grouped with the others, the journal is forced when it closes at the end or at a stop
+    _journal.commit();
+}
+
+// one futimens by file, io_uring has no operation for it
+void IngestJob::_setTimes(int dstFd, const IngestFile &file, const std::string &dstPath) {
+    timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = file.mtime;
+    times[1].tv_nsec = 0;
+    if(futimens(dstFd, times) != 0) {
+        log(LOG_ERR, "unable to set time of %s: %s", dstPath.c_str(), strerror(errno));
+    }
+}
+
+void IngestJob::_addCopied(uint64_t bytes) {
+    uint64_t copied = (_copied += bytes);
+    uint64_t last = _lastReport;
+    if((copied - last >= INGEST_PROGRESS_STEP) && _lastReport.compare_exchange_strong(last, copied)) {
+        _pipe.send(Ingest::PROGRESS);
+    }
+}
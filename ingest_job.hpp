@@ -0,0 +1,155 @@
+#ifndef _INGEST_JOB_HPP
+#define _INGEST_JOB_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "pipe.hpp"
+#include "ingest_dirs.hpp"
+#include "ingest_journal.hpp"
+#include "ingest_scheduler.hpp"
+
+class IngestUring;
+class IngestScanner;
+class ContentIndex;
+class IngestGovernor;
+class IngestManifest;
+class IngestVerifier;
+class IngestDirectCopy;
+class IngestCompressor;
+class IngestTunings;
+class IngestTuner;
+class IngestFilter;
+
+// a removable volume which can be copied on the big disk
+struct IngestVolume {
+    std::string label;
+    std::string uuid;
+    std::string sysname;
+    std::string device; // model and serial, "" when unknown
+    unsigned int queueDepth; // requests in flight on this volume, unless the device was tuned before
+    bool stableInodes; // false when the fs numbers the inodes at mount (fat)
+    IngestScheduler::Order order; // which files are copied first
+};
+
+// a regular file found on a source volume, path is relative to the volume root
+struct IngestFile {
+    std::string path;
+    uint64_t size;
+    time_t mtime;
+    ino_t inode;
+    uint64_t offset; // first byte to copy, when resuming a previous copy
+};
+
+// a folder of a volume and its regular files, path is relative to the volume root
+struct IngestFolder {
+    std::string path;
+    std::vector<IngestFile> files;
+};
+
+// copy one volume to the big disk, in its own thread
+class IngestJob {
+    public:
+        enum Status {
+            running,
+            done,
+            failed,
+            stopped,
+            noSpace // the big disk cannot hold the volume, nothing was copied
+        };
+
+        IngestJob(const IngestVolume&, const Pipe&, ContentIndex&, IngestGovernor&, IngestManifest&, IngestTunings&, const IngestFilter&);
+        ~IngestJob();
+
+        void stop();
+        Status getStatus() const;
+        const IngestVolume& getVolume() const;
+        uint64_t getCopiedBytes() const;
+        uint64_t getTotalBytes() const;
+
+        // has the destination the same size and mtime as the source ?
+        static bool isUpToDate(const IngestFile&, const std::string &dstPath);
+        static bool isUpToDate(const IngestFile&, int dirFd, const std::string &dstName);
+
+    protected:
+        IngestVolume _volume;
+        std::string _srcRoot;
+        std::string _dstRoot;
+        const Pipe &_pipe;
+        ContentIndex &_index;
+        IngestGovernor &_governor;
+        IngestManifest &_manifest;
+        IngestTunings &_tunings;
+        const IngestFilter &_filter;
+        IngestJournal _journal;
+        IngestDirCache _srcDirs;
+        IngestDirCache _dstDirs;
+        pthread_t _thread;
+        bool _started;
+        std::atomic<bool> _stop;
+        std::atomic<int> _status;
+        std::atomic<uint64_t> _copied;
+        std::atomic<uint64_t> _total;
+        std::atomic<uint64_t> _lastReport;
+        std::atomic<bool> _useCopyRange;
+        std::atomic<bool> _aborted; // one of the disks is gone or full
+        std::atomic<bool> _failed;
+        IngestScanner *_scanner;
+        IngestVerifier *_verifier;
+        IngestTuner *_tuner;
+        std::deque<IngestFile> _files; // files to copy, found by the scan
+        std::deque<IngestFolder> _scanned; // read by the space check, not planned yet
+        IngestScheduler _scheduler;
+        unsigned int _known;
+        unsigned int _linked;
+        std::mutex _poolMut;
+        std::atomic<unsigned int> _poolWorkers;
+        std::atomic<bool> _poolDone;
+        std::mutex _asideMut;
+        std::condition_variable _asideCond;
+        std::deque<const IngestFile*> _asideFiles; // big or compressible files, left by io_uring to a thread of their own
+        pthread_t _asideThread;
+        bool _asideStarted;
+        bool _asideClosing;
+
+        static void* _startRun(void*);
+        static void* _startWorker(void*);
+        static void* _startAside(void*);
+        void _run();
+        bool _hasSpace();
+        uint64_t _getMissingBytes();
+        bool _makeDir(const std::string &relPath);
+        bool _makeDirs(IngestUring&, const std::vector<std::string> &dirs);
+        bool _fetch(bool wait, IngestUring*);
+        void _plan(std::vector<IngestFile>&);
+        void _queue(const IngestFile&);
+        bool _linkStored(const std::string &storedPath, const IngestFile&, const std::string &dstPath);
+        bool _copyFiles(IngestUring&);
+        bool _copyUring(IngestUring&);
+        bool _copyPool();
+        void _poolWorker();
+        const IngestFile* _poolTake();
+        void _pushAside(const IngestFile*);
+        void _asideWorker();
+        void _closeAside();
+        bool _copyFile(const IngestFile&, IngestDirectCopy&, IngestCompressor&);
+        bool _copyFileAt(const IngestFile&, int srcDir, int dstDir, const std::string &name, IngestDirectCopy&, IngestCompressor&);
+        bool _copyData(int srcFd, int dstFd, const IngestFile&);
+        bool _copyLarge(int srcFd, int dstFd, const IngestFile&, const std::string &partPath, IngestDirectCopy&);
+        bool _copyCompressed(int srcFd, int dstFd, const IngestFile&, const std::string &partPath, IngestCompressor&);
+        bool _finishFile(int dstFd, const IngestFile&, const std::string &partPath);
+        void _onFileVerified(const IngestFile&, const std::string &copyPath, int error, uint64_t hash);
+        void _setTimes(int dstFd, const IngestFile&, const std::string &dstPath);
+        void _onFileCopied(const IngestFile&, uint64_t hash = 0);
+        void _onFileError(int error);
+        void _addCopied(uint64_t bytes);
+};
+
+#endif // _INGEST_JOB_HPP
@@ -0,0 +1,304 @@
+#include "ingest_journal.hpp"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "log.hpp"
+#include "ingest_job.hpp"
+
+IngestJournal::IngestJournal() {
+    _fd = -1;
+    _rootFd = -1;
+    _lines = 0;
+    _checkInode = false;
+    _lastCommit.tv_sec = 0;
+    _lastCommit.tv_nsec = 0;
+}
+
+IngestJournal::~IngestJournal() {
+    close();
+}
+
+bool IngestJournal::open(const std::string &root, const IngestVolume &volume) {
+    close();
+    std::string dir = root + "/" INGEST_STATE_DIR;
+    if((mkdir(dir.c_str(), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) != 0) && (errno != EEXIST)) {
+        log(LOG_ERR, "Unable to create folder %s: %s", dir.c_str(), strerror(errno));
+        return false;
+    }
+    _rootFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(_rootFd == -1) {
+        log(LOG_ERR, "unable to open %s: %s", root.c_str(), strerror(errno));
+        return false;
+    }
+    _copied.open(VolumeIndex::getPath(root, volume));
+    _checkInode = volume.stableInodes;
+    _path = dir + "/journal-" + (volume.uuid.empty() ? volume.label : volume.uuid) + ".log";
+    _lines = _load();
+    if(_lines > _records.size() * 2 + 64) {
+        _compact();
+    }
+    _fd = ::open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if(_fd == -1) {
+        log(LOG_ERR, "unable to open %s: %s", _path.c_str(), strerror(errno));
+        ::close(_rootFd);
+        _rootFd = -1;
+        _copied.close();
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &_lastCommit);
+    return true;
+}
+
+void IngestJournal::close() {
+    if(_fd != -1) {
+        commit(true);
+        ::close(_fd);
+        _fd = -1;
+    }
+    if(_rootFd != -1) {
+        ::close(_rootFd);
+        _rootFd = -1;
+    }
+    const std::lock_guard<std::mutex> lock(_mut);
+    _copied.close();
+    _records.clear();
+    _pending.clear();
+}
+
+void IngestJournal::setSyncListener(const SyncListener &listener) {
+    const std::lock_guard<std::mutex> lock(_commitMut);
+    _syncListener = listener;
+}
+
+// P size mtime offset path: the file is copied up to offset,
+// the last line of a path wins, until the file is in the volume index
+unsigned int IngestJournal::_load() {
+    FILE *file = fopen(_path.c_str(), "r");
+    if(file == NULL) {
+        return 0;
+    }
+    unsigned int lines = 0;
+    char *line = NULL;
+    size_t lineSize = 0;
+    ssize_t length;
+    const std::lock_guard<std::mutex> lock(_mut);
+    while((length = getline(&line, &lineSize, file)) > 0) {
+        if(line[length - 1] != '\n') {
+            break; // the last record was not fully written
+        }
+        line[length - 1] = 0;
+        unsigned long long size;
+        long long mtime;
+        unsigned long long offset;
+        int pathStart = 0;
+        if((sscanf(line, "P %llu %lld %llu %n", &size, &mtime, &offset, &pathStart) < 3) || (pathStart == 0)) {
+            continue;
+        }
+        Record record;
+        record.size = size;
+        record.mtime = mtime;
+        record.inode = 0;
+        record.offset = offset;
+        record.done = false;
+        _records[line + pathStart] = record;
+        ++lines;
+    }
+    free(line);
+    fclose(file);
+
+    //forget the files copied since their last progress
+    std::map<std::string, Record>::iterator i = _records.begin();
+    while(i != _records.end()) {
+        IngestFile copied;
+        copied.path = i->first;
+        copied.size = i->second.size;
+        copied.mtime = i->second.mtime;
+        if(_copied.isCurrent(copied, false)) {
+            _records.erase(i++);
+        }
+        else {
+            ++i;
+        }
+    }
+    return lines;
+}
+
+void IngestJournal::_compact() {
+    std::string out;
+    {
+        const std::lock_guard<std::mutex> lock(_mut);
+        for(const std::pair<const std::string, Record> &pair : _records) {
+            _format(out, pair.first, pair.second);
+        }
+    }
+    std::string tmpPath = _path + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if(fd == -1) {
+        log(LOG_ERR, "unable to create %s: %s", tmpPath.c_str(), strerror(errno));
+        return;
+    }
+    bool success = _write(fd, out) && (fsync(fd) == 0);
+    ::close(fd);
+    if(!success || (rename(tmpPath.c_str(), _path.c_str()) != 0)) {
+        log(LOG_ERR, "unable to compact %s: %s", _path.c_str(), strerror(errno));
+        return;
+    }
+    _lines = _records.size();
+}
+
+void IngestJournal::_format(std::string &out, const std::string &path, const Record &record) {
+    if(strchr(path.c_str(), '\n') != NULL) {
+        return;
+    }
+    char line[80];
+    snprintf(line, sizeof(line), "P %llu %lld %llu ", (unsigned long long)record.size, (long long)record.mtime,
+        (unsigned long long)record.offset);
+    out += line;
+    out += path;
+    out += '\n';
+}
+
+bool IngestJournal::_write(int fd, const std::string &data) {
+    size_t written = 0;
+    while(written < data.size()) {
+        ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+        if(result == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            log(LOG_ERR, "unable to write %s: %s", _path.c_str(), strerror(errno));
+            return false;
+        }
+        written += result;
+    }
+    return true;
+}
+
+const IngestJournal::Record* IngestJournal::_find(const IngestFile &file) {
+    std::map<std::string, Record>::const_iterator found = _records.find(file.path);
+    if(found == _records.end()) {
+        return NULL;
+    }
+    //the source changed since the record
+    if((found->second.size != file.size) || (found->second.mtime != file.mtime)) {
+        return NULL;
+    }
+    return &found->second;
+}
+
+bool IngestJournal::isDone(const IngestFile &file) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    return _copied.isCurrent(file, _checkInode);
+}
+
+uint64_t IngestJournal::getResumeOffset(const IngestFile &file) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    const Record *record = _find(file);
+    return (record == NULL) ? 0 : record->offset;
+}
+
+void IngestJournal::setProgress(const IngestFile &file, uint64_t offset) {
+    Record record;
+    record.size = file.size;
+    record.mtime = file.mtime;
+    record.inode = file.inode;
+    record.offset = offset;
+    record.done = false;
+    const std::lock_guard<std::mutex> lock(_mut);
+    _records[file.path] = record;
+    _pending[file.path] = record;
+}
+
+void IngestJournal::setDone(const IngestFile &file) {
+    Record record;
+    record.size = file.size;
+    record.mtime = file.mtime;
+    record.inode = file.inode;
+    record.offset = file.size;
+    record.done = true;
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(_copied.isCurrent(file, _checkInode)) {
+        return;
+    }
+    _records.erase(file.path);
+    _pending[file.path] = record;
+}
+
+void IngestJournal::commit(bool force) {
+    std::unique_lock<std::mutex> commitLock(_commitMut, std::defer_lock);
+    if(force) {
+        commitLock.lock();
+    }
+    else if(!commitLock.try_lock()) {
+        return; //another thread is committing
+    }
+    if(_fd == -1) {
+        return;
+    }
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed = (long long)(now.tv_sec - _lastCommit.tv_sec) * 1000000 + (now.tv_nsec - _lastCommit.tv_nsec) / 1000;
+    if(!force && (elapsed < INGEST_COMMIT_DELAY)) {
+        return;
+    }
+    _lastCommit = now;
+
+    std::map<std::string, Record> batch;
+    {
+        const std::lock_guard<std::mutex> lock(_mut);
+        batch.swap(_pending);
+    }
+    bool waiting = _syncListener && _syncListener(IngestJournal::syncStart);
+    if(batch.empty() && !waiting) {
+        return;
+    }
+    //the data must be durable before the records describing it
+    if(syncfs(_rootFd) != 0) {
+        log(LOG_ERR, "unable to sync the big disk: %s", strerror(errno));
+        {
+            //retried by the next commit, the records set meanwhile are newer
+            const std::lock_guard<std::mutex> lock(_mut);
+            _pending.insert(batch.begin(), batch.end());
+        }
+        if(_syncListener) {
+            _syncListener(IngestJournal::syncFailed);
+        }
+        return;
+    }
+    if(_syncListener) {
+        _syncListener(IngestJournal::syncDone);
+    }
+    std::string out;
+    unsigned int lines = 0;
+    bool copied = false;
+    {
+        const std::lock_guard<std::mutex> lock(_mut);
+        for(const std::pair<const std::string, Record> &pair : batch) {
+            if(!pair.second.done) {
+                _format(out, pair.first, pair.second);
+                ++lines;
+                continue;
+            }
+            IngestFile file;
+            file.path = pair.first;
+            file.size = pair.second.size;
+            file.mtime = pair.second.mtime;
+            file.inode = pair.second.inode;
+            copied = _copied.set(file) || copied;
+        }
+    }
+    if(copied) {
+        _copied.sync();
+    }
+    if(!out.empty() && _write(_fd, out) && (fdatasync(_fd) != 0)) {
+        log(LOG_ERR, "unable to sync %s: %s", _path.c_str(), strerror(errno));
+    }
+    _lines += lines;
+}
@@ -0,0 +1,73 @@
+#ifndef _INGEST_JOURNAL_HPP
+#define _INGEST_JOURNAL_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "volume_index.hpp"
+
+// write-ahead journal of the copy of a volume, on the big disk.
+// Progress is made durable by group commits: one syncfs of the big disk
+// for all the data written since the last commit, then the journal records.
+// The copied files go to the volume index, the log keeps the partial copies.
+class IngestJournal {
+    public:
+        enum SyncStep {
+            syncStart,
+            syncDone,
+            syncFailed
+        };
+        // told of each sync of the big disk, returns true at syncStart when data waits for a sync
+        typedef std::function<bool(SyncStep)> SyncListener;
+
+        IngestJournal();
+        ~IngestJournal();
+
+        bool open(const std::string &root, const IngestVolume&);
+        void close();
+
+        // was the file copied by a previous run ?
+        bool isDone(const IngestFile&);
+        // first byte not copied yet by a previous run
+        uint64_t getResumeOffset(const IngestFile&);
+        // the data before offset is written (but maybe not durable yet)
+        void setProgress(const IngestFile&, uint64_t offset);
+        void setDone(const IngestFile&);
+        // commit if the last commit is older than INGEST_COMMIT_DELAY, or if forced
+        void commit(bool force = false);
+        void setSyncListener(const SyncListener&);
+
+    protected:
+        struct Record {
+            uint64_t size;
+            time_t mtime;
+            ino_t inode;
+            uint64_t offset;
+            bool done;
+        };
+
+        std::mutex _mut;
+        std::mutex _commitMut;
+        std::string _path;
+        int _fd;
+        int _rootFd;
+        std::map<std::string, Record> _records;
+        std::map<std::string, Record> _pending;
+        SyncListener _syncListener;
+        VolumeIndex _copied;
+        bool _checkInode;
+        timespec _lastCommit;
+        unsigned int _lines;
+
+        unsigned int _load();
+        void _compact();
+        const Record* _find(const IngestFile&);
+        static void _format(std::string &out, const std::string &path, const Record&);
+        bool _write(int fd, const std::string&);
+};
+
+#endif // _INGEST_JOURNAL_HPP
@@ -0,0 +1,63 @@
+#include "ingest_manifest.hpp"
+
+#include <cstring>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "log.hpp"
+
+IngestManifest::IngestManifest() {
+    _file = NULL;
+    time_t now = time(NULL);
+    tm local;
+    char trip[32];
+    strftime(trip, sizeof(trip), "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+    _trip = trip;
+}
+
+IngestManifest::~IngestManifest() {
+    close();
+}
+
+bool IngestManifest::open(const std::string &root) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(_file != NULL) {
+        if(root == _root) {
+            return true;
+        }
+        fclose(_file);
+        _file = NULL;
+    }
+    _root = root;
+    std::string dir = root + "/" INGEST_STATE_DIR;
+    if((mkdir(dir.c_str(), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) != 0) && (errno != EEXIST)) {
+        log(LOG_ERR, "Unable to create folder %s: %s", dir.c_str(), strerror(errno));
+        return false;
+    }
+    std::string path = dir + "/manifest-" + _trip + ".xxh64";
+    _file = fopen(path.c_str(), "a");
+    if(_file == NULL) {
+        log(LOG_ERR, "unable to open %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void IngestManifest::close() {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(_file != NULL) {
+        fclose(_file);
+        _file = NULL;
+    }
+}
+
+void IngestManifest::add(uint64_t hash, const std::string &storedPath) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if((_file == NULL) || (strchr(storedPath.c_str(), '\n') != NULL)) {
+        return;
+    }
+    fprintf(_file, "%016llx  %s\n", (unsigned long long)hash, storedPath.c_str());
+    fflush(_file);
+}
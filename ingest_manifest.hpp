@@ -0,0 +1,29 @@
+#ifndef _INGEST_MANIFEST_HPP
+#define _INGEST_MANIFEST_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+#include <string>
+
+// checksums of the files verified during this trip (since the power on), on the big disk.
+// One line by file, in the xxh64sum format, so it can be checked from the big disk root.
+// A compressed copy is listed with the hash of its data
+class IngestManifest {
+    public:
+        IngestManifest();
+        ~IngestManifest();
+
+        bool open(const std::string &root);
+        void close();
+        // storedPath is relative to the root
+        void add(uint64_t hash, const std::string &storedPath);
+
+    protected:
+        std::mutex _mut;
+        std::string _trip;
+        std::string _root;
+        FILE *_file;
+};
+
+#endif // _INGEST_MANIFEST_HPP
@@ -0,0 +1,240 @@
+#include "ingest_scan.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "config.h"
+#include "log.hpp"
+
+#define DENTS_BUFFER_SIZE   (64*1024) // one getdents64 call reads a whole camera folder
+
+// layout of the entries returned by getdents64
+struct DirEntry64 {
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+IngestScanner::IngestScanner(const std::string &root, const IngestFilter &filter, unsigned int threads, const std::atomic<bool> *stop):
+        _root(root), _filter(filter), _stop(stop) {
+    _pending = 1;
+    _failed = false;
+    _closing = false;
+    if(threads == 0) {
+        threads = 1;
+    }
+    for(unsigned int i = 0; i < threads; i++) {
+        Worker *worker = new Worker();
+        worker->scanner = this;
+        worker->started = false;
+        _workers.push_back(worker);
+    }
+    Dir dir;
+    dir.state = filter.getStart();
+    _workers[0]->dirs.push_back(dir);
+    _running = threads;
+    for(Worker *worker : _workers) {
+        worker->started = (pthread_create(&worker->thread, NULL, IngestScanner::_startWorker, (void*)worker) == 0);
+        if(!worker->started) {
+            --_running;
+            log(LOG_ERR, "unable to start a scan thread: %s", strerror(errno));
+        }
+    }
+    if(_running == 0) {
+        log(LOG_ERR, "unable to scan %s", root.c_str());
+        _failed = true;
+    }
+}
+
+IngestScanner::~IngestScanner() {
+    _closing = true;
+    for(Worker *worker : _workers) {
+        if(worker->started) {
+            pthread_join(worker->thread, NULL);
+        }
+        delete worker;
+    }
+}
+
+bool IngestScanner::next(IngestFolder &folder, bool wait) {
+    std::unique_lock<std::mutex> lock(_outMut);
+    while(wait && _folders.empty() && (_running > 0)) {
+        _outCond.wait(lock);
+    }
+    if(_folders.empty()) {
+        return false;
+    }
+    folder = std::move(_folders.front());
+    _folders.pop_front();
+    return true;
+}
+
+bool IngestScanner::isFailed() const {
+    return _failed;
+}
+
+void* IngestScanner::_startWorker(void *worker) {
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    ((Worker*)worker)->scanner->_work(*(Worker*)worker);
+    return NULL;
+}
+
+void IngestScanner::_work(Worker &worker) {
+    Dir dir;
+    while(_take(worker, dir)) {
+        _readFolder(worker, dir);
+        if(--_pending == 0) {
+            const std::lock_guard<std::mutex> lock(_idleMut);
+            _idleCond.notify_all();
+        }
+    }
+    const std::lock_guard<std::mutex> lock(_outMut);
+    --_running;
+    _outCond.notify_all();
+}
+
+// own folders are taken from the back, depth first, the stolen ones from the front
+bool IngestScanner::_take(Worker &worker, Dir &dir) {
+    while(!_isStopped()) {
+        {
+            const std::lock_guard<std::mutex> lock(worker.mut);
+            if(!worker.dirs.empty()) {
+                dir.path.swap(worker.dirs.back().path);
+                dir.state = worker.dirs.back().state;
+                worker.dirs.pop_back();
+                return true;
+            }
+        }
+        for(Worker *other : _workers) {
+            const std::lock_guard<std::mutex> lock(other->mut);
+            if(!other->dirs.empty()) {
+                dir.path.swap(other->dirs.front().path);
+                dir.state = other->dirs.front().state;
+                other->dirs.pop_front();
+                return true;
+            }
+        }
+        if(_pending == 0) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(_idleMut);
+        _idleCond.wait_for(lock, std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+void IngestScanner::_push(Worker &worker, const Dir &dir) {
+    ++_pending;
+    {
+        const std::lock_guard<std::mutex> lock(worker.mut);
+        worker.dirs.push_back(dir);
+    }
+    _idleCond.notify_one();
+}
+
+void IngestScanner::_readFolder(Worker &worker, const Dir &dir) {
+    const std::string &relPath = dir.path;
+    std::string path = _root + relPath;
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1) {
+        log(LOG_ERR, "unable to read folder %s: %s", path.c_str(), strerror(errno));
+        _failed = true;
+        return;
+    }
+    IngestFolder folder;
+    folder.path = relPath;
+    std::vector<Dir> children;
+    char *buffer = new char[DENTS_BUFFER_SIZE];
+    while(!_isStopped()) {
+        long length = syscall(SYS_getdents64, fd, buffer, DENTS_BUFFER_SIZE);
+        if(length == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            log(LOG_ERR, "unable to read folder %s: %s", path.c_str(), strerror(errno));
+            _failed = true;
+            break;
+        }
+        if(length == 0) {
+            break;
+        }
+        for(long offset = 0; offset < length; ) {
+            const DirEntry64 *entry = (const DirEntry64*)(buffer + offset);
+            offset += entry->reclen;
+            if((strcmp(entry->name, ".") == 0) || (strcmp(entry->name, "..") == 0)) {
+                continue;
+            }
+            Dir child;
+            child.state = _filter.next(dir.state, entry->name);
+            //the type given by the fs saves a stat for the folders and the other special files
+            if(entry->type == DT_DIR) {
+                if(_filter.isFolderIncluded(child.state)) {
+                    child.path = relPath + "/" + entry->name;
+                    children.push_back(child);
+                }
+                continue;
+            }
+            if((entry->type != DT_REG) && (entry->type != DT_UNKNOWN)) {
+                continue;
+            }
+            struct stat info;
+            if(fstatat(fd, entry->name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+                log(LOG_ERR, "unable to stat %s/%s: %s", path.c_str(), entry->name, strerror(errno));
+                _failed = true;
+                continue;
+            }
+            if(S_ISDIR(info.st_mode)) {
+                if(_filter.isFolderIncluded(child.state)) {
+                    child.path = relPath + "/" + entry->name;
+                    children.push_back(child);
+                }
+            }
+            else if(S_ISREG(info.st_mode) && _filter.isFileIncluded(child.state, fd, entry->name, info.st_size)) {
+                IngestFile file;
+                file.path = relPath + "/" + entry->name;
+                file.size = info.st_size;
+                file.mtime = info.st_mtime;
+                file.inode = info.st_ino;
+                file.offset = 0;
+                folder.files.push_back(file);
+            }
+        }
+    }
+    delete[] buffer;
+    close(fd);
+
+    //the folder is given before its children are queued
+    {
+        const std::lock_guard<std::mutex> lock(_outMut);
+        _folders.push_back(std::move(folder));
+        _outCond.notify_one();
+    }
+    for(const Dir &child : children) {
+        _push(worker, child);
+    }
+}
+
+bool IngestScanner::_isStopped() const {
+    return _closing || ((_stop != NULL) && *_stop);
+}
+
+bool scanVolume(const std::string &root, const IngestFilter &filter, std::vector<std::string> &dirs, std::vector<IngestFile> &files, const std::atomic<bool> *stop) {
+    IngestScanner scanner(root, filter, INGEST_SCAN_THREADS, stop);
+    IngestFolder folder;
+    while(scanner.next(folder)) {
+        if(!folder.path.empty()) {
+            dirs.push_back(folder.path);
+        }
+        files.insert(files.end(), folder.files.begin(), folder.files.end());
+    }
+    return !scanner.isFailed();
+}
@@ -0,0 +1,68 @@
+#ifndef _INGEST_SCAN_HPP
+#define _INGEST_SCAN_HPP
+
+#include <pthread.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ingest_job.hpp"
+#include "ingest_filter.hpp"
+
+// walk a volume with a few threads, the folders are given as soon as they are read.
+// Each thread reads its own folders depth first, and steals the oldest folders
+// of the others when it has nothing left, so one deep tree does not stall the walk.
+// A folder is always given after its parent. The folders and files excluded by the filter
+// are left out, the excluded folders are not read.
+class IngestScanner {
+    public:
+        IngestScanner(const std::string &root, const IngestFilter&, unsigned int threads, const std::atomic<bool> *stop = NULL);
+        ~IngestScanner();
+
+        // get the next folder read, false when the walk is over (or nothing is ready and !wait)
+        bool next(IngestFolder&, bool wait = true);
+        bool isFailed() const;
+
+    protected:
+        // a folder to read, with the filter state of its path
+        struct Dir {
+            std::string path;
+            IngestFilter::State state;
+        };
+        struct Worker {
+            IngestScanner *scanner;
+            pthread_t thread;
+            bool started;
+            std::mutex mut;
+            std::deque<Dir> dirs;
+        };
+
+        std::string _root;
+        const IngestFilter &_filter;
+        const std::atomic<bool> *_stop;
+        std::vector<Worker*> _workers;
+        std::atomic<unsigned int> _pending; // folders queued or being read
+        std::atomic<unsigned int> _running; // threads not finished
+        std::atomic<bool> _failed;
+        std::atomic<bool> _closing;
+        std::mutex _idleMut;
+        std::condition_variable _idleCond;
+        std::mutex _outMut;
+        std::condition_variable _outCond;
+        std::deque<IngestFolder> _folders;
+
+        static void* _startWorker(void*);
+        void _work(Worker&);
+        bool _take(Worker&, Dir&);
+        void _push(Worker&, const Dir&);
+        void _readFolder(Worker&, const Dir&);
+        bool _isStopped() const;
+};
+
+// list the folders (parents first) and the regular files of a volume, paths are relative to root
+bool scanVolume(const std::string &root, const IngestFilter&, std::vector<std::string> &dirs, std::vector<IngestFile> &files, const std::atomic<bool> *stop = NULL);
+
+#endif // _INGEST_SCAN_HPP
@@ -0,0 +1,79 @@
+#include "ingest_scheduler.hpp"
+
+#include <algorithm>
+#include <string.h>
+#include <strings.h>
+
+#include "config.h"
+#include "ingest_job.hpp"
+
+IngestScheduler::IngestScheduler(Order order) {
+    _order = order;
+    _seq = 0;
+}
+
+void IngestScheduler::push(const IngestFile *file) {
+    Entry entry;
+    entry.seq = _seq++;
+    entry.file = file;
+    entry.tie = 0;
+    switch(_order) {
+        case IngestScheduler::scanOrder:
+            entry.key = 0;
+            break;
+        case IngestScheduler::newestFirst:
+            entry.key = -(int64_t)file->mtime;
+            break;
+        case IngestScheduler::smallestFirst:
+            entry.key = file->size;
+            break;
+        case IngestScheduler::typePriority:
+            entry.key = _getTypeRank(*file);
+            entry.tie = file->size;
+            break;
+    }
+    _heap.push_back(entry);
+    std::push_heap(_heap.begin(), _heap.end(), IngestScheduler::_isAfter);
+}
+
+const IngestFile* IngestScheduler::take() {
+    if(_heap.empty()) {
+        return NULL;
+    }
+    std::pop_heap(_heap.begin(), _heap.end(), IngestScheduler::_isAfter);
+    const IngestFile *file = _heap.back().file;
+    _heap.pop_back();
+    return file;
+}
+
+bool IngestScheduler::isEmpty() const {
+    return _heap.empty();
+}
+
+// the heap keeps on top the entry which is after no other one
+bool IngestScheduler::_isAfter(const Entry &a, const Entry &b) {
+    if(a.key != b.key) {
+        return a.key > b.key;
+    }
+    if(a.tie != b.tie) {
+        return a.tie > b.tie;
+    }
+    return a.seq > b.seq;
+}
+
+int64_t IngestScheduler::_getTypeRank(const IngestFile &file) {
+    static const char* types[] = INGEST_TYPE_PRIORITY;
+    static const unsigned int typesLength = sizeof(types)/sizeof(const char*);
+    const char *name = strrchr(file.path.c_str(), '/');
+    const char *extension = strrchr((name == NULL) ? file.path.c_str() : name, '.');
+    if(extension == NULL) {
+        return typesLength;
+    }
+    ++extension;
+    for(unsigned int i = 0; i < typesLength; i++) {
+        if(strcasecmp(types[i], extension) == 0) {
+            return i;
+        }
+    }
+    return typesLength;
+}
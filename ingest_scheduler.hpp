@@ -0,0 +1,44 @@
+#ifndef _INGEST_SCHEDULER_HPP
+#define _INGEST_SCHEDULER_HPP
+
+#include <stdint.h>
+#include <vector>
+
+struct IngestFile;
+
+// choose the next file to copy, so the most valuable files are copied
+// first when the trip stop is too short for a full copy.
+// The files are not owned and must stay valid until taken. Not thread safe.
+class IngestScheduler {
+    public:
+        enum Order {
+            scanOrder,
+            newestFirst,
+            smallestFirst,
+            typePriority // INGEST_TYPE_PRIORITY first, in its order, then the smallest
+        };
+
+        IngestScheduler(Order = scanOrder);
+
+        void push(const IngestFile*);
+        // the most valuable file queued, NULL if none
+        const IngestFile* take();
+        bool isEmpty() const;
+
+    protected:
+        struct Entry {
+            int64_t key;
+            int64_t tie;
+            uint64_t seq;
+            const IngestFile *file;
+        };
+
+        Order _order;
+        std::vector<Entry> _heap;
+        uint64_t _seq;
+
+        static bool _isAfter(const Entry&, const Entry&);
+        static int64_t _getTypeRank(const IngestFile&);
+};
+
+#endif // _INGEST_SCHEDULER_HPP
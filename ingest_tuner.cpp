@@ -0,0 +1,213 @@
+#include "ingest_tuner.hpp"
+
+#include <cstring>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.hpp"
+#include "ingest_governor.hpp"
+
+#define MOVES   4 // more depth, less depth, bigger requests, smaller requests
+
+static long long diffUsec(const timespec &a, const timespec &b) {
+    return (long long)(a.tv_sec - b.tv_sec) * 1000000 + (a.tv_nsec - b.tv_nsec) / 1000;
+}
+
+bool IngestTunings::open(const std::string &root) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    std::string path = root + "/" INGEST_STATE_DIR "/tunings";
+    if(path == _path) {
+        return true;
+    }
+    _path = path;
+    _tunings.clear();
+    FILE *file = fopen(_path.c_str(), "r");
+    if(file == NULL) {
+        return errno == ENOENT;
+    }
+    //one line by device: depth request_size device
+    char line[512];
+    while(fgets(line, sizeof(line), file) != NULL) {
+        IngestTuning tuning;
+        int used = 0;
+        if((sscanf(line, "%u %u %n", &tuning.depth, &tuning.requestSize, &used) != 2) || (used == 0)) {
+            continue;
+        }
+        std::string device(line + used);
+        while(!device.empty() && (device.back() == '\n')) {
+            device.pop_back();
+        }
+        if(!device.empty() && (tuning.depth > 0) && (tuning.requestSize > 0)) {
+            _tunings[device] = tuning;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+void IngestTunings::close() {
+    const std::lock_guard<std::mutex> lock(_mut);
+    _path.clear();
+    _tunings.clear();
+}
+
+bool IngestTunings::get(const std::string &device, IngestTuning &tuning) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    std::map<std::string, IngestTuning>::const_iterator found = _tunings.find(device);
+    if(device.empty() || (found == _tunings.end())) {
+        return false;
+    }
+    tuning = found->second;
+    return true;
+}
+
+void IngestTunings::set(const std::string &device, const IngestTuning &tuning) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(device.empty() || _path.empty() || (device.find('\n') != std::string::npos)) {
+        return;
+    }
+    std::map<std::string, IngestTuning>::const_iterator found = _tunings.find(device);
+    if((found != _tunings.end()) && (found->second.depth == tuning.depth) && (found->second.requestSize == tuning.requestSize)) {
+        return;
+    }
+    _tunings[device] = tuning;
+    if(_save()) {
+        log(LOG_INFO, "%s is best read %u by %u KB", device.c_str(), tuning.depth, tuning.requestSize / 1024);
+    }
+}
+
+// the file is replaced at once, so a power loss keeps the old one
+bool IngestTunings::_save() {
+    std::string tmpPath = _path + ".tmp";
+    FILE *file = fopen(tmpPath.c_str(), "w");
+    if(file == NULL) {
+        log(LOG_ERR, "unable to write %s: %s", tmpPath.c_str(), strerror(errno));
+        return false;
+    }
+    for(const std::pair<const std::string, IngestTuning> &pair : _tunings) {
+        fprintf(file, "%u %u %s\n", pair.second.depth, pair.second.requestSize, pair.first.c_str());
+    }
+    bool success = (fflush(file) == 0) && (fdatasync(fileno(file)) == 0);
+    success = (fclose(file) == 0) && success;
+    if(!success || (rename(tmpPath.c_str(), _path.c_str()) != 0)) {
+        log(LOG_ERR, "unable to write %s: %s", _path.c_str(), strerror(errno));
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+IngestTuner::IngestTuner(const IngestTuning &start, unsigned int maxDepth, unsigned int maxRequestSize, const IngestGovernor &governor):
+        _governor(governor), _maxDepth(maxDepth), _maxRequestSize(maxRequestSize) {
+    _best = start;
+    if((_best.depth == 0) || (_best.depth > _maxDepth)) {
+        _best.depth = _maxDepth;
+    }
+    if((_best.requestSize < INGEST_MIN_REQUEST_SIZE) || (_best.requestSize > _maxRequestSize)) {
+        _best.requestSize = _maxRequestSize;
+    }
+    _depth = _best.depth;
+    _requestSize = _best.requestSize;
+    clock_gettime(CLOCK_MONOTONIC, &_periodStart);
+    _periodBytes = 0;
+    _bestRate = 0;
+    _move = -1;
+    _failedMoves = 0;
+    _settled = false;
+}
+
+void IngestTuner::addBytes(uint64_t bytes) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(_settled) {
+        return;
+    }
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(_governor.getLevel() > 0) { //the rate is the governor's
+        _periodStart = now;
+        _periodBytes = 0;
+        return;
+    }
+    _periodBytes += bytes;
+    long long elapsed = diffUsec(now, _periodStart);
+    if(elapsed < INGEST_TUNE_PERIOD) {
+        return;
+    }
+    uint64_t rate = _periodBytes * 1000000 / elapsed;
+    _periodStart = now;
+    _periodBytes = 0;
+    _step(rate);
+}
+
+unsigned int IngestTuner::getDepth() const {
+    return _depth;
+}
+
+unsigned int IngestTuner::getRequestSize() const {
+    return _requestSize;
+}
+
+bool IngestTuner::getBest(IngestTuning &tuning) const {
+    const std::lock_guard<std::mutex> lock(_mut);
+    tuning = _best;
+    return _bestRate > 0;
+}
+
+void IngestTuner::_step(uint64_t rate) {
+    if(_move == -1) { //the current setting is the best one
+        _bestRate = rate;
+        _move = 0;
+    }
+    else if(rate > _bestRate + _bestRate / 20) {
+        //keep going the same way
+        _best.depth = _depth;
+        _best.requestSize = _requestSize;
+        _bestRate = rate;
+        _failedMoves = 0;
+    }
+    else {
+        _depth = _best.depth;
+        _requestSize = _best.requestSize;
+        _move = (_move + 1) % MOVES;
+        ++_failedMoves;
+    }
+    while(_failedMoves < MOVES) {
+        if(_tryMove()) {
+            return;
+        }
+        _move = (_move + 1) % MOVES;
+        ++_failedMoves;
+    }
+    _depth = _best.depth;
+    _requestSize = _best.requestSize;
+    _settled = true;
+    log(LOG_INFO, "copy tuned to %u by %u KB, %llu KB/s", _best.depth, _best.requestSize / 1024, (unsigned long long)(_bestRate / 1024));
+}
+
+// apply the neighbour of the best setting, false if it is out of bounds
+bool IngestTuner::_tryMove() {
+    unsigned int depth = _best.depth;
+    unsigned int requestSize = _best.requestSize;
+    switch(_move) {
+        case 0:
+            depth = (depth * 2 > _maxDepth) ? _maxDepth : depth * 2;
+            break;
+        case 1:
+            depth = (depth / 2 < 1) ? 1 : depth / 2;
+            break;
+        case 2:
+            requestSize = (requestSize * 2 > _maxRequestSize) ? _maxRequestSize : requestSize * 2;
+            break;
+        case 3:
+            requestSize = (requestSize / 2 < INGEST_MIN_REQUEST_SIZE) ? INGEST_MIN_REQUEST_SIZE : requestSize / 2;
+            break;
+    }
+    if((depth == _best.depth) && (requestSize == _best.requestSize)) {
+        return false;
+    }
+    _depth = depth;
+    _requestSize = requestSize;
+    return true;
+}
@@ -0,0 +1,69 @@
+#ifndef _INGEST_TUNER_HPP
+#define _INGEST_TUNER_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+class IngestGovernor;
+
+// how a source device is read
+struct IngestTuning {
+    unsigned int depth; // files or requests in flight
+    unsigned int requestSize; // bytes by read
+};
+
+// best tuning found for each source device, by model and serial, kept on the big disk
+class IngestTunings {
+    public:
+        bool open(const std::string &root);
+        void close();
+        bool get(const std::string &device, IngestTuning&);
+        void set(const std::string &device, const IngestTuning&);
+
+    protected:
+        std::mutex _mut;
+        std::string _path;
+        std::map<std::string, IngestTuning> _tunings;
+
+        bool _save();
+};
+
+// hill climbing on the depth and the request size of a copy: at the end of each
+// period, a neighbour setting (double or half of one of them) is tried, and kept
+// if the throughput is better. The search is over when no neighbour is better.
+// Periods throttled by the governor are not measured.
+class IngestTuner {
+    public:
+        IngestTuner(const IngestTuning &start, unsigned int maxDepth, unsigned int maxRequestSize, const IngestGovernor&);
+
+        // bytes read from the source and written, thread safe
+        void addBytes(uint64_t bytes);
+        unsigned int getDepth() const;
+        unsigned int getRequestSize() const;
+        // best tuning measured, false if none was
+        bool getBest(IngestTuning&) const;
+
+    protected:
+        const IngestGovernor &_governor;
+        unsigned int _maxDepth;
+        unsigned int _maxRequestSize;
+        std::atomic<unsigned int> _depth;
+        std::atomic<unsigned int> _requestSize;
+        mutable std::mutex _mut;
+        timespec _periodStart;
+        uint64_t _periodBytes;
+        IngestTuning _best;
+        uint64_t _bestRate; // bytes/sec, 0 until measured
+        int _move; // neighbour being tried, -1 for none
+        unsigned int _failedMoves; // in a row
+        bool _settled;
+
+        void _step(uint64_t rate);
+        bool _tryMove();
+};
+
+#endif // _INGEST_TUNER_HPP
@@ -0,0 +1,369 @@
+#include "ingest_uring.hpp"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "config.h"
+#include "log.hpp"
+
+#if defined(__NR_io_uring_setup) && !defined(DISABLE_IO_URING)
+#define HAS_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+
+IngestUring::IngestUring(unsigned int depth, unsigned int bufferSize, unsigned int files) {
+    _fd = -1;
+    _canMkdir = false;
+    _depth = depth;
+    _bufferSize = bufferSize;
+    _ioPriority = 0;
+    _buffers = NULL;
+    _sqRing = MAP_FAILED;
+    _sqRingSize = 0;
+    _cqRing = MAP_FAILED;
+    _cqRingSize = 0;
+    _sqes = (io_uring_sqe*)MAP_FAILED;
+    _sqesSize = 0;
+    _sqLocalTail = 0;
+    _toSubmit = 0;
+
+    //a read and a write by buffer, plus two opens (or a read and a write) by file
+    if(!_setup((depth + files) * 2) || !_registerBuffers()) {
+        _free();
+    }
+}
+
+IngestUring::~IngestUring() {
+    _free();
+}
+
+bool IngestUring::isValid() const {
+    return _fd != -1;
+}
+
+bool IngestUring::canMkdir() const {
+    return _canMkdir;
+}
+
+unsigned int IngestUring::getDepth() const {
+    return _depth;
+}
+
+unsigned int IngestUring::getBufferSize() const {
+    return _bufferSize;
+}
+
+char* IngestUring::getBuffer(unsigned int index) const {
+    return (char*)_buffers[index].iov_base;
+}
+
+void IngestUring::setIoPriority(int priority) {
+    _ioPriority = priority;
+}
+
+#ifdef HAS_IO_URING
+
+bool IngestUring::_setup(unsigned int entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    _fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(_fd == -1) {
+        log(LOG_INFO, "io_uring not available: %s", strerror(errno));
+        return false;
+    }
+
+    //open and stat are needed, mkdir is optional (linux 5.15)
+    size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    io_uring_probe *probe = (io_uring_probe*)calloc(1, probeSize);
+    bool supported = false;
+    if((probe != NULL) && (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PROBE, probe, 256) == 0)) {
+        supported = (probe->last_op >= IORING_OP_STATX) &&
+            (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_READ_FIXED].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_WRITE_FIXED].flags & IO_URING_OP_SUPPORTED);
+        _canMkdir = (probe->last_op >= IORING_OP_MKDIRAT) &&
+            (probe->ops[IORING_OP_MKDIRAT].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    if(!supported) {
+        log(LOG_INFO, "io_uring is too old for the copy");
+        return false;
+    }
+
+    _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(_cqRingSize > _sqRingSize) {
+            _sqRingSize = _cqRingSize;
+        }
+        _cqRingSize = 0;
+    }
+    _sqRing = mmap(0, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    if(_sqRing == MAP_FAILED) {
+        log(LOG_ERR, "unable to map io_uring: %s", strerror(errno));
+        return false;
+    }
+    if(_cqRingSize == 0) {
+        _cqRing = _sqRing;
+    }
+    else {
+        _cqRing = mmap(0, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+        if(_cqRing == MAP_FAILED) {
+            log(LOG_ERR, "unable to map io_uring: %s", strerror(errno));
+            return false;
+        }
+    }
+    _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    _sqes = (io_uring_sqe*)mmap(0, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if(_sqes == MAP_FAILED) {
+        log(LOG_ERR, "unable to map io_uring: %s", strerror(errno));
+        return false;
+    }
+
+    char *sq = (char*)_sqRing;
+    _sqHead = (unsigned int*)(sq + params.sq_off.head);
+    _sqTail = (unsigned int*)(sq + params.sq_off.tail);
+    _sqMask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+    _sqEntries = *(unsigned int*)(sq + params.sq_off.ring_entries);
+    _sqArray = (unsigned int*)(sq + params.sq_off.array);
+    _sqLocalTail = *_sqTail;
+
+    char *cq = (char*)_cqRing;
+    _cqHead = (unsigned int*)(cq + params.cq_off.head);
+    _cqTail = (unsigned int*)(cq + params.cq_off.tail);
+    _cqMask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+    _cqes = cq + params.cq_off.cqes;
+    return true;
+}
+
+bool IngestUring::_registerBuffers() {
+    _buffers = (iovec*)calloc(_depth, sizeof(iovec));
+    if(_buffers == NULL) {
+        return false;
+    }
+    for(unsigned int i = 0; i < _depth; i++) {
+        if(posix_memalign(&_buffers[i].iov_base, sysconf(_SC_PAGESIZE), _bufferSize) != 0) {
+            log(LOG_ERR, "unable to allocate copy buffers");
+            return false;
+        }
+        _buffers[i].iov_len = _bufferSize;
+    }
+    if(syscall(__NR_io_uring_register, _fd, IORING_REGISTER_BUFFERS, _buffers, _depth) != 0) {
+        log(LOG_ERR, "unable to register io_uring buffers: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void IngestUring::_free() {
+    if(_sqes != MAP_FAILED) {
+        munmap(_sqes, _sqesSize);
+        _sqes = (io_uring_sqe*)MAP_FAILED;
+    }
+    if((_cqRing != MAP_FAILED) && (_cqRing != _sqRing)) {
+        munmap(_cqRing, _cqRingSize);
+    }
+    _cqRing = MAP_FAILED;
+    if(_sqRing != MAP_FAILED) {
+        munmap(_sqRing, _sqRingSize);
+        _sqRing = MAP_FAILED;
+    }
+    if(_fd != -1) {
+        close(_fd);
+        _fd = -1;
+    }
+    if(_buffers != NULL) {
+        for(unsigned int i = 0; i < _depth; i++) {
+            free(_buffers[i].iov_base);
+        }
+        free(_buffers);
+        _buffers = NULL;
+    }
+}
+
+unsigned int IngestUring::getFreeSqes() const {
+    unsigned int head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+    return _sqEntries - (_sqLocalTail - head);
+}
+
+bool IngestUring::reserve(unsigned int count) {
+    if(getFreeSqes() >= count) {
+        return true;
+    }
+    return submit(0) && (getFreeSqes() >= count);
+}
+
+io_uring_sqe* IngestUring::_getSqe(uint64_t userData) {
+    //the kernel consumes the whole submission queue on submit
+    if((getFreeSqes() == 0) && (!submit(0) || (getFreeSqes() == 0))) {
+        return NULL;
+    }
+    unsigned int index = _sqLocalTail & _sqMask;
+    io_uring_sqe *sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->user_data = userData;
+    _sqArray[index] = index;
+    ++_sqLocalTail;
+    ++_toSubmit;
+    return sqe;
+}
+
+io_uring_sqe* IngestUring::read(int fd, unsigned int bufIndex, unsigned int bufOffset, unsigned int length, uint64_t offset, uint64_t userData) {
+    io_uring_sqe *sqe = _getSqe(userData);
+    if(sqe != NULL) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)_buffers[bufIndex].iov_base + bufOffset;
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->buf_index = bufIndex;
+        sqe->ioprio = _ioPriority;
+    }
+    return sqe;
+}
+
+io_uring_sqe* IngestUring::write(int fd, unsigned int bufIndex, unsigned int bufOffset, unsigned int length, uint64_t offset, uint64_t userData) {
+    io_uring_sqe *sqe = _getSqe(userData);
+    if(sqe != NULL) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)_buffers[bufIndex].iov_base + bufOffset;
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->buf_index = bufIndex;
+        sqe->ioprio = _ioPriority;
+    }
+    return sqe;
+}
+
+io_uring_sqe* IngestUring::openAt(int dirFd, const char *path, int flags, mode_t mode, uint64_t userData) {
+    io_uring_sqe *sqe = _getSqe(userData);
+    if(sqe != NULL) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dirFd;
+        sqe->addr = (uint64_t)(uintptr_t)path;
+        sqe->len = mode;
+        sqe->open_flags = flags;
+    }
+    return sqe;
+}
+
+io_uring_sqe* IngestUring::statxAt(int dirFd, const char *path, struct statx *info, uint64_t userData) {
+    io_uring_sqe *sqe = _getSqe(userData);
+    if(sqe != NULL) {
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirFd;
+        sqe->addr = (uint64_t)(uintptr_t)path;
+        sqe->len = STATX_SIZE | STATX_MTIME;
+        sqe->off = (uint64_t)(uintptr_t)info;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    }
+    return sqe;
+}
+
+io_uring_sqe* IngestUring::mkdirAt(const char *path, mode_t mode, uint64_t userData) {
+    io_uring_sqe *sqe = _getSqe(userData);
+    if(sqe != NULL) {
+        sqe->opcode = IORING_OP_MKDIRAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)path;
+        sqe->len = mode;
+    }
+    return sqe;
+}
+
+void IngestUring::link(io_uring_sqe *sqe) {
+    sqe->flags |= IOSQE_IO_LINK;
+}
+
+bool IngestUring::submit(unsigned int waitCount) {
+    __atomic_store_n(_sqTail, _sqLocalTail, __ATOMIC_RELEASE);
+    while(true) {
+        int result = syscall(__NR_io_uring_enter, _fd, _toSubmit, waitCount, waitCount > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(result >= 0) {
+            _toSubmit -= result;
+            return true;
+        }
+        if(errno != EINTR) {
+            log(LOG_ERR, "io_uring submission failed: %s", strerror(errno));
+            return false;
+        }
+    }
+}
+
+bool IngestUring::complete(uint64_t &userData, int &result) {
+    unsigned int head = *_cqHead;
+    if(head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    io_uring_cqe *cqe = &((io_uring_cqe*)_cqes)[head & _cqMask];
+    userData = cqe->user_data;
+    result = cqe->res;
+    __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else // HAS_IO_URING
+
+bool IngestUring::_setup(unsigned int) {
+    return false;
+}
+
+bool IngestUring::_registerBuffers() {
+    return false;
+}
+
+void IngestUring::_free() {
+}
+
+unsigned int IngestUring::getFreeSqes() const {
+    return 0;
+}
+
+bool IngestUring::reserve(unsigned int) {
+    return false;
+}
+
+io_uring_sqe* IngestUring::_getSqe(uint64_t) {
+    return NULL;
+}
+
+io_uring_sqe* IngestUring::read(int, unsigned int, unsigned int, unsigned int, uint64_t, uint64_t) {
+    return NULL;
+}
+
+io_uring_sqe* IngestUring::write(int, unsigned int, unsigned int, unsigned int, uint64_t, uint64_t) {
+    return NULL;
+}
+
+io_uring_sqe* IngestUring::openAt(int, const char*, int, mode_t, uint64_t) {
+    return NULL;
+}
+
+io_uring_sqe* IngestUring::statxAt(int, const char*, struct statx*, uint64_t) {
+    return NULL;
+}
+
+io_uring_sqe* IngestUring::mkdirAt(const char*, mode_t, uint64_t) {
+    return NULL;
+}
+
+void IngestUring::link(io_uring_sqe*) {
+}
+
+bool IngestUring::submit(unsigned int) {
+    return false;
+}
+
+bool IngestUring::complete(uint64_t&, int&) {
+    return false;
+}
+
+#endif // HAS_IO_URING
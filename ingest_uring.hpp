@@ -0,0 +1,76 @@
+#ifndef _INGEST_URING_HPP
+#define _INGEST_URING_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+
+// minimal io_uring wrapper (raw syscalls, no liburing), with registered fixed buffers
+class IngestUring {
+    public:
+        // files is the max of files copied at once
+        IngestUring(unsigned int depth, unsigned int bufferSize, unsigned int files);
+        ~IngestUring();
+
+        bool isValid() const;
+        bool canMkdir() const;
+        unsigned int getDepth() const;
+        unsigned int getBufferSize() const;
+        char* getBuffer(unsigned int index) const;
+        // io priority of the next reads and writes
+        void setIoPriority(int);
+
+        // prepare requests, the queue is flushed when it is full, NULL on error.
+        // bufOffset is where the data goes in the buffer, dirFd may be AT_FDCWD
+        io_uring_sqe* read(int fd, unsigned int bufIndex, unsigned int bufOffset, unsigned int length, uint64_t offset, uint64_t userData);
+        io_uring_sqe* write(int fd, unsigned int bufIndex, unsigned int bufOffset, unsigned int length, uint64_t offset, uint64_t userData);
+        io_uring_sqe* openAt(int dirFd, const char *path, int flags, mode_t mode, uint64_t userData);
+        io_uring_sqe* statxAt(int dirFd, const char *path, struct statx *info, uint64_t userData);
+        io_uring_sqe* mkdirAt(const char *path, mode_t mode, uint64_t userData);
+        void link(io_uring_sqe*);
+
+        unsigned int getFreeSqes() const;
+        // flush the queue unless count requests fit in it, so linked requests go in one submission
+        bool reserve(unsigned int count);
+        // submit prepared requests and wait for at least waitCount completions
+        bool submit(unsigned int waitCount);
+        // get a completion, false when none is available
+        bool complete(uint64_t &userData, int &result);
+
+    protected:
+        int _fd;
+        bool _canMkdir;
+        unsigned int _depth;
+        unsigned int _bufferSize;
+        int _ioPriority;
+        iovec *_buffers;
+
+        void *_sqRing;
+        size_t _sqRingSize;
+        void *_cqRing;
+        size_t _cqRingSize;
+        io_uring_sqe *_sqes;
+        size_t _sqesSize;
+
+        unsigned int *_sqHead;
+        unsigned int *_sqTail;
+        unsigned int _sqMask;
+        unsigned int _sqEntries;
+        unsigned int *_sqArray;
+        unsigned int _sqLocalTail;
+        unsigned int _toSubmit;
+
+        unsigned int *_cqHead;
+        unsigned int *_cqTail;
+        unsigned int _cqMask;
+        void *_cqes;
+
+        bool _setup(unsigned int entries);
+        bool _registerBuffers();
+        io_uring_sqe* _getSqe(uint64_t userData);
+        void _free();
+};
+
+#endif // _INGEST_URING_HPP
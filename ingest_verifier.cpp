@@ -0,0 +1,243 @@
+#include "ingest_verifier.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "log.hpp"
+#include "checksum.hpp"
+#include "ingest_job.hpp"
+#include "ingest_compress.hpp"
+#include "ingest_governor.hpp"
+
+#define HASH_BLOCK      (256*1024)
+
+IngestVerifier::IngestVerifier(const Callback &callback, IngestGovernor &governor, IngestJournal *journal, const std::atomic<bool> &stop):
+        _callback(callback), _governor(governor), _journal(journal), _stop(stop) {
+    _busy = 0;
+    _closing = false;
+    long threads = INGEST_VERIFY_THREADS;
+    if(threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(threads <= 0) {
+        threads = 1;
+    }
+    for(long i = 0; i < threads; i++) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, IngestVerifier::_startWorker, (void*)this) != 0) {
+            log(LOG_ERR, "unable to start a verification thread: %s", strerror(errno));
+            break;
+        }
+        _threads.push_back(thread);
+    }
+    _holding = (_journal != NULL) && !_threads.empty();
+    if(_holding) {
+        _journal->setSyncListener([this](IngestJournal::SyncStep step) -> bool {
+            return _onSync(step);
+        });
+    }
+}
+
+IngestVerifier::~IngestVerifier() {
+    if(_holding) {
+        _journal->setSyncListener(IngestJournal::SyncListener());
+    }
+    {
+        const std::lock_guard<std::mutex> lock(_mut);
+        _closing = true;
+        _taskCond.notify_all();
+    }
+    for(pthread_t thread : _threads) {
+        pthread_join(thread, NULL);
+    }
+}
+
+void IngestVerifier::push(const IngestFile &file, const std::string &srcPath, const std::string &copyPath) {
+    Task task;
+    task.file = &file;
+    task.srcPath = srcPath;
+    task.copyPath = copyPath;
+    task.hashed = false;
+    task.srcHash = 0;
+    task.compressed = false;
+    _push(task);
+}
+
+void IngestVerifier::pushHashed(const IngestFile &file, const std::string &srcPath, uint64_t srcHash, const std::string &copyPath) {
+    Task task;
+    task.file = &file;
+    task.srcPath = srcPath;
+    task.copyPath = copyPath;
+    task.hashed = true;
+    task.srcHash = srcHash;
+    task.compressed = false;
+    _push(task);
+}
+
+void IngestVerifier::pushCompressed(const IngestFile &file, const std::string &srcPath, uint64_t srcHash, const std::string &copyPath) {
+    Task task;
+    task.file = &file;
+    task.srcPath = srcPath;
+    task.copyPath = copyPath;
+    task.hashed = true;
+    task.srcHash = srcHash;
+    task.compressed = true;
+    _push(task);
+}
+
+void IngestVerifier::_push(const Task &task) {
+    if(_threads.empty()) { //verify in the copy thread
+        uint64_t hash = 0;
+        int error = _verify(task, hash);
+        _callback(*task.file, task.copyPath, error, hash);
+        return;
+    }
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(_holding) {
+        _held.push_back(task);
+        return;
+    }
+    _tasks.push_back(task);
+    _taskCond.notify_one();
+}
+
+void IngestVerifier::wait() {
+    std::unique_lock<std::mutex> lock(_mut);
+    while((!_tasks.empty() || !_held.empty() || !_syncing.empty() || (_busy > 0)) && !_stop) {
+        if(!_held.empty()) { //the last copies wait for a sync
+            lock.unlock();
+            _journal->commit(true);
+            lock.lock();
+        }
+        _idleCond.wait_for(lock, std::chrono::milliseconds(100));
+    }
+}
+
+// the syncs are serialized by the journal
+bool IngestVerifier::_onSync(IngestJournal::SyncStep step) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    switch(step) {
+        case IngestJournal::syncStart:
+            _syncing.insert(_syncing.end(), _held.begin(), _held.end());
+            _held.clear();
+            return !_syncing.empty();
+
+        case IngestJournal::syncDone:
+            _tasks.insert(_tasks.end(), _syncing.begin(), _syncing.end());
+            _syncing.clear();
+            _taskCond.notify_all();
+            break;
+
+        case IngestJournal::syncFailed: //for the next sync
+            _held.insert(_held.begin(), _syncing.begin(), _syncing.end());
+            _syncing.clear();
+            break;
+    }
+    return false;
+}
+
+void* IngestVerifier::_startWorker(void *verifier) {
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    ((IngestVerifier*)verifier)->_work();
+    return NULL;
+}
+
+void IngestVerifier::_work() {
+    std::unique_lock<std::mutex> lock(_mut);
+    while(true) {
+        while(_tasks.empty() && !_closing) {
+            _taskCond.wait(lock);
+        }
+        if(_tasks.empty()) {
+            return;
+        }
+        Task task = _tasks.front();
+        _tasks.pop_front();
+        if(_stop) {
+            continue; //the copies not verified stay partial, they will be checked again
+        }
+        ++_busy;
+        lock.unlock();
+        uint64_t hash = 0;
+        int error = _verify(task, hash);
+        _callback(*task.file, task.copyPath, error, hash);
+        lock.lock();
+        --_busy;
+        _idleCond.notify_all();
+    }
+}
+
+int IngestVerifier::_verify(const Task &task, uint64_t &hash) {
+    uint64_t copyHash;
+    hash = task.srcHash;
+    int error = task.hashed ? 0 : _hash(task.srcPath, task.file->size, false, false, hash);
+    if(error == 0) {
+        error = _hash(task.copyPath, task.file->size, true, task.compressed, copyHash);
+    }
+    if((error == 0) && (hash != copyHash)) {
+        log(LOG_ERR, "%s differs from %s", task.copyPath.c_str(), task.srcPath.c_str());
+        error = EBADMSG;
+    }
+    return error;
+}
+
+int IngestVerifier::_hash(const std::string &path, uint64_t size, bool fromDisk, bool compressed, uint64_t &hash) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        int error = errno;
+        log(LOG_ERR, "unable to open %s: %s", path.c_str(), strerror(errno));
+        return error;
+    }
+    //the cached pages can be dropped only once written, by the sync of the journal or here
+    if(fromDisk && (_holding || (fdatasync(fd) == 0))) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if(compressed) {
+        struct stat info;
+        if((fstat(fd, &info) == 0) && !_governor.acquireCheck(info.st_size, _stop)) {
+            close(fd);
+            return ECANCELED;
+        }
+        int error = IngestCompressor::hashContent(fd, size, hash);
+        close(fd);
+        return error;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    bool dropBehind = (size >= INGEST_LARGE_FILE_SIZE); // a video would evict the music
+    char *buffer = new char[HASH_BLOCK];
+    Checksum checksum;
+    int error = 0;
+    uint64_t offset = 0;
+    while(offset < size) {
+        size_t length = (size - offset > HASH_BLOCK) ? HASH_BLOCK : (size_t)(size - offset);
+        //the reads of the big disk share its bandwidth with the copies
+        if(fromDisk && !_governor.acquireCheck(length, _stop)) {
+            error = ECANCELED;
+            break;
+        }
+        ssize_t result = pread(fd, buffer, length, offset);
+        if((result == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if(result <= 0) {
+            error = (result == 0) ? EBADMSG : errno;
+            log(LOG_ERR, "unable to read %s: %s", path.c_str(), result == 0 ? "file truncated" : strerror(errno));
+            break;
+        }
+        checksum.update(buffer, result);
+        if(dropBehind) {
+            posix_fadvise(fd, offset, result, POSIX_FADV_DONTNEED);
+        }
+        offset += result;
+    }
+    delete[] buffer;
+    close(fd);
+    hash = checksum.digest();
+    return error;
+}
@@ -0,0 +1,75 @@
+#ifndef _INGEST_VERIFIER_HPP
+#define _INGEST_VERIFIER_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ingest_journal.hpp"
+
+struct IngestFile;
+class IngestGovernor;
+
+// check the copies while the next files are copied, with a thread by core.
+// The source is hashed from the page cache filled by the copy, so the stick is not read
+// twice, and the copy from the disk itself, after dropping its cached pages.
+// The copies wait for the next sync of the journal, their pages can then be dropped
+// without a sync by file. The big files are read around the cache, as they are copied.
+// The compressed copies are checked by the hash of their data.
+class IngestVerifier {
+    public:
+        // error is 0 when the copy is valid, EBADMSG when it differs from the source
+        typedef std::function<void(const IngestFile&, const std::string &copyPath, int error, uint64_t hash)> Callback;
+
+        // journal is NULL when it could not be opened, each copy is then synced by itself
+        IngestVerifier(const Callback&, IngestGovernor&, IngestJournal*, const std::atomic<bool> &stop);
+        ~IngestVerifier();
+
+        void push(const IngestFile&, const std::string &srcPath, const std::string &copyPath);
+        // the source was hashed by the copy, only the copy is read
+        void pushHashed(const IngestFile&, const std::string &srcPath, uint64_t srcHash, const std::string &copyPath);
+        void pushCompressed(const IngestFile&, const std::string &srcPath, uint64_t srcHash, const std::string &copyPath);
+        // wait until the files pushed are verified, or the stop. The journal is committed
+        // for the copies still waiting for a sync
+        void wait();
+
+    protected:
+        struct Task {
+            const IngestFile *file;
+            std::string srcPath;
+            std::string copyPath;
+            bool hashed;
+            uint64_t srcHash;
+            bool compressed;
+        };
+
+        Callback _callback;
+        IngestGovernor &_governor;
+        IngestJournal *_journal;
+        const std::atomic<bool> &_stop;
+        std::vector<pthread_t> _threads;
+        std::mutex _mut;
+        std::condition_variable _taskCond;
+        std::condition_variable _idleCond;
+        std::deque<Task> _tasks;
+        std::deque<Task> _held; // not synced yet
+        std::deque<Task> _syncing;
+        unsigned int _busy;
+        bool _closing;
+        bool _holding; // the copies wait for a sync of the journal
+
+        void _push(const Task&);
+        bool _onSync(IngestJournal::SyncStep);
+        static void* _startWorker(void*);
+        void _work();
+        int _verify(const Task&, uint64_t &hash);
+        int _hash(const std::string &path, uint64_t size, bool fromDisk, bool compressed, uint64_t &hash);
+};
+
+#endif // _INGEST_VERIFIER_HPP
@@ -12,6 +12,45 @@
 #include "gpio_button.hpp"
 #include "mpd.hpp"
 
+static unsigned int showStatus(Led &led, const Devices &devs, unsigned int lastBlinks) {
+    if(!devs.isBigDiskConnected()) {
+        led.blinkQuickly();
+    }
+    else if(devs.isCopying()) {
+        //one blink per fifth copied
+        unsigned int blinks = devs.getCopyProgress() / 20 + 1;
+        if(blinks > 5) {
+            blinks = 5;
+        }
+        if(blinks != lastBlinks) {
+            led.blinkNumber(blinks);
+        }
+        return blinks;
+    }
+    else if(devs.isCopyAvailable()) {
+        led.blinkSlowly();
+    }
+    else {
+        led.on();
+    }
+    return 0;
+}
+
+static void updateMusic(Devices &devs, Mpd &mpd) {
+    std::list<std::string> paths;
+    devs.collectMusicChanges(paths);
+    for(const std::string &path : paths) {
+        mpd.update(path);
+    }
+    std::list<std::pair<std::string, uint64_t> > volumes;
+    devs.collectPluggedVolumes(volumes);
+#ifndef DISABLE_AUTOPLAY
+    for(const std::pair<std::string, uint64_t> &volume : volumes) {
+        mpd.autoplay(volume.first, volume.second);
+    }
+#endif
+}
+
 //TODO: better error management
 //TODO: handle sigterm with sigaction, off the led and mount drive in r/o mode
 bool run(bool isDaemon) {
@@ -54,15 +93,8 @@ bool run(bool isDaemon) {
         log(LOG_ERR, "btn pause failed");
         return false;
     }
-    if(!devs.isBigDiskConnected()) {
-        led.blinkQuickly();
-    }
-    else if(devs.isCopyAvailable()) {
-        led.blinkSlowly();
-    }
-    else {
-        led.on();
-    }
+    unsigned int blinks = showStatus(led, devs, 0);
+    updateMusic(devs, mpd);
 
     bool exit = false;
     if(!isDaemon) {
@@ -73,11 +105,17 @@ bool run(bool isDaemon) {
         FD_ZERO(&readFsSet);
         FD_SET(signalFd, &readFsSet);
         FD_SET(devs.getUdevFd(), &readFsSet);
+        FD_SET(devs.getIngestFd(), &readFsSet);
+        FD_SET(mpd.getFd(), &readFsSet);
+        FD_SET(mpd.getEventPipe().getReadFd(), &readFsSet);
         FD_SET(btnNext.getPipe().getReadFd(), &readFsSet);
         FD_SET(btnPrev.getPipe().getReadFd(), &readFsSet);
         FD_SET(btnPause.getPipe().getReadFd(), &readFsSet);
 
         int max = std::max(signalFd,devs.getUdevFd());
+        max = std::max(max, devs.getIngestFd());
+        max = std::max(max, mpd.getFd());
+        max = std::max(max, mpd.getEventPipe().getReadFd());
         max = std::max(max, btnNext.getPipe().getReadFd());
         max = std::max(max, btnPrev.getPipe().getReadFd());
         max = std::max(max, btnPause.getPipe().getReadFd());
@@ -96,14 +134,25 @@ bool run(bool isDaemon) {
         }
         else if(FD_ISSET(devs.getUdevFd(), &readFsSet)) {
             devs.manageChanges();
-            if(!devs.isBigDiskConnected()) {
-                led.blinkQuickly();
-            }
-            else if(devs.isCopyAvailable()) {
-                led.blinkSlowly();
+            updateMusic(devs, mpd);
+            blinks = showStatus(led, devs, blinks);
+        }
+        else if(FD_ISSET(devs.getIngestFd(), &readFsSet)) {
+            devs.manageIngest();
+            updateMusic(devs, mpd);
+            unsigned int newBlinks = showStatus(led, devs, blinks);
+            if(newBlinks != blinks) {
+                log(LOG_INFO, "copy progress: %u%%, throttle level %u, %llu KB/s", devs.getCopyProgress(),
+                    devs.getCopyThrottle(), (unsigned long long)(devs.getCopyThroughput() / 1024));
             }
-            else {
-                led.on();
+            blinks = newBlinks;
+        }
+        else if(FD_ISSET(mpd.getFd(), &readFsSet)) {
+            mpd.manageEvents();
+        }
+        else if(FD_ISSET(mpd.getEventPipe().getReadFd(), &readFsSet)) {
+            if(mpd.getEventPipe().read() == Mpd::PLAY_STATE) {
+                devs.setMusicPlaying(mpd.isPlaying());
             }
         }
         else if(FD_ISSET(btnNext.getPipe().getReadFd(), &readFsSet)){
@@ -117,14 +166,14 @@ bool run(bool isDaemon) {
             char msg = btnPrev.getPipe().read();
             log(LOG_INFO, "btn Prev event %d", msg);
             if(msg == GpioButton::PRESS) {
-                mpd.next();
+                mpd.prev();
             }
         }
         else if(FD_ISSET(btnPause.getPipe().getReadFd(), &readFsSet)){
             char msg = btnPause.getPipe().read();
             log(LOG_INFO, "btn Pause event %d", msg);
             if(msg == GpioButton::PRESS) {
-                mpd.next();
+                mpd.playOrPause();
             }
         }
     }
@@ -1,498 +1,859 @@
 #include "mpd.hpp"
 
-#include <mpd/client.h>
-#include <mpd/status.h>
-#include <mpd/entity.h>
-#include <mpd/search.h>
-#include <mpd/tag.h>
+#include <mpd/idle.h>
+#include <mpd/pair.h>
+#include <algorithm>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
 #include <sys/timerfd.h>
+#include <sys/un.h>
 
 #include "config.h"
 #include "log.hpp"
 
-const char Mpd::EXIT;
-const char Mpd::PLAY_PAUSE;
-const char Mpd::NEXT;
-const char Mpd::PREV;
+const char Mpd::PLAY_STATE;
 const char Mpd::IDLE;
-const char Mpd::CONNECT;
-const char Mpd::WAIT_RECONNECT;
-const char Mpd::STATUS;
+const char Mpd::LIST;
+
+static uint64_t nowUsec() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
 Mpd::Mpd() {
     _cnxDelay = MPD_RECONNECT_DELAY;
-    _attemptCount = 0;
     _status = MPD_STATE_UNKNOWN;
-    _queueLength = 0;
+    _playing = false;
     _currentIndex = -1;
-    _timerFd = -1;
-    _conn = NULL;
-    _cmds.push_back(Mpd::CONNECT);
-    _cmds.push_back(Mpd::STATUS);
-    pthread_create(&_thread, NULL, Mpd::_startRun, (void*)this);
+    _targetIndex = -1;
+    _refresh = true;
+    _fd = -1;
+    _async = NULL;
+    _parser = NULL;
+    _reply = NULL;
+    _changes = 0;
+    _noidleSent = false;
+    _state = Mpd::disconnected;
+    _deadline = 0;
+    _lostAt = nowUsec(); // the first connection is measured too
+    _appearedAt = 0;
+    _autoplay = NULL;
+    _pluggedAt = 0;
+    _autoplayClear = false;
+    _autoplayPlay = false;
+    srandom(_lostAt);
+    //a stopped music is not resumed
+    _resumePending = _resume.open(MPD_RESUME_FILE) && _resume.getPrevious(_resumed) &&
+        ((_resumed.state == MPD_STATE_PLAY) || (_resumed.state == MPD_STATE_PAUSE)) && (_resumed.uri[0] != 0);
+    _synced = false;
+    signal(SIGPIPE, SIG_IGN); // a write on a closed connection is an error, not the end of the daemon
+
+    _epollFd = epoll_create1(EPOLL_CLOEXEC);
+    _timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = _timerFd;
+    if((_epollFd == -1) || (_timerFd == -1) || (epoll_ctl(_epollFd, EPOLL_CTL_ADD, _timerFd, &event) != 0)) {
+        log(LOG_ERR, "unable to watch the mpd connection: %s", strerror(errno));
+    }
+    _inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    event.data.fd = _inotifyFd;
+    if((_inotifyFd == -1) || (epoll_ctl(_epollFd, EPOLL_CTL_ADD, _inotifyFd, &event) != 0)) {
+        log(LOG_ERR, "unable to watch the mpd socket, reconnections will be slower: %s", strerror(errno));
+    }
+    _watchSocket();
+    _connect();
+    _watch();
 }
 
 Mpd::~Mpd() {
-    _pipe.send(Mpd::EXIT);
-
-    //wait thread for 3sec
-    timespec ts;
-    if(clock_gettime(CLOCK_REALTIME, &ts) == -1) {
-        log(LOG_ERR, "clock gettime failed");
-        return;
-    }
-    ts.tv_sec += 3;
-    int joined = pthread_timedjoin_np(_thread, NULL, &ts);
-    if(joined != 0) {
-        log(LOG_ERR, "unable to join the mpd thread");
-    }
+    _stopAutoplay();
+    _disconnect();
     if(_timerFd != -1){
         close(_timerFd);
     }
-    if(_conn != NULL) {
-        mpd_connection_free(_conn);
+    if(_inotifyFd != -1){
+        close(_inotifyFd);
+    }
+    if(_epollFd != -1){
+        close(_epollFd);
     }
 }
 
-void* Mpd::_startRun(void *mpd) {
-    signal(SIGCHLD,SIG_DFL); // A child process dies
-    signal(SIGTSTP,SIG_IGN); // Various TTY signals
-    signal(SIGTTOU,SIG_IGN);
-    signal(SIGTTIN,SIG_IGN);
-    signal(SIGHUP, SIG_IGN); // Ignore hangup signal
-    signal(SIGINT,SIG_IGN); // ignore SIGTERM
-    signal(SIGQUIT,SIG_IGN); // ignore SIGTERM
-    signal(SIGTERM,SIG_IGN); // ignore SIGTERM
-
-    int oldstate;
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-    ((Mpd*)mpd)->_run();
-    return NULL;
+int Mpd::getFd() const {
+    return _epollFd;
 }
 
-void Mpd::_run() {
-    while(true) {
-        char cmd = _cmds.empty() ? Mpd::IDLE : _cmds.front();
-        if(!_cmds.empty()) {
-            _cmds.pop_front();
-        }
-        if(cmd == Mpd::EXIT) {
-            return;
+void Mpd::manageEvents() {
+    epoll_event events[4];
+    int count = epoll_wait(_epollFd, events, 4, 0);
+    //the socket first: a timeout may replace it by a new one
+    for(int i = 0; i < count; i++) {
+        if((events[i].data.fd == _fd) && (_fd != -1)) {
+            _onSocket(events[i].events);
         }
-
-        bool success = _execCmd(cmd);
-        if(success) {
-            if((cmd != Mpd::CONNECT) && (cmd != Mpd::WAIT_RECONNECT)) {
-                _attemptCount = 0;
-            }
+    }
+    for(int i = 0; i < count; i++) {
+        if(events[i].data.fd == _inotifyFd) {
+            _onSocketFile();
         }
-        else if(cmd == CONNECT) {
-            mpd_connection_free(_conn);
-            _conn = NULL;
-            _cmds.push_front(Mpd::CONNECT);
-            _cmds.push_front(Mpd::WAIT_RECONNECT);
+        else if((_autoplay != NULL) && (events[i].data.fd == _autoplay->getPipe().getReadFd())) {
+            _onAutoplay();
         }
-        else {
-            if(_attemptCount >= 3) {
-                log(LOG_ERR, "max attempt to execute mpd command failed, dropping command");
-                _attemptCount = 0;
-            }
-            else{
-                _cmds.push_front(cmd);
-                ++_attemptCount;
-            }
-            if(!mpd_connection_clear_error(_conn)) {
-                mpd_connection_free(_conn);
-                _conn = NULL;
-                _cmds.push_front(Mpd::CONNECT);
-            }
+    }
+    for(int i = 0; i < count; i++) {
+        if(events[i].data.fd == _timerFd) {
+            _onTimeout();
         }
     }
+    _watch();
 }
 
+void Mpd::playOrPause() {
+    _push(MpdCommand::playPause, 0);
+}
 
-bool Mpd::_execCmd(char cmd) {
-    switch(cmd) {
-        case Mpd::STATUS:
-            return _getStatus();
+bool Mpd::isQueueEmpty() {
+    return _queue.getLength() == 0;
+}
 
-        case Mpd::NEXT:
-            return _playNext();
+void Mpd::next(){
+    _push(MpdCommand::skip, 1);
+}
 
-        case Mpd::CONNECT:
-            return _connect();
+void Mpd::prev() {
+    _push(MpdCommand::skip, -1);
+}
 
-        case Mpd::WAIT_RECONNECT:
-            return _waitReconnect();
+bool Mpd::isPlaying() const {
+    return _playing;
+}
 
-        case Mpd::IDLE:
-            return _idle();
+void Mpd::update(const std::string &path) {
+    std::string root = MPD_MUSIC_DIR;
+    if((path.compare(0, root.size(), root) != 0) || ((path.size() > root.size()) && (path[root.size()] != '/'))) {
+        log(LOG_ERR, "%s is out of the music folder, it is not updated", path.c_str());
+        return;
+    }
+    _pushUpdate(path.substr(std::min(root.size() + 1, path.size())));
+    _leaveIdle();
+    _watch();
+}
+
+const Pipe& Mpd::getEventPipe() const {
+    return _events;
+}
 
-        default:
-            log(LOG_ERR, "unknown mpd command: %d", cmd);
-            return true;
+// the commands pushed while a list is sent wait for its answer
+void Mpd::_push(MpdCommand::Type type, int offset) {
+    _cmds.push(type, offset, nowUsec() + MPD_PRESS_DEADLINE);
+    if(type == MpdCommand::skip) {
+        _warmNext();
     }
+    _leaveIdle();
+    _watch();
 }
 
-bool Mpd::_connect() {
-    _conn = mpd_connection_new(NULL, 0, 5000);
-    if(mpd_connection_get_error(_conn) == MPD_ERROR_SUCCESS) {
-        _cnxDelay = MPD_RECONNECT_DELAY;
-        log(LOG_INFO, "mpd connection established");
-        if(_timerFd != -1){
-            close(_timerFd);
-            _timerFd = -1;
-        }
-        return true;
+// the queue is kept until the first song is found
+void Mpd::autoplay(const std::string &root, uint64_t pluggedAt) {
+    _stopAutoplay();
+    _autoplay = new MpdAutoplay(root);
+    _pluggedAt = pluggedAt;
+    _adds.clear();
+    _autoplayClear = true;
+    _autoplayPlay = true;
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = _autoplay->getPipe().getReadFd();
+    if(epoll_ctl(_epollFd, EPOLL_CTL_ADD, event.data.fd, &event) != 0) {
+        log(LOG_ERR, "unable to watch the songs of %s: %s", root.c_str(), strerror(errno));
     }
-    log(LOG_ERR, "mpd conmection failed: %s", mpd_connection_get_error_message(_conn));
-    _cnxDelay *= MPD_RECONNECT_ACCEL;
-    if(_cnxDelay > MPD_RECONNECT_MAXDELAY) {
-        _cnxDelay = MPD_RECONNECT_MAXDELAY;
+}
+
+void Mpd::_onAutoplay() {
+    while(_autoplay->getPipe().read() != 0) {
+    }
+    std::vector<std::string> uris;
+    bool walking = _autoplay->take(uris);
+    _adds.insert(_adds.end(), uris.begin(), uris.end());
+    if(!walking) {
+        _stopAutoplay();
+    }
+    if(!_adds.empty()) {
+        _leaveIdle();
     }
-    return false;
 }
 
-bool Mpd::_waitReconnect() {
-    if(_timerFd == -1) {
-        _timerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+void Mpd::_stopAutoplay() {
+    if(_autoplay == NULL) {
+        return;
     }
-    itimerspec interval;
-    interval.it_value.tv_sec = _cnxDelay / 1000000;
-    interval.it_value.tv_nsec = (_cnxDelay % 1000000)* 1000;
-    interval.it_interval.tv_sec = 0;
-    interval.it_interval.tv_nsec = 0;
-    timerfd_settime(_timerFd, 0, &interval, NULL);
-    while(!_waitEvent(_timerFd)){
-        if(_cmds.front() == Mpd::EXIT) {
-            return true;
+    epoll_ctl(_epollFd, EPOLL_CTL_DEL, _autoplay->getPipe().getReadFd(), NULL);
+    delete _autoplay;
+    _autoplay = NULL;
+}
+
+// a folder waiting covers its subfolders, "" being the whole music
+static bool isInFolder(const std::string &uri, const std::string &folder) {
+    return folder.empty() || (uri == folder) ||
+        ((uri.size() > folder.size()) && (uri.compare(0, folder.size(), folder) == 0) && (uri[folder.size()] == '/'));
+}
+
+void Mpd::_pushUpdate(const std::string &uri) {
+    for(const std::string &folder : _updates) {
+        if(isInFolder(uri, folder)) {
+            return;
         }
     }
-    uint64_t unused;
-    read(_timerFd, &unused, sizeof(uint64_t));
-    return true;
+    _updates.erase(std::remove_if(_updates.begin(), _updates.end(), [&](const std::string &folder) -> bool {
+        return isInFolder(folder, uri);
+    }), _updates.end());
+    _updates.push_back(uri);
 }
 
-bool Mpd::_idle() {
-    mpd_connection_set_timeout(_conn, 2000000000);
-    if(!mpd_send_idle(_conn) || mpd_connection_get_error(_conn) != MPD_ERROR_SUCCESS) {
-        log(LOG_ERR, "idle mode failed: %s", mpd_connection_get_error_message(_conn));
-        mpd_connection_set_timeout(_conn, 5000);
-        return false;
+// the idle is left at once with noidle, the commands are sent after its answer
+void Mpd::_leaveIdle() {
+    if((_state != Mpd::ready) || _sent.empty() || (_sent.front().cmd != Mpd::IDLE) || _noidleSent) {
+        return;
     }
-    _waitEvent(mpd_connection_get_fd(_conn));
-    mpd_connection_set_timeout(_conn, 5000);
-    if(_cmds.front() == Mpd::EXIT) {
-        return true;
+    _noidleSent = true;
+    _sent.front().deadline = nowUsec() + MPD_COMMAND_TIMEOUT;
+    if(!mpd_async_send_command(_async, "noidle", NULL) || !mpd_async_io(_async, MPD_ASYNC_EVENT_WRITE)) {
+        log(LOG_ERR, "leaving idle mode failed: %s", mpd_async_get_error_message(_async));
+        _disconnect();
     }
-    int changes = (int)mpd_recv_idle(_conn, false);
-    if(changes == 0 || mpd_connection_get_error(_conn) != MPD_ERROR_SUCCESS) {
-        log(LOG_ERR, "idle mode failed: %s", mpd_connection_get_error_message(_conn));
-        return false;
+}
+
+// the folder of the socket is created by mpd too, so its parent is watched as well
+void Mpd::_watchSocket() {
+    if(_inotifyFd == -1) {
+        return;
     }
-    if(!mpd_response_finish(_conn)) {
-        log(LOG_ERR, "idle mode failed: %s", mpd_connection_get_error_message(_conn));
-        return false;
+    char folder[] = MPD_SOCKET;
+    char *slash = strrchr(folder, '/');
+    if((slash == NULL) || (slash == folder)) {
+        return;
+    }
+    *slash = 0;
+    if(inotify_add_watch(_inotifyFd, folder, IN_CREATE | IN_MOVED_TO | IN_ATTRIB) != -1) {
+        return;
     }
-    if((changes & MPD_IDLE_QUEUE) == MPD_IDLE_QUEUE || (changes & MPD_IDLE_PLAYER) == MPD_IDLE_PLAYER) {
-       _cmds.push_front(Mpd::STATUS);
+    slash = strrchr(folder, '/');
+    if(slash != NULL) {
+        *(slash == folder ? slash + 1 : slash) = 0;
+        inotify_add_watch(_inotifyFd, folder, IN_CREATE | IN_MOVED_TO);
     }
-    return true;
 }
 
-bool Mpd::_waitEvent(int contextFd) {
-    pollfd fds[2];
-    memset(fds, 0, sizeof(fds));
-    fds[0].fd = _pipe.getReadFd();
-    fds[0].events = POLLIN;
-    fds[1].fd = contextFd;
-    fds[1].events = POLLIN;
-    poll(fds, 2, -1);
-    if(fds[0].revents == POLLIN) {
-      _cmds.push_back(_pipe.read());
+// mpd binds its socket just before listening: the first tries may be refused, so the
+// backoff restarts from a short delay
+void Mpd::_onSocketFile() {
+    char events[4096];
+    while(read(_inotifyFd, events, sizeof(events)) > 0) {
     }
-    if(fds[1].revents == POLLIN) {
-        return true;
+    _watchSocket();
+    if((_state != Mpd::disconnected) || (access(MPD_SOCKET, F_OK) != 0)) {
+        return;
     }
-    return false;
+    _appearedAt = nowUsec();
+    _cnxDelay = MPD_RECONNECT_PROBE;
+    _connect();
 }
 
-void Mpd::next(){
-    _pipe.send(Mpd::NEXT);
+// the unix socket of MPD is used when it exists, else its port on localhost
+void Mpd::_connect() {
+    sockaddr_un local;
+    sockaddr_in remote;
+    sockaddr *address;
+    socklen_t length;
+    if(access(MPD_SOCKET, F_OK) == 0) {
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        strncpy(local.sun_path, MPD_SOCKET, sizeof(local.sun_path) - 1);
+        address = (sockaddr*)&local;
+        length = sizeof(local);
+    }
+    else {
+        memset(&remote, 0, sizeof(remote));
+        remote.sin_family = AF_INET;
+        remote.sin_port = htons(MPD_PORT);
+        remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address = (sockaddr*)&remote;
+        length = sizeof(remote);
+    }
+    _fd = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if((_fd == -1) || ((connect(_fd, address, length) != 0) && (errno != EINPROGRESS))) {
+        log(LOG_ERR, "mpd connection failed: %s", strerror(errno));
+        _disconnect();
+        return;
+    }
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLOUT;
+    event.data.fd = _fd;
+    epoll_ctl(_epollFd, EPOLL_CTL_ADD, _fd, &event);
+    _state = Mpd::connecting;
+    _deadline = nowUsec() + MPD_COMMAND_TIMEOUT;
 }
 
+bool Mpd::_onConnected() {
+    uint64_t now = nowUsec();
+    if(_appearedAt != 0) {
+        log(LOG_INFO, "mpd connection established after %u ms, %u ms after its socket appeared",
+            (unsigned int)((now - _lostAt) / 1000), (unsigned int)((now - _appearedAt) / 1000));
+    }
+    else {
+        log(LOG_INFO, "mpd connection established after %u ms", (unsigned int)((now - _lostAt) / 1000));
+    }
+    _lostAt = 0;
+    _appearedAt = 0;
+    _state = Mpd::ready;
+    _deadline = 0;
+    _cnxDelay = MPD_RECONNECT_DELAY;
+    _refresh = true;
+    _queue.clear(); // the versions of another MPD process mean nothing
+    _synced = false;
+    _updateJobs.clear(); // and its jobs are over
+    return _sendNext();
+}
 
-bool Mpd::_playNext() {
-    if(_queueLength == 0){
-        return true;
+// drop the connection and wait before the next one, the commands interrupted are tried
+// again if still in time. The delay is jittered between its half and itself.
+void Mpd::_disconnect() {
+    if(_fd != -1) {
+        epoll_ctl(_epollFd, EPOLL_CTL_DEL, _fd, NULL);
+        if(_async != NULL) {
+            mpd_async_free(_async); // closes the socket
+        }
+        else {
+            close(_fd);
+        }
     }
-    if((_status == MPD_STATE_PLAY) && (_queueLength == _currentIndex - 1)) {
-        return true;
+    _fd = -1;
+    _async = NULL;
+    if(_parser != NULL) {
+        mpd_parser_free(_parser);
+        _parser = NULL;
     }
-    int next = _currentIndex +1;
-    if(next + 1 >= _queueLength) {
-        next = _queueLength -1;
+    if(_reply != NULL) {
+        mpd_status_free(_reply);
+        _reply = NULL;
     }
-    if(!mpd_run_play_pos(_conn, next) || mpd_connection_get_error(_conn) != MPD_ERROR_SUCCESS) {
-        log(LOG_ERR, "playing next song failed: %s", mpd_connection_get_error_message(_conn));
-        return false;
+    for(std::deque<Request>::reverse_iterator i = _sent.rbegin(); i != _sent.rend(); ++i) {
+        _requeue(*i);
+    }
+    _sent.clear();
+    _noidleSent = false;
+    _state = Mpd::disconnected;
+    uint64_t now = nowUsec();
+    if(_lostAt == 0) {
+        _lostAt = now;
+    }
+    _deadline = now + _cnxDelay / 2 + random() % (_cnxDelay / 2 + 1);
+    _cnxDelay *= MPD_RECONNECT_ACCEL;
+    if(_cnxDelay > MPD_RECONNECT_MAXDELAY) {
+        _cnxDelay = MPD_RECONNECT_MAXDELAY;
     }
-    _currentIndex = next;
-    return true;
 }
 
-bool Mpd::_getStatus() {
-    mpd_send_status(_conn);
-    mpd_status* status = mpd_recv_status(_conn);
-    if(status == NULL) {
-        log(LOG_ERR, "mpd status failed: %s", mpd_connection_get_error_message(_conn));
-        return false;
+void Mpd::_onSocket(uint32_t events) {
+    if(_state == Mpd::connecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if((getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0) || (error != 0)) {
+            log(LOG_ERR, "mpd connection failed: %s", strerror((error != 0) ? error : errno));
+            _disconnect();
+            return;
+        }
+        _async = mpd_async_new(_fd);
+        _parser = mpd_parser_new();
+        if((_async == NULL) || (_parser == NULL)) {
+            log(LOG_ERR, "mpd connection failed: out of memory");
+            _disconnect();
+            return;
+        }
+        _state = Mpd::greeting;
+        _deadline = nowUsec() + MPD_COMMAND_TIMEOUT;
+        return;
     }
-    _status = mpd_status_get_state(status);
-    _queueLength = mpd_status_get_queue_length(status);
-    if(_status == MPD_STATE_PLAY || _status == MPD_STATE_PAUSE) {
-        _currentIndex = mpd_status_get_song_pos(status);
+    int flags = 0;
+    if((events & EPOLLIN) != 0) {
+        flags |= MPD_ASYNC_EVENT_READ;
     }
-    else {
-        _currentIndex = -1;
+    if((events & EPOLLOUT) != 0) {
+        flags |= MPD_ASYNC_EVENT_WRITE;
     }
-    mpd_status_free(status);
-    if(!mpd_response_finish(_conn)) {
-        log(LOG_ERR, "mpd status failed: %s", mpd_connection_get_error_message(_conn));
-        return false;
+    if((events & EPOLLHUP) != 0) {
+        flags |= MPD_ASYNC_EVENT_HUP;
+    }
+    if((events & EPOLLERR) != 0) {
+        flags |= MPD_ASYNC_EVENT_ERROR;
+    }
+    //the lines read before a closed connection are still handled
+    bool success = mpd_async_io(_async, (mpd_async_event)flags);
+    success = _receive() && success;
+    if(!success) {
+        if(mpd_async_get_error(_async) != MPD_ERROR_SUCCESS) {
+            log(LOG_ERR, "mpd connection lost: %s", mpd_async_get_error_message(_async));
+        }
+        _disconnect();
     }
-    return true;
 }
 
-/*
-        if(_idle) {
-            poll(fds, 1, -1);
-            if(fds[0].revents == POLLIN) { //exit cmd;
-                uint64_t msg = readEvent(_efd);
-                if(msg == Mpd::EXIT){
-                    exit = true;
-                }
-                else {
-                    std::lock_guard<std::mutex> lock(_mut);
-                    _cmds.push_front(Mpd::statusCmd);
-                    _cmds.push_front(Mpd::noIdleCmd);
-                }
-            }
+void Mpd::_onTimeout() {
+    uint64_t expirations;
+    read(_timerFd, &expirations, sizeof(uint64_t));
+    uint64_t now = nowUsec();
+    if(_state == Mpd::disconnected) {
+        if(now >= _deadline) {
+            _connect();
         }
-        else {
-            cnxDelay = MPD_RECONNECT_DELAY;
-           if(!exit) {
-                log(LOG_ERR, "mpd conmection lost: %s", mpd_connection_get_error_message(_conn));
-            }
-            mpd_connection_free(_conn);
+    }
+    else if(_state != Mpd::ready) {
+        if(now >= _deadline) {
+            log(LOG_ERR, "mpd connection timed out");
+            _disconnect();
         }
     }
+    else if(!_sent.empty() && (_sent.front().deadline != 0) && (now >= _sent.front().deadline)) {
+        log(LOG_ERR, "mpd command timed out");
+        _disconnect();
+    }
 }
-*/
 
-/*
+// the lines are parsed as they come, a command is over with its OK or ACK
+bool Mpd::_receive() {
+    char *line;
+    while((line = mpd_async_recv_line(_async)) != NULL) {
+        if(_state == Mpd::greeting) {
+            if(strncmp(line, "OK MPD ", 7) != 0) {
+                log(LOG_ERR, "unexpected mpd welcome: %s", line);
+                return false;
+            }
+            if(!_onConnected()) {
+                return false;
+            }
+            continue;
+        }
+        if(_sent.empty()) {
+            log(LOG_ERR, "unexpected mpd answer: %s", line);
+            return false;
+        }
+        switch(mpd_parser_feed(_parser, line)) {
+            case MPD_PARSER_PAIR: {
+                mpd_pair pair;
+                pair.name = mpd_parser_get_name(_parser);
+                pair.value = mpd_parser_get_value(_parser);
+                _onPair(pair);
+                break;
+            }
+            case MPD_PARSER_SUCCESS:
+                //the commands of a list end with list_OK, the list with OK
+                if(mpd_parser_is_discrete(_parser)) {
+                    ++_part;
+                }
+                else if(!_onResponse(true)) {
+                    return false;
+                }
+                break;
 
-static void
-print_tag(const struct mpd_song *song, enum mpd_tag_type type,
-        const char *label)
-{
-unsigned i = 0;
-      const char *value;
+            case MPD_PARSER_ERROR:
+                log(LOG_ERR, "mpd command failed: %s", mpd_parser_get_message(_parser));
+                if(!_onResponse(false)) {
+                    return false;
+                }
+                break;
 
-      while ((value = mpd_song_get_tag(song, type, i++)) != NULL)
-            printf("%s: %s\n", label, value);
+            default:
+                log(LOG_ERR, "malformed mpd answer: %s", line);
+                return false;
+        }
+    }
+    return mpd_async_get_error(_async) == MPD_ERROR_SUCCESS;
 }
 
-int main(int argc, char ** argv) {
-      struct mpd_connection *conn;
-
-      conn = mpd_connection_new(NULL, 0, 30000);
-
-      if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
-            fprintf(stderr,"%s\n", mpd_connection_get_error_message(conn));
-            mpd_connection_free(conn);
-            return -1;
-      }
-
-      {
-            int i;
-            for(i=0;i<3;i++) {
-                  printf("version[%i]: %i\n",i,
-                         mpd_connection_get_server_version(conn)[i]);
+void Mpd::_onPair(const mpd_pair &pair) {
+    switch(_sent.front().cmd) {
+        case Mpd::LIST:
+            if(_part == _sent.front().changesPart) {
+                _queue.feed(pair);
             }
-      }
-
-      if(argc==1) {
-            struct mpd_status * status;
-            struct mpd_song *song;
-            const struct mpd_audio_format *audio_format;
-
-            mpd_command_list_begin(conn, true);
-            mpd_send_status(conn);
-            mpd_send_current_song(conn);
-            mpd_command_list_end(conn);
-
-            status = mpd_recv_status(conn);
-            if (status == NULL) {
-                  fprintf(stderr,"%s\n", mpd_connection_get_error_message(conn));
-                  mpd_connection_free(conn);
-                  return -1;
+            else if(_part == _sent.front().changesPart + 1) {
+                mpd_status_feed(_reply, &pair);
             }
-
-            printf("volume: %i\n", mpd_status_get_volume(status));
-            printf("repeat: %i\n", mpd_status_get_repeat(status));
-            printf("queue version: %u\n", mpd_status_get_queue_version(status));
-            printf("queue length: %i\n", mpd_status_get_queue_length(status));
-            if (mpd_status_get_error(status) != NULL)
-                  printf("error: %s\n", mpd_status_get_error(status));
-
-
-                  printf("elaspedTime: %i\n",mpd_status_get_elapsed_time(status));
-                  printf("elasped_ms: %u\n", mpd_status_get_elapsed_ms(status));
-                  printf("totalTime: %i\n", mpd_status_get_total_time(status));
-                  printf("bitRate: %i\n", mpd_status_get_kbit_rate(status));
+            else if((_part >= _sent.front().updatesPart) && (_part < _sent.front().changesPart) && (strcmp(pair.name, "updating_db") == 0)) {
+                const std::string &uri = _sent.front().updates[_part - _sent.front().updatesPart];
+                _updateJobs[strtoul(pair.value, NULL, 10)] = std::make_pair(uri, nowUsec());
             }
+            break;
 
-            audio_format = mpd_status_get_audio_format(status);
-            if (audio_format != NULL) {
-                  printf("sampleRate: %i\n", audio_format->sample_rate);
-                  printf("bits: %i\n", audio_format->bits);
-                  printf("channels: %i\n", audio_format->channels);
+        case Mpd::IDLE:
+            if(strcmp(pair.name, "changed") == 0) {
+                _changes |= mpd_idle_name_parse(pair.value);
             }
+            break;
+    }
+}
 
-            if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
-                  fprintf(stderr,"%s\n", mpd_connection_get_error_message(conn));
-                  mpd_connection_free(conn);
-                  return -1;
+// a list refused by MPD is dropped, trying it again would not help. MPD stops at the
+// failed command, so the status is asked again
+bool Mpd::_onResponse(bool success) {
+    Request request = _sent.front();
+    _sent.pop_front();
+    switch(request.cmd) {
+        case Mpd::LIST:
+            if(success) {
+                _queue.endChanges(mpd_status_get_queue_version(_reply), mpd_status_get_queue_length(_reply));
+                _synced = true;
+                _setStatus(_reply);
+                _logSkip(request);
+                if(request.plays) {
+                    log(LOG_INFO, "autoplay: first song played %u ms after its volume was plugged", (unsigned int)((nowUsec() - _pluggedAt) / 1000));
+                }
             }
-
-            mpd_response_next(conn);
-
-            while ((song = mpd_recv_song(conn)) != NULL) {
-                  printf("uri: %s\n", mpd_song_get_uri(song));
-                  print_tag(song, MPD_TAG_ARTIST, "artist");
-                  print_tag(song, MPD_TAG_ALBUM, "album");
-                  print_tag(song, MPD_TAG_TITLE, "title");
-                  print_tag(song, MPD_TAG_TRACK, "track");
-                  print_tag(song, MPD_TAG_NAME, "name");
-                  print_tag(song, MPD_TAG_DATE, "date");
-
-                  if (mpd_song_get_duration(song) > 0) {
-                        printf("time: %u\n", mpd_song_get_duration(song));
-                  }
-
-                  printf("pos: %u\n", mpd_song_get_pos(song));
-
-                  mpd_song_free(song);
+            else {
+                _onListFailed(request);
             }
-
-            if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
-                  fprintf(stderr,"%s\n", mpd_connection_get_error_message(conn));
-                  mpd_connection_free(conn);
-                  return -1;
+            if(request.resumes) {
+                _onResumed(success);
             }
+            mpd_status_free(_reply);
+            _reply = NULL;
+            break;
 
-            if (!mpd_response_finish(conn)) {
-                  fprintf(stderr,"%s\n", mpd_connection_get_error_message(conn));
-                  mpd_connection_free(conn);
-                  return -1;
+        case Mpd::IDLE:
+            _noidleSent = false;
+            if((_changes & (MPD_IDLE_QUEUE | MPD_IDLE_PLAYER)) != 0) {
+                _refresh = true;
+            }
+            //the status tells which job runs
+            if(((_changes & MPD_IDLE_UPDATE) != 0) && !_updateJobs.empty()) {
+                _refresh = true;
             }
+            break;
+    }
+    return _sendNext();
+}
 
+// the commands waiting go in one list, the idle is sent when there is none
+bool Mpd::_sendNext() {
+    if((_state != Mpd::ready) || !_sent.empty()) {
+        return true;
+    }
+    if(_resumePending && _synced) {
+        return _sendResume();
+    }
+    Request request = Request(); // the flags of a list are false, its parts 0
+    //the skips are resolved against the mirror of the queue, they wait until it is rebuilt
+    unsigned int dropped = _synced ? _cmds.take(nowUsec(), request.commands) : _cmds.dropLate(nowUsec());
+    if(dropped > 0) {
+        log(LOG_INFO, "%u mpd commands dropped, too late", dropped);
+    }
+    if(request.commands.empty() && !_refresh && _updates.empty() && _adds.empty() && (_synced || _cmds.isEmpty())) {
+        return _sendIdle();
+    }
+    return _sendList(request);
+}
 
-      }
-      else if(argc==3 && strcmp(argv[1],"lsinfo")==0) {
-            struct mpd_entity * entity;
+bool Mpd::_sendIdle() {
+    Request request = Request(); // the flags of a list are false, its parts 0
+    request.cmd = Mpd::IDLE;
+    request.deadline = 0; // the idle lasts until a change or a command
+    _changes = 0;
+    //the command is written at once, the socket is seldom full
+    if(!mpd_async_send_command(_async, "idle", NULL) || !mpd_async_io(_async, MPD_ASYNC_EVENT_WRITE)) {
+        log(LOG_ERR, "idle mode failed: %s", mpd_async_get_error_message(_async));
+        return false;
+    }
+    _sent.push_back(request);
+    return true;
+}
 
-            if (!mpd_send_list_meta(conn,argv[2])) {
-                  fprintf(stderr,"%s\n", mpd_connection_get_error_message(conn));
-                  mpd_connection_free(conn);
-                  return -1;
+// the songs played are found in the mirror of the queue, as if each command was done,
+// and asked by id so a change of the queue meanwhile does not play another one
+bool Mpd::_sendList(Request &request) {
+    request.cmd = Mpd::LIST;
+    request.deadline = nowUsec() + MPD_COMMAND_TIMEOUT;
+    request.changesPart = 0;
+    bool sent = mpd_async_send_command(_async, "command_list_ok_begin", NULL);
+    int length = _queue.getLength();
+    int position = _currentIndex;
+    mpd_state state = _status;
+    for(const MpdCommand &command : request.commands) {
+        if(command.type == MpdCommand::skip) {
+            if(length == 0) {
+                continue; //nothing to play
             }
-
-            while ((entity = mpd_recv_entity(conn)) != NULL) {
-                  const struct mpd_song *song;
-                  const struct mpd_directory *dir;
-                  const struct mpd_playlist *pl;
-
-                  switch (mpd_entity_get_type(entity)) {
-                  case MPD_ENTITY_TYPE_UNKNOWN:
-                        break;
-
-                  case MPD_ENTITY_TYPE_SONG:
-                        song = mpd_entity_get_song(entity);
-                        printf("uri: %s\n", mpd_song_get_uri(song));
-                        print_tag(song, MPD_TAG_ARTIST, "artist");
-                        print_tag(song, MPD_TAG_ALBUM, "album");
-                        print_tag(song, MPD_TAG_TITLE, "title");
-                        print_tag(song, MPD_TAG_TRACK, "track");
-                        break;
-
-                  case MPD_ENTITY_TYPE_DIRECTORY:
-                        dir = mpd_entity_get_directory(entity);
-                        printf("directory: %s\n", mpd_directory_get_path(dir));
-                        break;
-
-                  case MPD_ENTITY_TYPE_PLAYLIST:
-                        pl = mpd_entity_get_playlist(entity);
-                        printf("playlist: %s\n",
-                               mpd_playlist_get_path(pl));
-                        break;
-                  }
-
-                  mpd_entity_free(entity);
+            position += command.offset;
+            if(position < 0) {
+                position = 0;
             }
-
-            if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
-                  fprintf(stderr, "%s\n",
-                        mpd_connection_get_error_message(conn));
-                  mpd_connection_free(conn);
-                  return -1;
+            if(position >= length) {
+                position = length - 1;
             }
+            char id[16];
+            snprintf(id, sizeof(id), "%u", _queue.getId(position));
+            sent = sent && mpd_async_send_command(_async, "playid", id, NULL);
+            state = MPD_STATE_PLAY;
+        }
+        else if(state == MPD_STATE_PLAY) {
+            sent = sent && mpd_async_send_command(_async, "pause", "1", NULL);
+            state = MPD_STATE_PAUSE;
+        }
+        else if(state == MPD_STATE_PAUSE) {
+            sent = sent && mpd_async_send_command(_async, "pause", "0", NULL);
+            state = MPD_STATE_PLAY;
+        }
+        else {
+            sent = sent && mpd_async_send_command(_async, "play", NULL);
+            state = MPD_STATE_PLAY;
+        }
+        ++request.changesPart;
+    }
+    request.updatesPart = request.changesPart;
+    request.updates.swap(_updates);
+    for(const std::string &uri : request.updates) {
+        sent = sent && mpd_async_send_command(_async, "update", uri.empty() ? NULL : uri.c_str(), NULL);
+        ++request.changesPart;
+    }
+    //the queue is cleared with the first songs found, not before
+    while(!_adds.empty() && (request.adds.size() < MPD_AUTOPLAY_BATCH)) {
+        request.adds.push_back(_adds.front());
+        _adds.pop_front();
+    }
+    request.clears = _autoplayClear && !request.adds.empty();
+    request.plays = _autoplayPlay && !request.adds.empty();
+    if(request.clears) {
+        sent = sent && mpd_async_send_command(_async, "clear", NULL);
+        ++request.changesPart;
+        _autoplayClear = false;
+    }
+    request.addsPart = request.changesPart;
+    for(const std::string &uri : request.adds) {
+        sent = sent && mpd_async_send_command(_async, "add", uri.c_str(), NULL);
+        ++request.changesPart;
+    }
+    if(request.plays) {
+        sent = sent && mpd_async_send_command(_async, "play", "0", NULL);
+        ++request.changesPart;
+        _autoplayPlay = false;
+    }
+    if(!_endList(request, sent)) {
+        return false;
+    }
+    _targetIndex = position;
+    return true;
+}
 
-            if (!mpd_response_finish(conn)) {
-                  fprintf(stderr, "%s\n", mpd_connection_get_error_message(conn));
-                  mpd_connection_free(conn);
-                  return -1;
-            }
-      }
-      else if(argc==2 && strcmp(argv[1],"artists")==0) {
-            struct mpd_pair *pair;
-
-            if (!mpd_search_db_tags(conn, MPD_TAG_ARTIST) ||
-                !mpd_search_commit(conn)) {
-                  fprintf(stderr,"%s\n", mpd_connection_get_error_message(conn));
-                  mpd_connection_free(conn);
-                  return -1;
-            }
+// the playback of the previous boot goes alone, so a refusal drops nothing else
+bool Mpd::_sendResume() {
+    _resumePending = false;
+    int position = _findResumed();
+    if(position < 0) {
+        log(LOG_INFO, "the song of the previous boot is no more in the queue, it is not resumed");
+        return _sendNext();
+    }
+    Request request = Request();
+    request.cmd = Mpd::LIST;
+    request.deadline = nowUsec() + MPD_COMMAND_TIMEOUT;
+    request.resumes = true;
+    char pos[16];
+    char elapsed[16];
+    snprintf(pos, sizeof(pos), "%d", position);
+    snprintf(elapsed, sizeof(elapsed), "%u.%03u", _resumed.elapsed / 1000, _resumed.elapsed % 1000);
+    bool sent = mpd_async_send_command(_async, "command_list_ok_begin", NULL) &&
+        mpd_async_send_command(_async, "seek", pos, elapsed, NULL) &&
+        mpd_async_send_command(_async, "pause", (_resumed.state == MPD_STATE_PAUSE) ? "1" : "0", NULL);
+    request.changesPart = 2;
+    if(!_endList(request, sent)) {
+        return false;
+    }
+    _targetIndex = position;
+    return true;
+}
 
-            while ((pair = mpd_recv_pair_tag(conn,
-                                     MPD_TAG_ARTIST)) != NULL) {
-                  printf("%s\n", pair->value);
-                  mpd_return_pair(conn, pair);
-            }
+// the song is looked for at its position first, the queue being often the same
+int Mpd::_findResumed() const {
+    unsigned int length = _queue.getLength();
+    if((_resumed.pos < length) && (_queue.getUri(_resumed.pos) == _resumed.uri)) {
+        return _resumed.pos;
+    }
+    for(unsigned int pos = 0; pos < length; pos++) {
+        if(_queue.getUri(pos) == _resumed.uri) {
+            return pos;
+        }
+    }
+    return -1;
+}
 
-             if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
-                  fprintf(stderr,"%s\n", mpd_connection_get_error_message(conn));
-                 mpd_connection_free(conn);
-                  return -1;
-            }
+// every list ends with the changes of the queue and the status
+bool Mpd::_endList(Request &request, bool sent) {
+    char version[16];
+    snprintf(version, sizeof(version), "%u", _queue.getVersion());
+    sent = sent && mpd_async_send_command(_async, "plchanges", version, NULL) &&
+        mpd_async_send_command(_async, "status", NULL) && mpd_async_send_command(_async, "command_list_end", NULL);
+    _reply = mpd_status_begin();
+    _part = 0;
+    _queue.beginChanges();
+    if(!sent || (_reply == NULL) || !mpd_async_io(_async, MPD_ASYNC_EVENT_WRITE)) {
+        log(LOG_ERR, "sending mpd commands failed: %s", mpd_async_get_error_message(_async));
+        _requeue(request);
+        return false;
+    }
+    _refresh = false;
+    _sent.push_back(request);
+    return true;
+}
 
-            if (!mpd_response_finish(conn)) {
-                  fprintf(stderr,"%s\n", mpd_connection_get_error_message(conn));
-                  mpd_connection_free(conn);
-                  return -1;
-            }
-      }
+// what was not sent is put back in front of what waits
+void Mpd::_requeue(const Request &request) {
+    _cmds.pushFront(request.commands);
+    _resumePending = _resumePending || request.resumes;
+    for(const std::string &uri : request.updates) {
+        _pushUpdate(uri);
+    }
+    _adds.insert(_adds.begin(), request.adds.begin(), request.adds.end());
+    _autoplayClear = _autoplayClear || request.clears;
+    _autoplayPlay = _autoplayPlay || request.plays;
+}
+
+// MPD stops at the failed command: the updates, clear and songs after it are sent again,
+// the status is asked again. A song refused is skipped, the next one is played instead
+void Mpd::_onListFailed(const Request &request) {
+    unsigned int at = mpd_parser_get_at(_parser);
+    for(unsigned int i = 0; i < request.updates.size(); i++) {
+        if(request.updatesPart + i == at) {
+            log(LOG_ERR, "mpd update of %s refused", request.updates[i].c_str());
+        }
+        else if(request.updatesPart + i > at) {
+            _pushUpdate(request.updates[i]);
+        }
+    }
+    for(unsigned int i = request.adds.size(); i > 0; i--) {
+        if(request.addsPart + i - 1 == at) {
+            log(LOG_ERR, "mpd refused to add %s", request.adds[i - 1].c_str());
+        }
+        else if(request.addsPart + i - 1 > at) {
+            _adds.push_front(request.adds[i - 1]);
+        }
+    }
+    if(request.clears && (request.addsPart - 1 >= at)) {
+        _autoplayClear = true;
+    }
+    if(request.plays && (request.addsPart + request.adds.size() >= at)) {
+        _autoplayPlay = true;
+    }
+    _refresh = true;
+}
+
+// the time to the music is measured from the power on, as the boot is part of the wait
+void Mpd::_onResumed(bool success) {
+    if(!success) {
+        log(LOG_ERR, "the playback of the previous boot could not be resumed");
+        return;
+    }
+    timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    log(LOG_INFO, "playback of %s resumed at %u ms, %u ms after power on",
+        _resumed.uri, _resumed.elapsed, (unsigned int)(now.tv_sec * 1000 + now.tv_nsec / 1000000));
+}
 
-      mpd_connection_free(conn);
+void Mpd::_setStatus(const mpd_status *status) {
+    _status = mpd_status_get_state(status);
+    //the mirror is current, the status came with its changes
+    MpdPlayback playback;
+    int pos = mpd_status_get_song_pos(status);
+    playback.pos = (pos >= 0) ? pos : 0;
+    playback.elapsed = mpd_status_get_elapsed_ms(status);
+    playback.state = _status;
+    playback.uri[0] = 0;
+    if((pos >= 0) && ((unsigned int)pos < _queue.getLength()) && (_queue.getUri(pos).size() < MpdPlayback::MAX_URI)) {
+        strcpy(playback.uri, _queue.getUri(pos).c_str());
+    }
+    _resume.save(playback);
+    if(_status == MPD_STATE_PLAY || _status == MPD_STATE_PAUSE) {
+        _currentIndex = mpd_status_get_song_pos(status);
+    }
+    else {
+        _currentIndex = -1;
+    }
+    _targetIndex = _currentIndex;
+    _warmNext();
+    //the jobs run one after the other, in the order of their ids
+    unsigned int running = mpd_status_get_update_id(status);
+    std::map<unsigned int, std::pair<std::string, uint64_t> >::iterator i = _updateJobs.begin();
+    while((i != _updateJobs.end()) && ((running == 0) || (i->first < running))) {
+        log(LOG_INFO, "mpd update of %s done in %u ms", i->second.first.c_str(), (unsigned int)((nowUsec() - i->second.second) / 1000));
+        _updateJobs.erase(i++);
+    }
+    if((_status == MPD_STATE_PLAY) != _playing) {
+        _playing = (_status == MPD_STATE_PLAY);
+        _events.send(Mpd::PLAY_STATE);
+    }
+}
 
-      return 0;
+// the time from the last press of a skip to its song played, as MPD answers playid once
+// the song is opened
+void Mpd::_logSkip(const Request &request) {
+    for(std::vector<MpdCommand>::const_reverse_iterator i = request.commands.rbegin(); i != request.commands.rend(); ++i) {
+        if(i->type == MpdCommand::skip) {
+            uint64_t pressedAt = i->deadline - MPD_PRESS_DEADLINE;
+            log(LOG_INFO, "skip of %d songs played %u ms after the press", i->offset, (unsigned int)((nowUsec() - pressedAt) / 1000));
+            return;
+        }
+    }
 }
 
-*/
+// the song the waiting skips lead to, and the following ones
+void Mpd::_warmNext() {
+    int length = _queue.getLength();
+    if(length == 0) {
+        return;
+    }
+    int target = std::min(std::max(_targetIndex + _cmds.getSkipOffset(), 0), length - 1);
+    std::vector<std::string> uris;
+    for(int pos = target; (pos < length) && (pos <= target + MPD_PREWARM_TRACKS); pos++) {
+        uris.push_back(_queue.getUri(pos));
+    }
+    _prewarm.warm(uris);
+}
 
+// the socket is watched for what mpd_async needs, the timer for the nearest deadline
+void Mpd::_watch() {
+    if(_fd != -1) {
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.data.fd = _fd;
+        if(_state == Mpd::connecting) {
+            event.events = EPOLLOUT;
+        }
+        else {
+            int wanted = mpd_async_events(_async);
+            event.events = (((wanted & MPD_ASYNC_EVENT_READ) != 0) ? EPOLLIN : 0) | (((wanted & MPD_ASYNC_EVENT_WRITE) != 0) ? EPOLLOUT : 0);
+        }
+        epoll_ctl(_epollFd, EPOLL_CTL_MOD, _fd, &event);
+    }
+    uint64_t deadline = _deadline;
+    if((_state == Mpd::ready) && !_sent.empty()) {
+        deadline = _sent.front().deadline;
+    }
+    itimerspec interval;
+    memset(&interval, 0, sizeof(interval));
+    if(deadline != 0) {
+        interval.it_value.tv_sec = deadline / 1000000;
+        interval.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    }
+    timerfd_settime(_timerFd, TFD_TIMER_ABSTIME, &interval, NULL);
+}
@@ -1,56 +1,146 @@
 #ifndef _MPD_HPP
 #define _MPD_HPP
 
-#include <mpd/connection.h>
+#include <mpd/async.h>
+#include <mpd/parser.h>
 #include <mpd/status.h>
-#include <pthread.h>
+#include <stdint.h>
 #include <deque>
-#include <poll.h>
+#include <map>
+#include <string>
+#include <vector>
 
 #include "pipe.hpp"
+#include "mpd_commands.hpp"
+#include "mpd_autoplay.hpp"
+#include "mpd_prewarm.hpp"
+#include "mpd_queue.hpp"
+#include "mpd_resume.hpp"
 
+// MPD client run by the event loop of the daemon. The connection is non-blocking, driven
+// by its fd through mpd_async, and each command has a deadline: a stalled server only
+// costs a reconnection, never a blocked loop. Between two commands, the client waits
+// in idle, left with noidle as soon as a command comes. The commands which came meanwhile
+// are merged, then sent in one command list which ends with the changes of the queue
+// and a status, so the mirror of the queue is current when the next press comes.
+// While disconnected, the folder of the MPD socket is watched: the connection is tried
+// the moment the socket appears, the jittered backoff only covers the other cases.
+// The songs a skip would play are read ahead from the mirror, before the press is sent.
+// The folders changed are updated in MPD with the next list, and their jobs followed.
+// The songs of a volume plugged replace the queue as they are found, the first at once.
+// Each status is saved for the next boot, which resumes the playback with a list of its
+// own once the queue is mirrored.
 class Mpd {
     public:
+        static const char PLAY_STATE = 1; // the music started or stopped
+
         Mpd();
         ~Mpd();
 
+        int getFd() const; // readable when manageEvents() has something to do
+        void manageEvents();
         void playOrPause();
         bool isQueueEmpty();
         void next();
         void prev();
+        bool isPlaying() const;
+        // scan again a folder of the music, or one removed
+        void update(const std::string &path);
+        // play the songs of a volume, pluggedAt is when udev announced it (usec, monotonic clock)
+        void autoplay(const std::string &root, uint64_t pluggedAt);
+        const Pipe& getEventPipe() const;
 
     protected:
-        static const char EXIT = 1;
-        static const char PLAY_PAUSE = 2;
-        static const char NEXT = 3;
-        static const char PREV = 4;
+        enum State {
+            disconnected, // waiting for the reconnection delay
+            connecting,
+            greeting, // waiting for the server welcome
+            ready
+        };
+
         static const char IDLE = 5;
-        static const char CONNECT = 7;
-        static const char WAIT_RECONNECT = 8;
-        static const char STATUS = 9;
-
-        pthread_t _thread;
-        Pipe _pipe;
-        mpd_connection *_conn;
-        std::deque<char> _cmds;
-        int _queueLength;
+        static const char LIST = 6;
+
+        // a command sent, waiting for its answer
+        struct Request {
+            char cmd;
+            uint64_t deadline; // usec on the monotonic clock, 0 for none
+            std::vector<MpdCommand> commands; // of a list
+            std::vector<std::string> updates; // URIs of folders
+            unsigned int updatesPart; // index of the first update in the list
+            bool clears; // the queue is replaced by the songs added
+            std::vector<std::string> adds; // URIs of songs
+            unsigned int addsPart;
+            bool plays; // the first song added is played
+            unsigned int changesPart; // index of the plchanges in the list
+            bool resumes; // the list is the playback of the previous boot
+        };
+
+        Pipe _events;
+        int _epollFd;
+        int _timerFd;
+        int _inotifyFd; // watches the creation of the MPD socket
+        int _fd;
+        mpd_async *_async;
+        mpd_parser *_parser;
+        State _state;
+        uint64_t _deadline; // of the connection steps
+        uint64_t _lostAt; // when the connection was lost, 0 if connected
+        uint64_t _appearedAt; // when the socket appeared while disconnected, 0 if not
+        MpdCommands _cmds; // waiting to be sent
+        bool _refresh; // a status is needed
+        std::deque<Request> _sent;
+        std::vector<std::string> _updates; // waiting to be sent
+        std::map<unsigned int, std::pair<std::string, uint64_t> > _updateJobs; // URI and start, by id
+        MpdAutoplay *_autoplay; // NULL when no volume is walked
+        uint64_t _pluggedAt;
+        std::deque<std::string> _adds; // waiting to be sent
+        bool _autoplayClear;
+        bool _autoplayPlay;
+        bool _noidleSent;
+        mpd_status *_reply; // status being received
+        unsigned int _part; // of the list being received
+        int _changes; // idle changes being received
+        MpdQueue _queue;
         int _currentIndex;
+        int _targetIndex; // once the lists sent are done
+        MpdPrewarm _prewarm;
         int _cnxDelay;
         mpd_state _status;
-        int _attemptCount;
-        int _timerFd;
+        bool _playing;
+        MpdResume _resume;
+        bool _resumePending; // the playback of the previous boot is still to send
+        bool _synced; // the queue was mirrored since the connection
+        MpdPlayback _resumed;
 
-        static void* _startRun(void*);
-        void _run();
-        bool _execCmd(char cmd);
-        bool _waitEvent(int fd);
-        bool _connect();
-        bool _waitReconnect();
-        bool _idle();
-        bool _getStatus();
-        bool _playNext();
-        bool _playPrev();
+        void _push(MpdCommand::Type, int offset);
+        void _leaveIdle();
+        void _watchSocket();
+        void _onSocketFile();
+        void _connect();
+        bool _onConnected();
+        void _disconnect();
+        void _onSocket(uint32_t events);
+        void _onTimeout();
+        bool _receive();
+        void _onPair(const mpd_pair&);
+        bool _onResponse(bool success);
+        bool _sendNext();
+        bool _sendIdle();
+        bool _sendList(Request&);
+        bool _sendResume();
+        int _findResumed() const;
+        bool _endList(Request&, bool sent);
+        void _onResumed(bool success);
+        void _logSkip(const Request&);
+        void _onListFailed(const Request&);
+        void _pushUpdate(const std::string &uri);
+        void _onAutoplay();
+        void _stopAutoplay();
+        void _requeue(const Request&);
+        void _setStatus(const mpd_status*);
+        void _warmNext();
+        void _watch();
 };
 
 #endif // _MPD_HPP
-
@@ -0,0 +1,84 @@
+#include "mpd_autoplay.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+
+#include "config.h"
+#include "log.hpp"
+#include "ingest_scan.hpp"
+
+MpdAutoplay::MpdAutoplay(const std::string &root): _root(root) {
+    //the junk of the copies is left out too, then the folders are walked for the songs only
+    static const char* junk[] = INGEST_FILTER;
+    static const char* types[] = MPD_AUTOPLAY_TYPES;
+    std::vector<std::string> rules(junk, junk + sizeof(junk)/sizeof(const char*));
+    rules.push_back("+*/");
+    for(const char *type : types) {
+        rules.push_back(std::string("+*.") + type);
+    }
+    rules.push_back("-*");
+    _filter.compile(rules);
+    _stop = false;
+    _over = false;
+    _started = (pthread_create(&_thread, NULL, MpdAutoplay::_startWorker, (void*)this) == 0);
+    if(!_started) {
+        log(LOG_ERR, "unable to look for the songs of %s: %s", root.c_str(), strerror(errno));
+        _over = true;
+    }
+}
+
+MpdAutoplay::~MpdAutoplay() {
+    _stop = true;
+    if(_started) {
+        pthread_join(_thread, NULL);
+    }
+}
+
+const std::string& MpdAutoplay::getRoot() const {
+    return _root;
+}
+
+const Pipe& MpdAutoplay::getPipe() const {
+    return _pipe;
+}
+
+bool MpdAutoplay::take(std::vector<std::string> &uris) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    uris.insert(uris.end(), _found.begin(), _found.end());
+    _found.clear();
+    return !_over || !uris.empty();
+}
+
+void* MpdAutoplay::_startWorker(void *autoplay) {
+    ((MpdAutoplay*)autoplay)->_work();
+    return NULL;
+}
+
+void MpdAutoplay::_work() {
+    IngestScanner scanner(_root, _filter, INGEST_SCAN_THREADS, &_stop);
+    IngestFolder folder;
+    unsigned int count = 0;
+    while(scanner.next(folder)) {
+        if(folder.files.empty()) {
+            continue;
+        }
+        std::sort(folder.files.begin(), folder.files.end(), [](const IngestFile &a, const IngestFile &b) -> bool {
+            return a.path < b.path;
+        });
+        {
+            const std::lock_guard<std::mutex> lock(_mut);
+            for(const IngestFile &file : folder.files) {
+                _found.push_back("file://" + _root + file.path);
+            }
+        }
+        count += folder.files.size();
+        _pipe.send(1);
+    }
+    {
+        const std::lock_guard<std::mutex> lock(_mut);
+        _over = true;
+    }
+    _pipe.send(1);
+    log(LOG_INFO, "%u songs found on %s", count, _root.c_str());
+}
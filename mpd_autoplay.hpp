@@ -0,0 +1,41 @@
+#ifndef _MPD_AUTOPLAY_HPP
+#define _MPD_AUTOPLAY_HPP
+
+#include <pthread.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "pipe.hpp"
+#include "ingest_filter.hpp"
+
+// look for the songs of a volume just plugged, to play them at once. The volume is walked
+// by the ingest scanner, and the songs of each folder are given as soon as it is read,
+// in the order of their names, as file:// URIs: MPD plays them before its library knows them.
+class MpdAutoplay {
+    public:
+        MpdAutoplay(const std::string &root);
+        ~MpdAutoplay();
+
+        const std::string& getRoot() const;
+        const Pipe& getPipe() const; // an event when songs are found
+        // the songs found since the last call, false when the walk is over and all were taken
+        bool take(std::vector<std::string> &uris);
+
+    protected:
+        std::string _root;
+        IngestFilter _filter;
+        Pipe _pipe;
+        pthread_t _thread;
+        bool _started;
+        std::atomic<bool> _stop;
+        std::mutex _mut;
+        std::vector<std::string> _found;
+        bool _over;
+
+        static void* _startWorker(void*);
+        void _work();
+};
+
+#endif // _MPD_AUTOPLAY_HPP
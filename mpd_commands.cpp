@@ -0,0 +1,70 @@
+#include "mpd_commands.hpp"
+
+void MpdCommands::push(MpdCommand::Type type, int offset, uint64_t deadline) {
+    if(!_cmds.empty() && (_cmds.back().type == type)) {
+        MpdCommand &last = _cmds.back();
+        if(type == MpdCommand::playPause) {
+            _cmds.pop_back();
+            return;
+        }
+        //the merged skip is as recent as its last press
+        last.offset += offset;
+        last.deadline = deadline;
+        if(last.offset == 0) {
+            _cmds.pop_back();
+        }
+        return;
+    }
+    MpdCommand command;
+    command.type = type;
+    command.offset = offset;
+    command.deadline = deadline;
+    _cmds.push_back(command);
+}
+
+void MpdCommands::pushFront(const std::vector<MpdCommand> &commands) {
+    _cmds.insert(_cmds.begin(), commands.begin(), commands.end());
+}
+
+bool MpdCommands::isEmpty() const {
+    return _cmds.empty();
+}
+
+int MpdCommands::getSkipOffset() const {
+    int offset = 0;
+    for(const MpdCommand &command : _cmds) {
+        if(command.type == MpdCommand::skip) {
+            offset += command.offset;
+        }
+    }
+    return offset;
+}
+
+unsigned int MpdCommands::take(uint64_t now, std::vector<MpdCommand> &commands) {
+    unsigned int dropped = 0;
+    for(const MpdCommand &command : _cmds) {
+        if(now > command.deadline) {
+            ++dropped;
+        }
+        else {
+            commands.push_back(command);
+        }
+    }
+    _cmds.clear();
+    return dropped;
+}
+
+unsigned int MpdCommands::dropLate(uint64_t now) {
+    unsigned int dropped = 0;
+    std::deque<MpdCommand>::iterator i = _cmds.begin();
+    while(i != _cmds.end()) {
+        if(now > i->deadline) {
+            i = _cmds.erase(i);
+            ++dropped;
+        }
+        else {
+            ++i;
+        }
+    }
+    return dropped;
+}
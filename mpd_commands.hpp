@@ -0,0 +1,38 @@
+#ifndef _MPD_COMMANDS_HPP
+#define _MPD_COMMANDS_HPP
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+// a command asked by the buttons
+struct MpdCommand {
+    enum Type {
+        skip,
+        playPause
+    };
+
+    Type type;
+    int offset; // songs skipped, negative backward
+    uint64_t deadline; // usec on the monotonic clock, the command is dropped if not sent by then
+};
+
+// the commands waiting for MPD, merged as they come: the following skips add up in one
+// jump, two following play/pause toggles cancel out. Not thread safe.
+class MpdCommands {
+    public:
+        void push(MpdCommand::Type, int offset, uint64_t deadline);
+        // put back commands sent but not done, before the others and as they were
+        void pushFront(const std::vector<MpdCommand>&);
+        bool isEmpty() const;
+        int getSkipOffset() const; // of the skips waiting
+        // take the commands still in time, in order, the count of the others is returned
+        unsigned int take(uint64_t now, std::vector<MpdCommand>&);
+        // drop the commands out of time and keep the others, their count is returned
+        unsigned int dropLate(uint64_t now);
+
+    protected:
+        std::deque<MpdCommand> _cmds;
+};
+
+#endif // _MPD_COMMANDS_HPP
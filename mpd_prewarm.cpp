@@ -0,0 +1,112 @@
+#include "mpd_prewarm.hpp"
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "log.hpp"
+
+#define MAX_WARMED      (4 * MPD_PREWARM_TRACKS) // songs remembered as warmed
+
+MpdPrewarm::MpdPrewarm() {
+    _generation = 0;
+    _closing = false;
+    _started = (pthread_create(&_thread, NULL, MpdPrewarm::_startWorker, (void*)this) == 0);
+    if(!_started) {
+        log(LOG_ERR, "unable to start the read ahead of the songs: %s", strerror(errno));
+    }
+}
+
+MpdPrewarm::~MpdPrewarm() {
+    {
+        const std::lock_guard<std::mutex> lock(_mut);
+        _closing = true;
+        _cond.notify_all();
+    }
+    if(_started) {
+        pthread_join(_thread, NULL);
+    }
+}
+
+void MpdPrewarm::warm(const std::vector<std::string> &uris) {
+    const std::lock_guard<std::mutex> lock(_mut);
+    if(uris == _wanted) {
+        return;
+    }
+    _wanted = uris;
+    ++_generation;
+    _cond.notify_all();
+}
+
+void* MpdPrewarm::_startWorker(void *prewarm) {
+    ((MpdPrewarm*)prewarm)->_work();
+    return NULL;
+}
+
+// a new list interrupts the current one between two songs
+void MpdPrewarm::_work() {
+    std::unique_lock<std::mutex> lock(_mut);
+    unsigned int done = 0;
+    while(!_closing) {
+        if(done == _generation) {
+            _cond.wait(lock);
+            continue;
+        }
+        done = _generation;
+        uint64_t budget = MPD_PREWARM_BUDGET;
+        for(size_t i = 0; (i < _wanted.size()) && (done == _generation) && (budget > 0) && !_closing; i++) {
+            std::string uri = _wanted[i];
+            if(_isWarmed(uri)) {
+                continue;
+            }
+            lock.unlock();
+            budget -= _warm(uri, budget);
+            lock.lock();
+            _warmed.push_back(uri);
+            if(_warmed.size() > MAX_WARMED) {
+                _warmed.pop_front();
+            }
+        }
+    }
+}
+
+bool MpdPrewarm::_isWarmed(const std::string &uri) const {
+    for(const std::string &warmed : _warmed) {
+        if(warmed == uri) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the streams are not files, they are skipped
+uint64_t MpdPrewarm::_warm(const std::string &uri, uint64_t budget) {
+    std::string path;
+    if(uri.compare(0, 7, "file://") == 0) {
+        path = uri.substr(7);
+    }
+    else if(!uri.empty() && (uri.find("://") == std::string::npos)) {
+        path = std::string(MPD_MUSIC_DIR "/") + uri;
+    }
+    else {
+        return 0;
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        log(LOG_ERR, "unable to read ahead %s: %s", path.c_str(), strerror(errno));
+        return 0;
+    }
+    struct stat info;
+    uint64_t length = 0;
+    if(fstat(fd, &info) == 0) {
+        length = std::min(std::min((uint64_t)info.st_size, (uint64_t)MPD_PREWARM_SIZE), budget);
+        posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+    }
+    close(fd);
+    return length;
+}
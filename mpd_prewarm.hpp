@@ -0,0 +1,39 @@
+#ifndef _MPD_PREWARM_HPP
+#define _MPD_PREWARM_HPP
+
+#include <pthread.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// reads ahead the songs MPD will play next, so a skip does not wait for the big disk to
+// spin up and seek. The heads of the songs are advised to the kernel from a thread, as
+// opening a file of a sleeping disk blocks, within a budget of bytes by list of songs.
+class MpdPrewarm {
+    public:
+        MpdPrewarm();
+        ~MpdPrewarm();
+
+        // the URIs of the songs, relative to the music folder, the most urgent first.
+        // The songs of the previous list not warmed yet are forgotten
+        void warm(const std::vector<std::string> &uris);
+
+    protected:
+        pthread_t _thread;
+        bool _started;
+        std::mutex _mut;
+        std::condition_variable _cond;
+        std::vector<std::string> _wanted;
+        unsigned int _generation; // of the wanted list
+        std::deque<std::string> _warmed; // lately, not warmed again
+        bool _closing;
+
+        static void* _startWorker(void*);
+        void _work();
+        bool _isWarmed(const std::string &uri) const;
+        static uint64_t _warm(const std::string &uri, uint64_t budget);
+};
+
+#endif // _MPD_PREWARM_HPP
@@ -0,0 +1,172 @@
+#include "mpd_queue.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+const unsigned int MpdQueue::NO_TAG;
+
+MpdQueue::MpdQueue() {
+    _version = 0;
+    _startSong();
+}
+
+unsigned int MpdQueue::getVersion() const {
+    return _version;
+}
+
+unsigned int MpdQueue::getLength() const {
+    return _ids.size();
+}
+
+unsigned int MpdQueue::getId(unsigned int pos) const {
+    return _ids[pos];
+}
+
+const std::string& MpdQueue::getUri(unsigned int pos) const {
+    return _uris[pos];
+}
+
+int MpdQueue::_getPosition(unsigned int id) const {
+    std::unordered_map<unsigned int, unsigned int>::const_iterator found = _positions.find(id);
+    if((found == _positions.end()) || (found->second >= _ids.size()) || (_ids[found->second] != id)) {
+        return -1;
+    }
+    return found->second;
+}
+
+void MpdQueue::beginChanges() {
+    _startSong();
+}
+
+// a song starts with its file and ends with its position and id
+void MpdQueue::feed(const mpd_pair &pair) {
+    if(strcmp(pair.name, "file") == 0) {
+        _endSong();
+        _startSong();
+        _song.uri = pair.value;
+    }
+    else if(strcmp(pair.name, "Pos") == 0) {
+        _song.pos = atoi(pair.value);
+    }
+    else if(strcmp(pair.name, "Id") == 0) {
+        _song.id = strtoul(pair.value, NULL, 10);
+    }
+    else if(strcmp(pair.name, "duration") == 0) {
+        _song.duration = (unsigned int)(atof(pair.value) * 1000);
+    }
+    else if((strcmp(pair.name, "Time") == 0) && (_song.duration == 0)) {
+        _song.duration = strtoul(pair.value, NULL, 10) * 1000;
+    }
+    else if((strcmp(pair.name, "Artist") == 0) && (_song.artist == NO_TAG)) {
+        _song.artist = _getTagId(pair.value);
+    }
+    else if((strcmp(pair.name, "Album") == 0) && (_song.album == NO_TAG)) {
+        _song.album = _getTagId(pair.value);
+    }
+}
+
+// the songs after the length were removed
+void MpdQueue::endChanges(unsigned int version, unsigned int length) {
+    _endSong();
+    _startSong();
+    for(unsigned int pos = length; pos < _ids.size(); pos++) {
+        _removeSong(pos);
+    }
+    _ids.resize(length, 0);
+    _uris.resize(length);
+    _durations.resize(length, 0);
+    _artists.resize(length, NO_TAG);
+    _albums.resize(length, NO_TAG);
+    _version = version;
+}
+
+void MpdQueue::clear() {
+    _version = 0;
+    _ids.clear();
+    _uris.clear();
+    _durations.clear();
+    _artists.clear();
+    _albums.clear();
+    _positions.clear();
+    _tagIds.clear();
+    _tags.clear();
+    _tagUses.clear();
+    _freeTags.clear();
+    _startSong();
+}
+
+void MpdQueue::_startSong() {
+    _song.pos = -1;
+    _song.id = 0;
+    _song.uri.clear();
+    _song.duration = 0;
+    _song.artist = NO_TAG;
+    _song.album = NO_TAG;
+}
+
+void MpdQueue::_endSong() {
+    if(_song.pos < 0) {
+        _releaseTag(_song.artist);
+        _releaseTag(_song.album);
+        return;
+    }
+    unsigned int pos = _song.pos;
+    if(pos >= _ids.size()) {
+        _ids.resize(pos + 1, 0);
+        _uris.resize(pos + 1);
+        _durations.resize(pos + 1, 0);
+        _artists.resize(pos + 1, NO_TAG);
+        _albums.resize(pos + 1, NO_TAG);
+    }
+    else {
+        _removeSong(pos);
+    }
+    _ids[pos] = _song.id;
+    _uris[pos].swap(_song.uri);
+    _durations[pos] = _song.duration;
+    _artists[pos] = _song.artist;
+    _albums[pos] = _song.album;
+    _positions[_song.id] = pos;
+}
+
+// the song replaced or cut from a position leaves its id and its tags
+void MpdQueue::_removeSong(unsigned int pos) {
+    if(_getPosition(_ids[pos]) == (int)pos) {
+        _positions.erase(_ids[pos]);
+    }
+    _releaseTag(_artists[pos]);
+    _releaseTag(_albums[pos]);
+    _artists[pos] = NO_TAG;
+    _albums[pos] = NO_TAG;
+}
+
+unsigned int MpdQueue::_getTagId(const char *name) {
+    std::map<std::string, unsigned int>::iterator found = _tagIds.find(name);
+    if(found != _tagIds.end()) {
+        ++_tagUses[found->second];
+        return found->second;
+    }
+    unsigned int tagId;
+    if(!_freeTags.empty()) {
+        tagId = _freeTags.back();
+        _freeTags.pop_back();
+        _tags[tagId] = name;
+        _tagUses[tagId] = 1;
+    }
+    else {
+        tagId = _tags.size();
+        _tags.push_back(name);
+        _tagUses.push_back(1);
+    }
+    _tagIds[name] = tagId;
+    return tagId;
+}
+
+void MpdQueue::_releaseTag(unsigned int tagId) {
+    if((tagId == NO_TAG) || (--_tagUses[tagId] > 0)) {
+        return;
+    }
+    _tagIds.erase(_tags[tagId]);
+    _tags[tagId].clear();
+    _freeTags.push_back(tagId);
+}
@@ -0,0 +1,65 @@
+#ifndef _MPD_QUEUE_HPP
+#define _MPD_QUEUE_HPP
+
+#include <mpd/pair.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// mirror of the MPD queue, in compact arrays by position, so the navigation is decided
+// without asking MPD. It is kept current with the answers of "plchanges <version>",
+// which give only the songs moved or added since the version mirrored.
+// The artists and albums are stored as ids of a table of their names. Not thread safe.
+class MpdQueue {
+    public:
+        static const unsigned int NO_TAG = (unsigned int)-1;
+
+        MpdQueue();
+
+        unsigned int getVersion() const; // of MPD, 0 when nothing is mirrored
+        unsigned int getLength() const;
+        unsigned int getId(unsigned int pos) const;
+        const std::string& getUri(unsigned int pos) const;
+
+        // a plchanges answer is fed between begin and end, end gets the version
+        // and the length of the status asked in the same command list
+        void beginChanges();
+        void feed(const mpd_pair&);
+        void endChanges(unsigned int version, unsigned int length);
+        void clear(); // the next changes will be the whole queue
+
+    protected:
+        // the song being read from the answer
+        struct Song {
+            int pos;
+            unsigned int id;
+            std::string uri;
+            unsigned int duration;
+            unsigned int artist;
+            unsigned int album;
+        };
+
+        unsigned int _version;
+        std::vector<unsigned int> _ids;
+        std::vector<std::string> _uris;
+        std::vector<unsigned int> _durations; // msec, 0 when unknown
+        std::vector<unsigned int> _artists;
+        std::vector<unsigned int> _albums;
+        std::unordered_map<unsigned int, unsigned int> _positions; // by id
+        std::map<std::string, unsigned int> _tagIds;
+        std::vector<std::string> _tags;
+        std::vector<unsigned int> _tagUses; // songs of a tag, its id is free at 0
+        std::vector<unsigned int> _freeTags;
+        Song _song;
+
+        int _getPosition(unsigned int id) const; // -1 when not in the queue
+        void _startSong();
+        void _endSong();
+        void _removeSong(unsigned int pos);
+        unsigned int _getTagId(const char *name);
+        void _releaseTag(unsigned int tagId);
+};
+
+#endif // _MPD_QUEUE_HPP
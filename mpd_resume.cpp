@@ -0,0 +1,112 @@
+#include "mpd_resume.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.hpp"
+#include "checksum.hpp"
+
+#define RESUME_MAGIC        "CARPIPB2"
+#define BOOT_ID_PATH        "/proc/sys/kernel/random/boot_id"
+#define FILE_MODE           (S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)
+
+const unsigned int MpdPlayback::MAX_URI;
+
+MpdResume::MpdResume() {
+    _fd = -1;
+    _data = NULL;
+    _last = -1;
+    memset(_bootId, 0, sizeof(_bootId));
+    int fd = ::open(BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+    if(fd != -1) {
+        //the newline is dropped
+        ssize_t length = read(fd, _bootId, sizeof(_bootId) - 1);
+        if((length > 0) && (_bootId[length - 1] == '\n')) {
+            _bootId[length - 1] = 0;
+        }
+        ::close(fd);
+    }
+}
+
+MpdResume::~MpdResume() {
+    close();
+}
+
+bool MpdResume::open(const char *path) {
+    close();
+    _fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, FILE_MODE);
+    if(_fd == -1) {
+        log(LOG_ERR, "unable to open %s: %s", path, strerror(errno));
+        return false;
+    }
+    if(ftruncate(_fd, sizeof(Data)) != 0) {
+        log(LOG_ERR, "unable to size %s: %s", path, strerror(errno));
+        close();
+        return false;
+    }
+    void *data = mmap(NULL, sizeof(Data), PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if(data == MAP_FAILED) {
+        log(LOG_ERR, "unable to map %s: %s", path, strerror(errno));
+        close();
+        return false;
+    }
+    _data = (Data*)data;
+    if(memcmp(_data->magic, RESUME_MAGIC, 8) != 0) {
+        memset(_data, 0, sizeof(Data));
+        memcpy(_data->magic, RESUME_MAGIC, 8);
+    }
+    for(int i = 0; i < 2; i++) {
+        if(_isValid(_data->slots[i]) && ((_last == -1) || (_data->slots[i].sequence > _data->slots[_last].sequence))) {
+            _last = i;
+        }
+    }
+    return true;
+}
+
+void MpdResume::close() {
+    if(_data != NULL) {
+        munmap(_data, sizeof(Data));
+    }
+    if(_fd != -1) {
+        ::close(_fd);
+    }
+    _data = NULL;
+    _fd = -1;
+    _last = -1;
+}
+
+bool MpdResume::getPrevious(MpdPlayback &playback) const {
+    if((_last == -1) || (strncmp(_data->slots[_last].bootId, _bootId, sizeof(_bootId)) == 0)) {
+        return false;
+    }
+    playback = _data->slots[_last].playback;
+    return true;
+}
+
+// the older slot is replaced, the newer one stays valid until the page is written back.
+// The write back is left to the kernel, a sync would stall the main loop at each status
+void MpdResume::save(const MpdPlayback &playback) {
+    if(_data == NULL) {
+        return;
+    }
+    uint64_t sequence = (_last == -1) ? 1 : _data->slots[_last].sequence + 1;
+    int index = (_last == -1) ? 0 : 1 - _last;
+    Slot &slot = _data->slots[index];
+    slot.sequence = sequence;
+    memcpy(slot.bootId, _bootId, sizeof(_bootId));
+    slot.playback = playback;
+    slot.checksum = Checksum::hash(&slot, offsetof(Slot, checksum));
+    if(msync(_data, sizeof(Data), MS_ASYNC) != 0) {
+        log(LOG_ERR, "unable to save the mpd playback: %s", strerror(errno));
+    }
+    _last = index;
+}
+
+bool MpdResume::_isValid(const Slot &slot) const {
+    return (slot.sequence != 0) && (slot.checksum == Checksum::hash(&slot, offsetof(Slot, checksum)));
+}
@@ -0,0 +1,55 @@
+#ifndef _MPD_RESUME_HPP
+#define _MPD_RESUME_HPP
+
+#include <stdint.h>
+
+// what MPD was playing, as saved for the next boot. The song is known by its position and
+// URI: MPD numbers the songs again when it loads its queue at boot
+struct MpdPlayback {
+    static const unsigned int MAX_URI = 1012; // the record fills 1 KB
+
+    uint32_t pos;
+    uint32_t elapsed; // msec
+    uint32_t state; // mpd_state
+    char uri[MAX_URI]; // "" when too long, the song is then not resumed
+};
+
+// the playback saved in a tiny file mapped in memory, which survives a power cut: the
+// file holds two slots written in turn, each with a sequence number and a checksum, so
+// a torn write leaves the previous slot valid. Each save is scheduled for write back at
+// once, MPD writes its own state file too lazily for a car.
+// A slot records the boot it was written in: the daemon restarted in the same boot
+// finds MPD still playing, and must not send it back in time.
+class MpdResume {
+    public:
+        MpdResume();
+        ~MpdResume();
+
+        bool open(const char *path);
+        void close();
+        // the playback saved by a previous boot, false if none
+        bool getPrevious(MpdPlayback&) const;
+        void save(const MpdPlayback&);
+
+    protected:
+        struct Slot {
+            uint64_t sequence; // 0 for an empty slot
+            char bootId[40];
+            MpdPlayback playback;
+            uint64_t checksum; // of what precedes
+        };
+
+        struct Data {
+            char magic[8];
+            Slot slots[2];
+        };
+
+        int _fd;
+        Data *_data;
+        char _bootId[40];
+        int _last; // slot last written, -1 if none is valid
+
+        bool _isValid(const Slot&) const;
+};
+
+#endif // _MPD_RESUME_HPP
@@ -0,0 +1,219 @@
+#include "volume_index.hpp"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "log.hpp"
+#include "checksum.hpp"
+#include "ingest_job.hpp"
+
+#define INDEX_MAGIC         "CARPIVI1"
+#define MIN_CAPACITY        1024
+#define FILE_MODE           (S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)
+
+VolumeIndex::VolumeIndex() {
+    _fd = -1;
+    _readOnly = false;
+    _data = NULL;
+    _dataSize = 0;
+    _header = NULL;
+    _entries = NULL;
+    _count = 0;
+}
+
+VolumeIndex::~VolumeIndex() {
+    close();
+}
+
+bool VolumeIndex::open(const std::string &path, bool readOnly) {
+    close();
+    _path = path;
+    _readOnly = readOnly;
+    _fd = ::open(path.c_str(), readOnly ? (O_RDONLY | O_CLOEXEC) : (O_RDWR | O_CREAT | O_CLOEXEC), FILE_MODE);
+    if(_fd == -1) {
+        if(!readOnly || (errno != ENOENT)) {
+            log(LOG_ERR, "unable to open %s: %s", path.c_str(), strerror(errno));
+        }
+        return false;
+    }
+    struct stat info;
+    if(fstat(_fd, &info) != 0) {
+        log(LOG_ERR, "unable to stat %s: %s", path.c_str(), strerror(errno));
+        close();
+        return false;
+    }
+
+    bool valid = false;
+    if((size_t)info.st_size >= sizeof(Header)) {
+        Header header;
+        if((pread(_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)) && (memcmp(header.magic, INDEX_MAGIC, 8) == 0) &&
+            (header.capacity >= MIN_CAPACITY) && ((header.capacity & (header.capacity - 1)) == 0) &&
+            ((size_t)info.st_size == _getFileSize(header.capacity))) {
+            valid = _map(header.capacity);
+        }
+    }
+    if(!valid) {
+        if(info.st_size != 0) {
+            log(LOG_ERR, "%s is invalid, it is reset", path.c_str());
+        }
+        if(readOnly || !_init(MIN_CAPACITY)) {
+            close();
+            return false;
+        }
+    }
+
+    //the count is not stored, so an interrupted update can not make it wrong
+    _count = 0;
+    for(uint32_t i = 0; i < _header->capacity; i++) {
+        if(_entries[i].pathHash != 0) {
+            ++_count;
+        }
+    }
+    return true;
+}
+
+void VolumeIndex::close() {
+    _unmap();
+    if(_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _count = 0;
+}
+
+bool VolumeIndex::isOpen() const {
+    return _header != NULL;
+}
+
+bool VolumeIndex::sync() {
+    if((_data == NULL) || _readOnly) {
+        return true;
+    }
+    if(msync(_data, _dataSize, MS_SYNC) != 0) {
+        log(LOG_ERR, "unable to sync %s: %s", _path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool VolumeIndex::isCurrent(const IngestFile &file, bool checkInode) const {
+    if(_header == NULL) {
+        return false;
+    }
+    const Entry *entry = _find(_hashPath(file.path));
+    return (entry->pathHash != 0) && (entry->size == file.size) && (entry->mtime == (int64_t)file.mtime) &&
+        (!checkInode || (entry->inode == (uint64_t)file.inode));
+}
+
+bool VolumeIndex::set(const IngestFile &file) {
+    if((_header == NULL) || _readOnly) {
+        return false;
+    }
+    uint64_t pathHash = _hashPath(file.path);
+    Entry *entry = _find(pathHash);
+    if(entry->pathHash == 0) {
+        //keep a quarter of the table empty, so the probes stay short
+        if(((_count + 1) * 4 > _header->capacity * 3) && !_grow()) {
+            return false;
+        }
+        entry = _find(pathHash);
+        ++_count;
+    }
+    //the hash is written last, an interrupted update leaves an empty entry
+    entry->size = file.size;
+    entry->mtime = file.mtime;
+    entry->inode = file.inode;
+    entry->pathHash = pathHash;
+    return true;
+}
+
+std::string VolumeIndex::getPath(const std::string &root, const IngestVolume &volume) {
+    return root + "/" INGEST_STATE_DIR "/volume-" + (volume.uuid.empty() ? volume.label : volume.uuid) + ".idx";
+}
+
+bool VolumeIndex::_init(uint32_t capacity) {
+    _unmap();
+    if((ftruncate(_fd, 0) != 0) || (ftruncate(_fd, _getFileSize(capacity)) != 0)) {
+        log(LOG_ERR, "unable to resize %s: %s", _path.c_str(), strerror(errno));
+        return false;
+    }
+    if(!_map(capacity)) {
+        return false;
+    }
+    memcpy(_header->magic, INDEX_MAGIC, 8);
+    _header->capacity = capacity;
+    return true;
+}
+
+bool VolumeIndex::_map(uint32_t capacity) {
+    _dataSize = _getFileSize(capacity);
+    _data = mmap(NULL, _dataSize, _readOnly ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, _fd, 0);
+    if(_data == MAP_FAILED) {
+        log(LOG_ERR, "unable to map %s: %s", _path.c_str(), strerror(errno));
+        _data = NULL;
+        _dataSize = 0;
+        return false;
+    }
+    _header = (Header*)_data;
+    _entries = (Entry*)((char*)_data + sizeof(Header));
+    return true;
+}
+
+void VolumeIndex::_unmap() {
+    if(_data != NULL) {
+        munmap(_data, _dataSize);
+    }
+    _data = NULL;
+    _dataSize = 0;
+    _header = NULL;
+    _entries = NULL;
+}
+
+// the bigger table is written aside, then replaces the current one
+bool VolumeIndex::_grow() {
+    std::string path = _path;
+    std::string tmpPath = path + ".tmp";
+    VolumeIndex bigger;
+    unlink(tmpPath.c_str());
+    if(!bigger.open(tmpPath) || !bigger._init(_header->capacity * 2)) {
+        return false;
+    }
+    for(uint32_t i = 0; i < _header->capacity; i++) {
+        if(_entries[i].pathHash != 0) {
+            *bigger._find(_entries[i].pathHash) = _entries[i];
+        }
+    }
+    bool success = bigger.sync() && (fsync(bigger._fd) == 0);
+    bigger.close();
+    if(!success || (rename(tmpPath.c_str(), path.c_str()) != 0)) {
+        log(LOG_ERR, "unable to grow %s: %s", path.c_str(), strerror(errno));
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    return open(path);
+}
+
+// linear probing, returns the entry of the hash or the empty entry where it belongs
+VolumeIndex::Entry* VolumeIndex::_find(uint64_t pathHash) const {
+    uint32_t mask = _header->capacity - 1;
+    uint32_t i = (uint32_t)pathHash & mask;
+    while((_entries[i].pathHash != 0) && (_entries[i].pathHash != pathHash)) {
+        i = (i + 1) & mask;
+    }
+    return &_entries[i];
+}
+
+// paths are stored as their 64 bits hash, a collision is very unlikely for the files of one volume
+uint64_t VolumeIndex::_hashPath(const std::string &path) {
+    uint64_t hash = Checksum::hash(path.data(), path.size());
+    return (hash == 0) ? 1 : hash; // 0 means empty
+}
+
+size_t VolumeIndex::_getFileSize(uint32_t capacity) {
+    return sizeof(Header) + (size_t)capacity * sizeof(Entry);
+}
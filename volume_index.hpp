@@ -0,0 +1,65 @@
+#ifndef _VOLUME_INDEX_HPP
+#define _VOLUME_INDEX_HPP
+
+#include <stdint.h>
+#include <string>
+
+struct IngestFile;
+struct IngestVolume;
+
+// the files of a volume already copied on the big disk, by path, with the
+// size, mtime and inode they had on the volume.
+// The file is an open addressing hash table, mapped in memory at once and
+// updated in place, so checking tens of thousands of files costs no I/O.
+class VolumeIndex {
+    public:
+        VolumeIndex();
+        ~VolumeIndex();
+
+        // create the index if needed, unless readOnly
+        bool open(const std::string &path, bool readOnly = false);
+        void close();
+        bool isOpen() const;
+        // write the changes to the disk
+        bool sync();
+
+        // was the file copied, and did not change since ?
+        bool isCurrent(const IngestFile&, bool checkInode) const;
+        bool set(const IngestFile&);
+
+        // path of the index of a volume on the big disk
+        static std::string getPath(const std::string &root, const IngestVolume&);
+
+    protected:
+        struct Header {
+            char magic[8];
+            uint32_t capacity; // power of 2
+            uint32_t reserved[13];
+        };
+
+        struct Entry {
+            uint64_t pathHash; // 0 for an empty entry
+            uint64_t size;
+            int64_t mtime;
+            uint64_t inode;
+        };
+
+        std::string _path;
+        int _fd;
+        bool _readOnly;
+        void *_data;
+        size_t _dataSize;
+        Header *_header;
+        Entry *_entries;
+        uint32_t _count;
+
+        bool _init(uint32_t capacity);
+        bool _map(uint32_t capacity);
+        void _unmap();
+        bool _grow();
+        Entry* _find(uint64_t pathHash) const;
+        static uint64_t _hashPath(const std::string &path);
+        static size_t _getFileSize(uint32_t capacity);
+};
+
+#endif // _VOLUME_INDEX_HPP